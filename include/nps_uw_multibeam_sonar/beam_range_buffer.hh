@@ -0,0 +1,101 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+#include <complex>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Cache line size the buffer allocations are aligned to
+  /// [bytes]. Only the start of each view is aligned, rows follow at
+  /// their natural stride.
+  const size_t bufferAlignment = 64;
+
+  /// \brief Contiguous nBeams x nRanges complex result of a sonar
+  /// calculation. The buffer is owned by the caller and reused across
+  /// frames; memory is only reallocated when the shape changes.
+  ///
+  /// The engines write the beam-major view, where the range series of
+  /// each beam is contiguous. UpdateRangeMajor() fills the range-major
+  /// view, where the beams of each range bin are contiguous, so that
+  /// consumers serializing range by range can stream over it linearly.
+  class BeamRangeBuffer
+  {
+    /// \brief Constructor
+    public: BeamRangeBuffer() = default;
+
+    /// \brief Destructor
+    public: ~BeamRangeBuffer();
+
+    /// \brief Not copyable, the buffer is meant to be reused in place
+    public: BeamRangeBuffer(const BeamRangeBuffer &) = delete;
+    public: BeamRangeBuffer &operator=(const BeamRangeBuffer &) = delete;
+
+    /// \brief Set the shape, keeping the allocation if it is unchanged
+    /// \param[in] _nBeams Number of beams
+    /// \param[in] _nRanges Number of range bins of each beam
+    public: void Resize(int _nBeams, int _nRanges);
+
+    /// \brief Number of beams
+    public: int Beams() const { return this->nBeams; }
+
+    /// \brief Number of range bins of each beam
+    public: int Ranges() const { return this->nRanges; }
+
+    /// \brief Range series of a beam (beam-major view)
+    /// \param[in] _beam Beam index
+    /// \return Pointer to Ranges() contiguous samples
+    public: std::complex<float> *Beam(int _beam)
+            { return this->beamMajor + static_cast<size_t>(_beam) * this->nRanges; }
+    public: const std::complex<float> *Beam(int _beam) const
+            { return this->beamMajor + static_cast<size_t>(_beam) * this->nRanges; }
+
+    /// \brief Sample of a beam at a range bin (beam-major view)
+    public: std::complex<float> &operator()(int _beam, int _range)
+            { return this->Beam(_beam)[_range]; }
+    public: const std::complex<float> &operator()(int _beam, int _range) const
+            { return this->Beam(_beam)[_range]; }
+
+    /// \brief Beams of a range bin (range-major view), valid after
+    /// UpdateRangeMajor()
+    /// \param[in] _range Range bin index
+    /// \return Pointer to Beams() contiguous samples
+    public: const std::complex<float> *Range(int _range) const
+            { return this->rangeMajor + static_cast<size_t>(_range) * this->nBeams; }
+
+    /// \brief Refresh the range-major view from the beam-major view
+    public: void UpdateRangeMajor();
+
+    /// \brief Release the allocations
+    private: void Free();
+
+    /// \brief Number of beams
+    private: int nBeams = 0;
+
+    /// \brief Number of range bins of each beam
+    private: int nRanges = 0;
+
+    /// \brief Beam-major samples, [beam * nRanges + range]
+    private: std::complex<float> *beamMajor = nullptr;
+
+    /// \brief Range-major samples, [range * nBeams + beam]
+    private: std::complex<float> *rangeMajor = nullptr;
+  };
+}  // namespace NpsGazeboSonar
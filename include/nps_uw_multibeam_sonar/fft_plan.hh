@@ -0,0 +1,95 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stddef.h>
+
+#include <complex>
+#include <utility>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Double precision working type of the CPU FFT
+  typedef std::complex<double> ComplexD;
+
+  /// \brief Planned unnormalized forward FFT of one length on the CPU,
+  /// with the same sign convention as cuFFT CUFFT_FORWARD.
+  ///
+  /// Everything that only depends on the length is computed once in
+  /// Configure(): the bit reversal permutation and twiddle factors of the
+  /// radix-2 stages and, for lengths that are not a power of two (nFreq
+  /// = ceil(bandwidth/delta_f) rarely is), the Bluestein chirp and the
+  /// spectrum of its convolution kernel. A transform then costs two
+  /// radix-2 FFTs and no trigonometric calls.
+  class FftPlan
+  {
+    /// \brief Set the transform length, keeping the tables if it is
+    /// unchanged
+    /// \param[in] _n Number of samples of each transform
+    public: void Configure(int _n);
+
+    /// \brief Transform length
+    public: int Size() const { return this->n; }
+
+    /// \brief Number of workspace elements a single Forward() needs
+    public: size_t WorkSize() const;
+
+    /// \brief Transform one sequence in place
+    /// \param[in,out] _data Size() samples
+    /// \param[in] _scale Factor applied to the result
+    /// \param[in] _work At least WorkSize() elements of scratch memory
+    public: void Forward(std::complex<float> *_data, float _scale,
+                         ComplexD *_work) const;
+
+    /// \brief Transform a batch of sequences in place, in parallel
+    /// (the CPU counterpart of a cufftPlanMany plan)
+    /// \param[in,out] _data First sample of the first sequence
+    /// \param[in] _batch Number of sequences
+    /// \param[in] _dist Distance between the starts of two sequences
+    /// \param[in] _scale Factor applied to the result
+    public: void ForwardMany(std::complex<float> *_data, int _batch,
+                             size_t _dist, float _scale);
+
+    /// \brief In-place radix-2 FFT of length m with the planned tables
+    /// \param[in] _inverse Use conjugate twiddles (unnormalized inverse)
+    private: void Radix2(ComplexD *_data, bool _inverse) const;
+
+    /// \brief Transform length
+    private: int n = 0;
+
+    /// \brief Radix-2 length, n itself or the Bluestein convolution size
+    private: int m = 0;
+
+    /// \brief Bit reversal permutation of m points, swap pairs only
+    private: std::vector<std::pair<int, int>> bitReversal;
+
+    /// \brief exp(-i*2*pi*k/m), k < m/2
+    private: std::vector<ComplexD> twiddles;
+
+    /// \brief Bluestein chirp exp(-i*pi*k^2/n), k < n
+    private: std::vector<ComplexD> chirp;
+
+    /// \brief Spectrum of the conjugate chirp kernel, divided by m for
+    /// the inverse transform
+    private: std::vector<ComplexD> kernelSpectrum;
+
+    /// \brief Workspace of each thread used by ForwardMany()
+    private: std::vector<std::vector<ComplexD>> workspaces;
+  };
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,231 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <omp.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Two stage pipeline over a fixed ring of frames, so that the
+  /// first stage of frame N+1 overlaps the second stage of frame N.
+  ///
+  /// The producer thread runs the first stage: it takes a free frame with
+  /// Acquire(), fills it and hands it over with Submit(). The pipeline's
+  /// own thread runs the second stage on the submitted frames in order
+  /// and then returns them to the free list. With a depth of D, at most
+  /// D frames are in flight; Acquire() blocks once they all are, which
+  /// holds the producer back to the rate of the second stage.
+  ///
+  /// With a depth above 1 the two stages run at the same time, and the
+  /// OpenMP regions of both would each start a team of all the threads
+  /// of the host. The pipeline instead splits the threads between the
+  /// two stages. Each stage gets a share in proportion to its measured
+  /// work (wall time times threads, averaged over the last frames), so
+  /// that the slower stage gets the larger share. The team size is set
+  /// on the producer thread by Acquire() and on the second stage thread
+  /// before each frame. With a depth of 1 the stages alternate and both
+  /// use all the threads.
+  template <typename Frame>
+  class FramePipeline
+  {
+    /// \brief Clock of the stage work
+    public: typedef std::chrono::steady_clock Clock;
+
+    /// \brief Constructor, starts the second stage thread
+    /// \param[in] _depth Number of frames in flight, at least 1
+    /// \param[in] _stage Second stage, called once per submitted frame
+    public: FramePipeline(size_t _depth, std::function<void(Frame &)> _stage)
+            : stage(_stage), threads(omp_get_max_threads())
+    {
+      _depth = _depth > 0 ? _depth : 1;
+      for (size_t i = 0; i < _depth; i++)
+      {
+        this->frames.emplace_back(new Frame());
+        this->freeFrames.push_back(this->frames.back().get());
+      }
+      this->thread = std::thread(&FramePipeline::Run, this);
+    }
+
+    /// \brief Destructor, stops the second stage thread. Frames still
+    /// waiting for the second stage are dropped.
+    public: ~FramePipeline()
+    {
+      this->Stop();
+    }
+
+    /// \brief Take a free frame for the first stage, waiting for one
+    /// while all frames are in flight. Sets the OpenMP team size of the
+    /// calling thread for the first stage of the frame.
+    /// \return The frame, or nullptr once the pipeline is stopped
+    public: Frame *Acquire()
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->condition.wait(lock, [this]
+          {return this->stopped || !this->freeFrames.empty();});
+      if (this->stopped)
+        return nullptr;
+      Frame *frame = this->freeFrames.back();
+      this->freeFrames.pop_back();
+      this->firstThreads = this->StageThreads(0);
+      this->firstStart = Clock::now();
+      lock.unlock();
+      omp_set_num_threads(this->firstThreads);
+      return frame;
+    }
+
+    /// \brief Queue a frame from Acquire() for the second stage
+    /// \param[in] _frame The filled frame
+    public: void Submit(Frame *_frame)
+    {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->Account(0, this->firstStart, this->firstThreads);
+        this->readyFrames.push_back(_frame);
+      }
+      this->condition.notify_all();
+    }
+
+    /// \brief Number of frames the pipeline holds
+    public: size_t Depth() const
+    {
+      return this->frames.size();
+    }
+
+    /// \brief Number of frames taken by Acquire() and not yet returned
+    public: size_t InFlight()
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      return this->frames.size() - this->freeFrames.size();
+    }
+
+    /// \brief Stop the second stage thread and wake up a waiting producer
+    public: void Stop()
+    {
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopped = true;
+      }
+      this->condition.notify_all();
+      if (this->thread.joinable())
+        this->thread.join();
+    }
+
+    /// \brief Second stage loop
+    private: void Run()
+    {
+      pthread_setname_np(pthread_self(), "sonar_pipeline");
+      std::unique_lock<std::mutex> lock(this->mutex);
+      while (true)
+      {
+        this->condition.wait(lock, [this]
+            {return this->stopped || !this->readyFrames.empty();});
+        if (this->stopped)
+          return;
+        Frame *frame = this->readyFrames.front();
+        this->readyFrames.pop_front();
+        const int secondThreads = this->StageThreads(1);
+        const Clock::time_point secondStart = Clock::now();
+
+        lock.unlock();
+        omp_set_num_threads(secondThreads);
+        this->stage(*frame);
+        lock.lock();
+
+        this->Account(1, secondStart, secondThreads);
+        this->freeFrames.push_back(frame);
+        this->condition.notify_all();
+      }
+    }
+
+    /// \brief Split of the threads, called with the mutex held
+    /// \param[in] _stage 0 for the first stage, 1 for the second
+    /// \return Team size of the stage
+    private: int StageThreads(int _stage) const
+    {
+      if (this->frames.size() < 2 || this->threads < 2)
+        return this->threads;
+      int second = this->threads / 2;
+      if (this->work[0] > 0.0 && this->work[1] > 0.0)
+        second = static_cast<int>(std::lround(this->threads * this->work[1]
+                                              / (this->work[0] + this->work[1])));
+      second = std::max(1, std::min(this->threads - 1, second));
+      return _stage == 0 ? this->threads - second : second;
+    }
+
+    /// \brief Add the work of one frame of a stage to its running
+    /// average, called with the mutex held
+    /// \param[in] _stage 0 for the first stage, 1 for the second
+    /// \param[in] _start Start of the frame in the stage
+    /// \param[in] _threads Team size the stage ran with
+    private: void Account(int _stage, Clock::time_point _start, int _threads)
+    {
+      const double sample = std::chrono::duration<double>(
+        Clock::now() - _start).count() * _threads;
+      double &average = this->work[_stage];
+      average = average > 0.0 ? 0.75 * average + 0.25 * sample : sample;
+    }
+
+    /// \brief Second stage
+    private: std::function<void(Frame &)> stage;
+
+    /// \brief OpenMP threads of the host, split between the stages
+    private: int threads;
+
+    /// \brief Average work of a frame in each stage [thread seconds]
+    private: double work[2] = {0.0, 0.0};
+
+    /// \brief Start and team size of the frame in the first stage
+    private: Clock::time_point firstStart;
+    private: int firstThreads = 1;
+
+    /// \brief Frames in flight, never moved once created
+    private: std::vector<std::unique_ptr<Frame>> frames;
+
+    /// \brief Frames available to Acquire()
+    private: std::vector<Frame *> freeFrames;
+
+    /// \brief Submitted frames, in order
+    private: std::deque<Frame *> readyFrames;
+
+    /// \brief Protects the frame lists and the stop flag
+    private: std::mutex mutex;
+
+    /// \brief Signals a free frame, a submitted frame or a stop
+    private: std::condition_variable condition;
+
+    /// \brief Set by Stop()
+    private: bool stopped = false;
+
+    /// \brief Second stage thread
+    private: std::thread thread;
+  };
+}  // namespace NpsGazeboSonar
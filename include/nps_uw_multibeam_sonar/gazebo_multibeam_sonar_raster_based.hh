@@ -31,6 +31,7 @@
 #include <std_msgs/Float64.h>
 #include <image_transport/image_transport.h>
 #include <acoustic_msgs/SonarImage.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 
 // dynamic reconfigure stuff
 #include <gazebo_plugins/GazeboRosCameraConfig.h>
@@ -40,14 +41,23 @@
 #include <gazebo_plugins/gazebo_ros_camera_utils.h>
 
 // boost stuff
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 #include <opencv2/core.hpp>
+#include <atomic>
 #include <complex>
 #include <valarray>
+#include <memory>
 #include <sstream>
 #include <chrono>
+#include <map>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 // gazebo stuff
 #include <sdf/Param.hh>
@@ -63,13 +73,18 @@
 #include <gazebo/rendering/Scene.hh>
 #include <gazebo/rendering/Visual.hh>
 #include "selection_buffer/SelectionBuffer.hh"
+#include <nps_uw_multibeam_sonar/frame_pipeline.hh>
+#include <nps_uw_multibeam_sonar/reflectivity_database.hh>
+#include <nps_uw_multibeam_sonar/sonar_diagnostics.hh>
+#include <nps_uw_multibeam_sonar/sonar_engine.hh>
+#include <nps_uw_multibeam_sonar/sonar_pipeline.hh>
+#include <nps_uw_multibeam_sonar/stage_latencies.hh>
+#include <nps_uw_multibeam_sonar/trace_recorder.hh>
 
 
 namespace gazebo
 {
   typedef std::complex<float> Complex;
-  typedef std::valarray<Complex> CArray;
-  typedef std::valarray<CArray> CArray2D;
 
   typedef std::valarray<float> Array;
   typedef std::valarray<Array> Array2D;
@@ -90,6 +105,33 @@ namespace gazebo
     /// \brief Helper function to fill the list of fiducials with all models
     /// in the world if none are specified
     private: void PopulateFiducials();
+
+    /// \brief Reflectivity of a visual at a reflectivity update
+    private: struct VisualReflectivity
+    {
+      /// \brief Id of the root visual
+      uint32_t id;
+
+      /// \brief Reflectivity of the visual
+      float reflectivity;
+
+      /// \brief True if it differs from the previous update
+      bool changed;
+    };
+
+    /// \brief Index of the reflectivity of the visual an entity belongs
+    /// to, for the variational reflectivity. The reflectivity of each
+    /// visual is looked up once per update and appended to a table.
+    /// \param[in] _entity Entity seen by a pixel
+    /// \param[in] _visible Fiducials visible within the frustum
+    /// \param[in,out] _indices Index of each visual looked up so far
+    /// \param[in,out] _visuals Reflectivity of each index
+    /// \return Index into _visuals, -1 if the entity is not part of a
+    /// visible fiducial or the database does not list it
+    private: int VisualIndex(Ogre::Entity *_entity,
+                             const std::set<rendering::VisualPtr> &_visible,
+                             std::map<rendering::VisualPtr, int> &_indices,
+                             std::vector<VisualReflectivity> &_visuals);
     // From FiducialCameraPlugin
     /// \brief Selection buffer used for occlusion detection
     public: std::unique_ptr<rendering::SelectionBuffer> selectionBuffer;
@@ -120,13 +162,112 @@ namespace gazebo
                                             unsigned int _depth,
                                             const std::string &_format);
 
-    /// \brief Compute a normal texture and implement sonar model
-    private: void ComputeSonarImage(const float *_src);
+    /// \brief Depth frame handed from the rendering thread to the sonar
+    /// worker
+    private: struct DepthFrame
+    {
+      /// \brief Depth of each pixel, preallocated for the image size
+      std::vector<float> depth;
+
+      /// \brief Simulation time of the frame
+      common::Time stamp;
+
+      /// \brief Outputs with subscribers, the point cloud is always
+      /// computed
+      NpsGazeboSonar::SonarOutputs outputs;
+    };
+
+    /// \brief Sonar worker loop, processes the latest pending frame
+    private: void SonarWorker();
+
+    /// \brief Frame slots: at most one is pending, one is being processed
+    /// by the worker and the callback writes to the remaining one
+    private: DepthFrame depthFrames[3];
+
+    /// \brief Slot waiting for the worker, -1 if none
+    private: int pendingFrame = -1;
+
+    /// \brief Slot being processed by the worker, -1 if none
+    private: int workingFrame = -1;
+
+    /// \brief Pending frames replaced by a newer one before processing
+    private: uint64_t droppedFrames = 0;
+
+    /// \brief Dropped frames already reported by the debug output
+    private: uint64_t loggedDroppedFrames = 0;
+
+    /// \brief Set on destruction to end the worker
+    private: bool stopWorker = false;
+
+    /// \brief Protects the slot indices and the stop flag
+    private: boost::mutex frameMutex;
+
+    /// \brief Signals the worker about a pending frame or the stop flag
+    private: boost::condition_variable frameCondition;
+
+    /// \brief Sonar worker thread
+    private: boost::thread sonarWorkerThread;
+
+    /// \brief Sonar frame between the worker, which computes the beam
+    /// spectra, and the publisher thread, which transforms and publishes
+    private: struct SonarFrame
+    {
+      /// \brief Beam spectra, then time series, reused across frames
+      NpsGazeboSonar::BeamRangeBuffer P_Beams;
+
+      /// \brief Depth and normal images the frame was computed from
+      cv::Mat depth_image;
+      cv::Mat normal_image;
+
+      /// \brief Simulation time of the frame
+      common::Time stamp;
+
+      /// \brief Outputs with subscribers when the frame was taken
+      NpsGazeboSonar::SonarOutputs outputs;
+
+      /// \brief Wall time the frame calculation started
+      NpsGazeboSonar::StageLatencies::Clock::time_point start;
+
+      /// \brief Wall time of the worker stage
+      std::chrono::microseconds calcTime;
+    };
+
+    /// \brief Sonar frames in flight, the publisher thread runs the
+    /// second stage of one frame while the worker computes the next
+    private: std::unique_ptr<NpsGazeboSonar::FramePipeline<SonarFrame>>
+             sonarPipeline;
+
+    /// \brief Number of sonar frames in flight
+    private: int pipelineDepth;
+
+    /// \brief Compute a normal texture and the beam spectra of a frame
+    private: void ComputeSonarImage(SonarFrame &_frame);
+
+    /// \brief Publish the outputs of a frame that have subscribers
+    private: void PublishSonarImage(SonarFrame &_frame);
+
+    /// \brief Range FFT of a frame, then its CSV log, raw and fan images
+    private: void PublishBeams(SonarFrame &_frame);
+
+    /// \brief Rolling latency of each stage over the last 10 s
+    private: NpsGazeboSonar::StageLatencies stageLatencies;
+
+    /// \brief Sensor id in the trace recorder, -1 if tracing is off
+    private: int traceSensor = -1;
+
+    /// \brief Publish the stage latencies and frame counters
+    private: void PublishDiagnostics(const ros::WallTimerEvent &_event);
+
+    /// \brief Diagnostics publisher and its 1 Hz timer
+    private: ros::Publisher diagnostics_pub_;
+    private: ros::WallTimer diagnosticsTimer;
+
+    /// \brief Compute the range image of a depth frame, and the point
+    /// cloud if it has subscribers
     private: void ComputePointCloud(const float *_src);
     private: double ComputeIncidence(double azimuth,
                                      double elevation,
                                      cv::Vec3f normal);
-    private: cv::Mat ComputeNormalImage(cv::Mat& depth);
     private: void ComputeCorrector();
     private: cv::Mat rand_image;
 
@@ -149,15 +290,110 @@ namespace gazebo
     private: std::string reflectivityDatabaseFilePath;
     private: std::string customTagDatabaseFileName;
     private: std::string customTagDatabaseFilePath;
-    private: std::vector<std::string> objectNames;
-    private: std::vector<float> reflectivities;
+    /// \brief Reflectivity of each object, or of each material and the
+    /// surface coefficients with custom SDF tags
+    private: NpsGazeboSonar::ReflectivityDatabase reflectivityDatabase;
+
+    /// \brief Reflectivity of a model resolved from its custom SDF tags
+    private: struct SurfaceReflectivity
+    {
+      /// \brief SDF the tags were read from
+      sdf::ElementPtr sdf;
+
+      /// \brief True if the database lists the material of the model
+      bool listed = false;
+
+      /// \brief Reflectivity of the model
+      float reflectivity = 0.0;
+    };
+
+    /// \brief Reflectivity of a model from its custom SDF tags, resolved
+    /// on first use and kept until models are added or deleted or the
+    /// model gets a new SDF
+    /// \param[in] _model Model name
+    /// \param[out] _reflectivity Reflectivity of the model
+    /// \return False if the model or its material is unknown
+    private: bool ModelSurfaceReflectivity(const std::string &_model,
+                                           float &_reflectivity);
+
+    /// \brief Resolved custom SDF tag reflectivity of each model
+    private: std::unordered_map<std::string, SurfaceReflectivity>
+             surfaceReflectivities;
+
+    /// \brief Set from the world thread when models are added or
+    /// deleted, clears the surface reflectivities on their next use
+    private: std::atomic<bool> surfaceReflectivitiesStale{false};
+
+    /// \brief Model insertion and deletion events
+    private: event::ConnectionPtr addEntityConnection;
+    private: event::ConnectionPtr deleteEntityConnection;
     private: double biofouling_rating_coeff;
     private: double roughness_coeff;
-    private: double maxDepth, maxDepth_before, maxDepth_beforebefore;
-    private: double maxDepth_prev;
     private: bool calculateReflectivity;
+
+    /// \brief Sensor pose (id 0) and model poses by model id
+    private: typedef std::vector<std::pair<uint32_t, ignition::math::Pose3d>>
+             ScenePoses;
+
+    /// \brief True once the sensor, a model or the range image changed
+    /// beyond the tolerances since the last time it returned true and
+    /// has then stayed still for changeFrames frames. Costs a pass over
+    /// the models and a sparse sample of the range image.
+    private: bool SceneChanged();
+
+    /// \brief True if the poses or the range image samples differ from
+    /// the last ones beyond the tolerances
+    /// \param[in] _poses Sensor and model poses
+    /// \param[in] _grid Range image samples [m]
+    /// \param[in] _lastPoses Sensor and model poses to compare against
+    /// \param[in] _lastGrid Range image samples to compare against [m]
+    private: bool SceneDiffers(const ScenePoses &_poses,
+                 const std::vector<float> &_grid,
+                 const ScenePoses &_lastPoses,
+                 const std::vector<float> &_lastGrid) const;
+
+    /// \brief Poses at the last scene change
+    private: ScenePoses scenePoses;
+
+    /// \brief Range image samples at the last scene change [m]
+    private: std::vector<float> sceneGrid;
+
+    /// \brief Poses and range image samples of the previous frame
+    private: ScenePoses framePoses;
+    private: std::vector<float> frameGrid;
+
+    /// \brief Frames in a row the scene has stayed still, up to
+    /// changeFrames
+    private: int sceneStillFrames = 0;
+
+    /// \brief Motion that counts as a scene change [m] and [rad]
+    private: double changePositionTolerance;
+    private: double changeAngleTolerance;
+
+    /// \brief Range change of a range image sample that counts as a
+    /// scene change, relative to the range, on top of the position
+    /// tolerance
+    private: double changeRangeTolerance;
+
+    /// \brief Frames the scene must stay still after a change before
+    /// it counts
+    private: int changeFrames;
     private: bool artificialVehicleVibration;
     private: cv::Mat reflectivityImage;
+
+    /// \brief Reflectivity image updated in place by the variational
+    /// reflectivity, copied to reflectivityImage when it changes
+    private: cv::Mat reflectivityWork;
+
+    /// \brief Root visual id seen by each pixel of reflectivityWork at
+    /// the last update, column by column of the selection frame
+    private: std::vector<uint32_t> reflectivityVisualIds;
+
+    /// \brief Reflectivity of each root visual id at the last update
+    private: std::unordered_map<uint32_t, float> lastVisualReflectivities;
+
+    /// \brief Pixels written by the last reflectivity update
+    private: std::atomic<int64_t> reflectivityDirtyPixels{0};
     private: float* rangeVector;
     private: float* window;
     private: float** beamCorrector;
@@ -171,8 +407,28 @@ namespace gazebo
     private: int ray_nAzimuthRays;
     private: int ray_nElevationRays;
     private: float* elevation_angles;
+
+    /// \brief Ray angles and tangents of the point cloud
+    private: NpsGazeboSonar::RayAngleTable rayAngles;
+
     private: float plotScaler;
     private: float sensorGain;
+    /// \brief Sonar calculation backend, "gpu" (CUDA) or "cpu"
+    private: std::string computeBackend;
+    /// \brief Sonar calculation mode, "spectral" (per ray spectrum and FFT)
+    /// or "timedomain" (direct range bin deposit)
+    private: std::string calculationMode;
+    /// \brief Half width of the time domain deposit kernel [bins]
+    private: int kernelHalfWidth;
+    /// \brief Hamming window on the time domain deposit, off to match
+    /// the spectral mode
+    private: bool timeDomainWindow;
+    /// \brief Truncation tolerance of the beam corrector, 0 for the full matrix
+    private: double correctorTolerance;
+    /// \brief Samples of the range table of the scattering amplitude
+    private: int rangeTableSize;
+    /// \brief Sonar calculation engine, created in Load()
+    private: std::unique_ptr<NpsGazeboSonar::SonarEngine> sonarEngine;
     protected: bool debugFlag;
 
     /// \brief CSV log writing stream for verifications
@@ -185,7 +441,9 @@ namespace gazebo
     /// \brief Keep track of number of connctions for plugin outputs
     private: int depth_image_connect_count_;
     private: int depth_info_connect_count_;
+    private: int normal_image_connect_count_;
     private: int point_cloud_connect_count_;
+    private: int sonar_image_raw_connect_count_;
     private: int sonar_image_connect_count_;
     private: void DepthImageConnect();
     private: void DepthImageDisconnect();
@@ -195,6 +453,16 @@ namespace gazebo
     private: void NormalImageDisconnect();
     private: void PointCloudConnect();
     private: void PointCloudDisconnect();
+    private: void SonarImageRawConnect();
+    private: void SonarImageRawDisconnect();
+    private: void SonarImageConnect();
+    private: void SonarImageDisconnect();
+
+    /// \brief Outputs of the next frame, from the connection counts
+    private: NpsGazeboSonar::SonarOutputs SubscribedOutputs() const;
+
+    /// \brief True if any plugin output has a subscriber
+    private: bool HasSubscribers() const;
     private: common::Time last_depth_image_camera_info_update_time_;
 
     /// \brief A pointer to the ROS node.
@@ -207,7 +475,9 @@ namespace gazebo
 
     private: sensor_msgs::Image depth_image_msg_;
     private: sensor_msgs::Image normal_image_msg_;
-    private: sensor_msgs::PointCloud2 point_cloud_msg_;
+    /// \brief Point cloud, published by pointer and reused while no
+    /// subscriber holds on to it
+    private: sensor_msgs::PointCloud2Ptr point_cloud_msg_;
     private: acoustic_msgs::SonarImage sonar_image_raw_msg_;
     private: sensor_msgs::Image sonar_image_msg_;
     private: sensor_msgs::Image sonar_image_mono_msg_;
@@ -224,6 +494,7 @@ namespace gazebo
     private: std::string point_cloud_topic_name_;
     private: std::string sonar_image_raw_topic_name_;
     private: std::string sonar_image_topic_name_;
+    private: std::string diagnostics_topic_name_;
 
     private: double point_cloud_cutoff_;
 
@@ -25,6 +25,7 @@
 #include <string>
 #include <complex>
 #include <valarray>
+#include <memory>
 #include <sstream>
 #include <chrono>
 
@@ -55,6 +56,7 @@
 #include <std_msgs/Float64.h>
 #include <image_transport/image_transport.h>
 #include <acoustic_msgs/SonarImage.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 
 // dynamic reconfigure stuff
 #include <gazebo_plugins/GazeboRosCameraConfig.h>
@@ -71,13 +73,17 @@
 #include <gazebo/rendering/Scene.hh>
 #include <gazebo/rendering/Visual.hh>
 #include "selection_buffer/SelectionBuffer.hh"
+#include <nps_uw_multibeam_sonar/frame_pipeline.hh>
+#include <nps_uw_multibeam_sonar/sonar_diagnostics.hh>
+#include <nps_uw_multibeam_sonar/sonar_engine.hh>
+#include <nps_uw_multibeam_sonar/sonar_pipeline.hh>
+#include <nps_uw_multibeam_sonar/stage_latencies.hh>
+#include <nps_uw_multibeam_sonar/trace_recorder.hh>
 
 
 namespace gazebo
 {
   typedef std::complex<float> Complex;
-  typedef std::valarray<Complex> CArray;
-  typedef std::valarray<CArray> CArray2D;
 
   typedef std::valarray<float> Array;
   typedef std::valarray<Array> Array2D;
@@ -117,16 +123,81 @@ namespace gazebo
 
     /// \brief Keep track of number of connctions for plugin outputs
     private: int point_cloud_connect_count_;
+    private: int normal_image_connect_count_;
+    private: int sonar_image_raw_connect_count_;
     private: int sonar_image_connect_count_;
     private: void PointCloudConnect();
     private: void PointCloudDisconnect();
+    private: void NormalImageConnect();
+    private: void NormalImageDisconnect();
+    private: void SonarImageRawConnect();
+    private: void SonarImageRawDisconnect();
     private: void SonarImageConnect();
     private: void SonarImageDisconnect();
 
+    /// \brief Outputs of the next frame, from the connection counts
+    private: NpsGazeboSonar::SonarOutputs SubscribedOutputs() const;
+
+    /// \brief True if any plugin output has a subscriber
+    private: bool HasSubscribers() const;
+
+    /// \brief Sonar frame between the laser callback, which computes the
+    /// beam spectra, and the publisher thread, which transforms and
+    /// publishes
+    private: struct SonarFrame
+    {
+      /// \brief Beam spectra, then time series, reused across frames
+      NpsGazeboSonar::BeamRangeBuffer P_Beams;
+
+      /// \brief Depth and normal images the frame was computed from
+      cv::Mat depth_image;
+      cv::Mat normal_image;
+
+      /// \brief Simulation time of the frame
+      common::Time stamp;
+
+      /// \brief Outputs with subscribers when the frame was taken
+      NpsGazeboSonar::SonarOutputs outputs;
+
+      /// \brief Wall time the frame calculation started
+      NpsGazeboSonar::StageLatencies::Clock::time_point start;
+
+      /// \brief Wall time of the first stage
+      std::chrono::microseconds calcTime;
+    };
+
+    /// \brief Sonar frames in flight, the publisher thread runs the
+    /// second stage of one frame while the callback computes the next
+    private: std::unique_ptr<NpsGazeboSonar::FramePipeline<SonarFrame>>
+             sonarPipeline;
+
+    /// \brief Number of sonar frames in flight
+    private: int pipelineDepth;
+
     /// \brief Compute a normal texture and implement sonar model
     private: void UpdatePointCloud(const sensor_msgs::PointCloud2ConstPtr& _msg);
-    private: void ComputeSonarImage();
-    private: cv::Mat ComputeNormalImage(cv::Mat& depth);
+
+    /// \brief Compute a normal texture and the beam spectra of a frame
+    private: void ComputeSonarImage(SonarFrame &_frame);
+
+    /// \brief Publish the outputs of a frame that have subscribers
+    private: void PublishSonarImage(SonarFrame &_frame);
+
+    /// \brief Range FFT of a frame, then its CSV log, raw and fan images
+    private: void PublishBeams(SonarFrame &_frame);
+
+    /// \brief Rolling latency of each stage over the last 10 s
+    private: NpsGazeboSonar::StageLatencies stageLatencies;
+
+    /// \brief Sensor id in the trace recorder, -1 if tracing is off
+    private: int traceSensor = -1;
+
+    /// \brief Publish the stage latencies and frame counters
+    private: void PublishDiagnostics(const ros::WallTimerEvent &_event);
+
+    /// \brief Diagnostics publisher and its 1 Hz timer
+    private: ros::Publisher diagnostics_pub_;
+    private: ros::WallTimer diagnosticsTimer;
     private: double point_cloud_cutoff_;
 
     private: void ComputeCorrector();
@@ -162,6 +233,22 @@ namespace gazebo
     private: int ray_nElevationRays;
     private: float plotScaler;
     private: float sensorGain;
+    /// \brief Sonar calculation backend, "gpu" (CUDA) or "cpu"
+    private: std::string computeBackend;
+    /// \brief Sonar calculation mode, "spectral" (per ray spectrum and FFT)
+    /// or "timedomain" (direct range bin deposit)
+    private: std::string calculationMode;
+    /// \brief Half width of the time domain deposit kernel [bins]
+    private: int kernelHalfWidth;
+    /// \brief Hamming window on the time domain deposit, off to match
+    /// the spectral mode
+    private: bool timeDomainWindow;
+    /// \brief Truncation tolerance of the beam corrector, 0 for the full matrix
+    private: double correctorTolerance;
+    /// \brief Samples of the range table of the scattering amplitude
+    private: int rangeTableSize;
+    /// \brief Sonar calculation engine, created in Load()
+    private: std::unique_ptr<NpsGazeboSonar::SonarEngine> sonarEngine;
     protected: bool debugFlag;
 
     /// \brief A pointer to the ROS node.
@@ -191,6 +278,7 @@ namespace gazebo
     private: std::string point_cloud_topic_name_;
     private: std::string sonar_image_raw_topic_name_;
     private: std::string sonar_image_topic_name_;
+    private: std::string diagnostics_topic_name_;
 
     /// \brief CSV log writing stream for verifications
     protected: std::ofstream writeLog;
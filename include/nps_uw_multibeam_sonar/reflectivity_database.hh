@@ -0,0 +1,91 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Reflectivity database of the variational reflectivity.
+  ///
+  /// The source is a CSV file of name,reflectivity rows after three
+  /// header lines. Names are object (visual) names, or material names and
+  /// coefficients in custom SDF tag mode. compile_reflectivity_catalog
+  /// compiles it offline into a binary catalog: a versioned header, the
+  /// entries sorted by name, an open addressing hash table over them and
+  /// the names. A catalog is memory mapped read-only and shared by all
+  /// databases of the process that load the same file, so large catalogs
+  /// are neither parsed nor copied at startup. CSV files still load, they
+  /// are compiled in memory.
+  class ReflectivityDatabase
+  {
+    /// \brief Catalog magic, also tells a catalog from a CSV file
+    public: static const char catalogMagic[8];
+
+    /// \brief Catalog layout version
+    public: static const uint32_t catalogVersion = 1;
+
+    /// \brief Load a catalog or a CSV file, replacing the current entries
+    /// \param[in] _path Catalog or CSV file
+    /// \param[out] _errors Problems found, one per line. Rows of a CSV
+    /// file with errors are skipped.
+    /// \return False if the file could not be loaded or had errors
+    public: bool Load(const std::string &_path, std::string &_errors);
+
+    /// \brief Compile a CSV file into a catalog image. A name listed more
+    /// than once keeps its last reflectivity.
+    /// \param[in] _csvPath CSV file
+    /// \param[out] _image The catalog, as written to a file
+    /// \param[out] _errors Problems found, one per line, with the line
+    /// number. Rows with errors are left out of the image.
+    /// \return False if the file could not be read or had errors
+    public: static bool Compile(const std::string &_csvPath,
+                                std::vector<char> &_image,
+                                std::string &_errors);
+
+    /// \brief Id of a name
+    /// \param[in] _name Object, material or coefficient name
+    /// \return Id for Reflectivity(), -1 if the name is not listed
+    public: int Find(const std::string &_name) const;
+
+    /// \brief Reflectivity of an id from Find()
+    public: float Reflectivity(int _id) const;
+
+    /// \brief Number of distinct names
+    public: size_t Size() const;
+
+    /// \brief Loaded catalog, mapped or compiled in memory
+    private: struct Catalog;
+
+    /// \brief Map a catalog file, or share the mapping of a database
+    /// that loaded it before
+    /// \param[in] _path Catalog file
+    /// \param[out] _catalog The catalog
+    /// \return Empty on success, else the problem
+    private: static std::string MapCatalog(const std::string &_path,
+                 std::shared_ptr<const Catalog> &_catalog);
+
+    /// \brief Catalog of the entries, null before Load()
+    private: std::shared_ptr<const Catalog> catalog;
+  };
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <complex>
+#include <vector>
+
+#include <nps_uw_multibeam_sonar/fft_plan.hh>
+#include <nps_uw_multibeam_sonar/sonar_engine.hh>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Number of worker threads used by the CPU sonar calculation
+  int cpu_thread_count(void);
+
+  /// \brief Multi-threaded CPU sonar engine, for hosts without a CUDA
+  /// device. Produces the same output as the CUDA engine.
+  class SonarEngineCpu : public SonarEngine
+  {
+    /// \brief Scattering, ray summation and beam culling correction
+    public: virtual void ComputeSpectrum(const cv::Mat &_depth_image,
+                                         const cv::Mat &_normal_image,
+                                         const cv::Mat &_rand_image,
+                                         const cv::Mat &_reflectivity_image,
+                                         BeamRangeBuffer &_P_Beams) override;
+
+    /// \brief Batched range FFT of the beam spectra
+    public: virtual void Transform(BeamRangeBuffer &_P_Beams) override;
+
+    /// \brief (Re)allocate the working memory for the current config
+    protected: virtual void Allocate() override;
+
+    /// \brief Scale the new beam corrector into row-major order
+    protected: virtual void UpdateBeamCorrector() override;
+
+    /// \brief Nothing to do, the range table is read from the base class
+    protected: virtual void UpdateRangeTable() override;
+
+    /// \brief Ray summation of each beam, nBeams x nFreq, stored as
+    /// separate real and imaginary parts for vectorization
+    private: std::vector<float> P_Beams_F_real;
+    private: std::vector<float> P_Beams_F_imag;
+
+    /// \brief Normalized beam corrector, [beam * nBeams + beam_other]
+    private: std::vector<float> beamCorrectorRows;
+
+    /// \brief Batched FFT planned for nFreq samples
+    private: FftPlan fftPlan;
+  };
+} // namespace NpsGazeboSonar
@@ -21,50 +21,215 @@
 #include "cuda_runtime_api.h"
 #include "device_launch_parameters.h"
 #include <thrust/complex.h>
+#include <cufft.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <iostream>
 #include <complex>
+#include <map>
+#include <utility>
 #include <valarray>
 
 #include <opencv2/core.hpp>
 #include <opencv2/core/core.hpp>
 
+#include <nps_uw_multibeam_sonar/sonar_engine.hh>
+
 namespace NpsGazeboSonar
 {
-
-  typedef std::complex<float> Complex;
-  typedef std::valarray<Complex> CArray;
-  typedef std::valarray<CArray> CArray2D;
-
   /// \brief CUDA Device Check Function Wrapper
   void check_cuda_init_wrapper(void);
 
-  /// \brief Sonar Claculation Function Wrapper
-  CArray2D sonar_calculation_wrapper(const cv::Mat &depth_image,
-                                     const cv::Mat &normal_image,
-                                     const cv::Mat &rand_image,
-                                     double _hPixelSize,
-                                     double _vPixelSize,
-                                     double _hFOV,
-                                     double _vFOV,
-                                     double _beam_azimuthAngleWidth,
-                                     double _beam_elevationAngleWidth,
-                                     double _ray_azimuthAngleWidth,
-                                     float *_ray_elevationAngles,
-                                     double _ray_elevationAngleWidth,
-                                     double _soundSpeed,
-                                     double _maxDistance,
-                                     double _sourceLevel,
-                                     int _nBeams, int _nRays,
-                                     int _raySkips,
-                                     double _sonarFreq,
-                                     double _bandwidth,
-                                     int _nFreq,
-                                     const cv::Mat &reflectivity_image,
-                                     double _attenuation,
-                                     float *_window,
-                                     float **_beamCorrector,
-                                     float _beamCorrectorSum,
-                                     bool _debugFlag);
-} // namespace NpsGazeboSonar
\ No newline at end of file
+  /// \brief Device memory that is only reallocated when its size changes
+  template <typename T>
+  class DeviceBuffer
+  {
+    /// \brief Destructor
+    public: ~DeviceBuffer() { this->Free(); }
+
+    /// \brief Make room for _n elements, keeping the allocation if the
+    /// size is unchanged
+    public: void Reserve(size_t _n)
+    {
+      if (_n == this->n)
+        return;
+      this->Free();
+      if (cudaMalloc(reinterpret_cast<void **>(&this->ptr),
+                     _n * sizeof(T)) != cudaSuccess)
+      {
+        fprintf(stderr, "CUDA Malloc Failed (%zu bytes)\n", _n * sizeof(T));
+        exit(EXIT_FAILURE);
+      }
+      this->n = _n;
+    }
+
+    /// \brief Release the allocation
+    public: void Free()
+    {
+      if (this->ptr)
+        cudaFree(this->ptr);
+      this->ptr = nullptr;
+      this->n = 0;
+    }
+
+    /// \brief Size of the allocation in bytes
+    public: size_t Bytes() const { return this->n * sizeof(T); }
+
+    /// \brief Device pointer
+    public: T *ptr = nullptr;
+
+    /// \brief Number of elements
+    public: size_t n = 0;
+  };
+
+  /// \brief Page-locked host memory that is only reallocated when its
+  /// size changes
+  template <typename T>
+  class PinnedBuffer
+  {
+    /// \brief Destructor
+    public: ~PinnedBuffer() { this->Free(); }
+
+    /// \brief Make room for _n elements, keeping the allocation if the
+    /// size is unchanged
+    public: void Reserve(size_t _n)
+    {
+      if (_n == this->n)
+        return;
+      this->Free();
+      if (cudaMallocHost(reinterpret_cast<void **>(&this->ptr),
+                         _n * sizeof(T)) != cudaSuccess)
+      {
+        fprintf(stderr, "CUDA Host Malloc Failed (%zu bytes)\n", _n * sizeof(T));
+        exit(EXIT_FAILURE);
+      }
+      this->n = _n;
+    }
+
+    /// \brief Release the allocation
+    public: void Free()
+    {
+      if (this->ptr)
+        cudaFreeHost(this->ptr);
+      this->ptr = nullptr;
+      this->n = 0;
+    }
+
+    /// \brief Size of the allocation in bytes
+    public: size_t Bytes() const { return this->n * sizeof(T); }
+
+    /// \brief Host pointer
+    public: T *ptr = nullptr;
+
+    /// \brief Number of elements
+    public: size_t n = 0;
+  };
+
+  /// \brief Batched 1D complex-to-complex cuFFT plans, created once per
+  /// (size, batch) and kept until the cache is destroyed. Plan creation
+  /// allocates device memory and is far too slow to repeat every frame.
+  class CufftPlanCache
+  {
+    /// \brief Constructor
+    public: CufftPlanCache() = default;
+
+    /// \brief Destructor, destroys all the plans
+    public: ~CufftPlanCache()
+    {
+      for (auto &plan : this->plans)
+        cufftDestroy(plan.second);
+    }
+
+    /// \brief Plans own device resources and are not copyable
+    public: CufftPlanCache(const CufftPlanCache &) = delete;
+    public: CufftPlanCache &operator=(const CufftPlanCache &) = delete;
+
+    /// \brief Plan of _batch contiguous transforms of _n samples,
+    /// created on the first request
+    public: cufftHandle Get(int _n, int _batch)
+    {
+      const std::pair<int, int> key(_n, _batch);
+      auto it = this->plans.find(key);
+      if (it != this->plans.end())
+        return it->second;
+
+      cufftHandle handle;
+      int n[] = {_n};  // --- Size of the Fourier transform
+      // --- Input/Output size with pitch (ignored for 1D transforms)
+      int inembed[] = {0};
+      int onembed[] = {0};
+      if (cufftPlanMany(&handle, 1, n,
+                        inembed, 1, _n,
+                        onembed, 1, _n, CUFFT_C2C, _batch) != CUFFT_SUCCESS)
+      {
+        fprintf(stderr, "cuFFT Plan Creation Failed (%d x %d)\n", _n, _batch);
+        exit(EXIT_FAILURE);
+      }
+      this->plans.emplace(key, handle);
+      return handle;
+    }
+
+    /// \brief Plans by (size, batch)
+    private: std::map<std::pair<int, int>, cufftHandle> plans;
+  };
+
+  /// \brief CUDA sonar engine
+  class SonarEngineCuda : public SonarEngine
+  {
+    /// \brief Constructor, creates the streams of the two stages
+    public: SonarEngineCuda();
+
+    /// \brief Destructor, destroys the streams
+    public: virtual ~SonarEngineCuda();
+
+    /// \brief Scattering, ray summation and beam culling correction
+    public: virtual void ComputeSpectrum(const cv::Mat &_depth_image,
+                                         const cv::Mat &_normal_image,
+                                         const cv::Mat &_rand_image,
+                                         const cv::Mat &_reflectivity_image,
+                                         BeamRangeBuffer &_P_Beams) override;
+
+    /// \brief Batched cuFFT of the beam spectra, through its own host
+    /// and device buffers
+    public: virtual void Transform(BeamRangeBuffer &_P_Beams) override;
+
+    /// \brief (Re)allocate the working memory for the current config
+    protected: virtual void Allocate() override;
+
+    /// \brief Upload the new beam corrector to the device
+    protected: virtual void UpdateBeamCorrector() override;
+
+    /// \brief Upload the new range table to the device
+    protected: virtual void UpdateRangeTable() override;
+
+    /// \brief Input images on the device, sized by the image bytes
+    private: DeviceBuffer<char> d_depth_image;
+    private: DeviceBuffer<char> d_normal_image;
+    private: DeviceBuffer<char> d_rand_image;
+    private: DeviceBuffer<char> d_reflectivity_image;
+
+    /// \brief Beam spectrum and beam culling correction, nFreq x nBeams
+    private: PinnedBuffer<float> P_Beams_Cor_real_tmp, P_Beams_Cor_imag_tmp;
+    private: DeviceBuffer<float> d_P_Beams_Cor_real, d_P_Beams_Cor_imag;
+    private: DeviceBuffer<float> d_P_Beams_Cor_F_real, d_P_Beams_Cor_F_imag;
+    private: DeviceBuffer<float> d_beamCorrector_lin;
+    private: DeviceBuffer<int> d_correctorBandStart, d_correctorBandEnd;
+
+    /// \brief Range table of the scattering amplitude
+    private: DeviceBuffer<float> d_rangeTable;
+
+    /// \brief Batched FFT input and output, nBeams x nFreq
+    private: PinnedBuffer<float2> hostInputData, hostOutputData;
+    private: DeviceBuffer<float2> deviceInputData, deviceOutputData;
+
+    /// \brief Batched FFT plans, nBeams transforms of nFreq samples
+    private: CufftPlanCache fftPlans;
+
+    /// \brief Streams of ComputeSpectrum() and Transform(). The two
+    /// stages run on different threads for different frames, each only
+    /// waits for its own stream so that their copies and kernels overlap.
+    private: cudaStream_t spectrumStream = nullptr;
+    private: cudaStream_t transformStream = nullptr;
+  };
+} // namespace NpsGazeboSonar
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#include <diagnostic_msgs/DiagnosticStatus.h>
+
+#include <nps_uw_multibeam_sonar/stage_latencies.hh>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Counters of a sonar sensor reported with its latencies
+  struct SonarCounters
+  {
+    /// \brief Frames dropped since the sensor was loaded
+    uint64_t droppedFrames = 0;
+
+    /// \brief Frames in the pipeline right now
+    size_t framesInFlight = 0;
+
+    /// \brief Frames the pipeline holds at most
+    size_t pipelineDepth = 0;
+
+    /// \brief Pixels written by the last variational reflectivity
+    /// update, -1 if the sensor has a constant reflectivity
+    int64_t reflectivityDirtyPixels = -1;
+  };
+
+  /// \brief Fill the diagnostic status of a sonar sensor: p50, p95, p99
+  /// and max of each stage [ms] and the counters. The level is WARN while
+  /// the p95 frame time exceeds the frame budget.
+  /// \param[in] _name Name of the sensor
+  /// \param[in] _hardwareId Frame of the sensor
+  /// \param[in] _latencies Latencies of the sensor stages
+  /// \param[in] _counters Frame counters of the sensor
+  /// \param[in] _frameBudget Update period of the sensor [s], 0 for none
+  /// \param[out] _status The status
+  void FillSonarDiagnostics(const std::string &_name,
+                            const std::string &_hardwareId,
+                            const StageLatencies &_latencies,
+                            const SonarCounters &_counters,
+                            double _frameBudget,
+                            diagnostic_msgs::DiagnosticStatus &_status);
+}  // namespace NpsGazeboSonar
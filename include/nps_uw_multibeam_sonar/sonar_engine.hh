@@ -0,0 +1,280 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <complex>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include <nps_uw_multibeam_sonar/beam_range_buffer.hh>
+
+namespace NpsGazeboSonar
+{
+
+  typedef std::complex<float> Complex;
+
+  /// \brief Number of frequencies between two exactly evaluated phasors
+  /// of the echo spectrum. In between, exp(i*2*d*kw) is synthesized by
+  /// rotating the previous sample by the constant phase step of the ray.
+  /// The anchors reset the drift of the recurrence, which bounds the
+  /// deviation from the exact spectrum to 1e-5 |amplitude| on the GPU
+  /// (float recurrence) and 2e-7 |amplitude| on the CPU (double rotation
+  /// table). The former per sample evaluation in float deviated by up to
+  /// 2*d*kw*2^-23, 1.4e-3 |amplitude| at 120 m range.
+  const int phasorInterval = 32;
+
+  /// \brief Largest half width of the time domain deposit kernel [bins]
+  const int maxKernelHalfWidth = 64;
+
+  /// \brief Hamming window coefficients of the time domain deposit kernel,
+  /// see SonarConfig::timeDomainWindow
+  constexpr double hammingAlpha = 0.54;
+  constexpr double hammingBeta = 0.46;
+
+  /// \brief Sensor configuration a sonar engine is built from
+  struct SonarConfig
+  {
+    /// \brief Number of beams (columns of the depth image)
+    int nBeams = 0;
+
+    /// \brief Number of rays per beam (rows of the depth image)
+    int nRays = 0;
+
+    /// \brief Calculation skips along the rays of a beam
+    int raySkips = 1;
+
+    /// \brief Number of frequencies (equals the number of range bins)
+    int nFreq = 0;
+
+    /// \brief Angular size of one image pixel [rad]
+    double hPixelSize = 0.0;
+    double vPixelSize = 0.0;
+
+    /// \brief Field of view of the image [rad]
+    double hFOV = 0.0;
+    double vFOV = 0.0;
+
+    /// \brief Beam and ray widths [rad]
+    double beamAzimuthAngleWidth = 0.0;
+    double beamElevationAngleWidth = 0.0;
+    double rayAzimuthAngleWidth = 0.0;
+    double rayElevationAngleWidth = 0.0;
+
+    /// \brief Elevation angle of each ray, owned by the plugin
+    float *rayElevationAngles = nullptr;
+
+    /// \brief Acoustic properties
+    double soundSpeed = 1500.0;
+    double maxDistance = 60.0;
+    double sourceLevel = 220.0;
+    double sonarFreq = 900e3;
+    double bandwidth = 29.5e6;
+    double attenuation = 0.0;
+
+    /// \brief Hamming window of nFreq samples, owned by the plugin
+    float *window = nullptr;
+
+    /// \brief Deposit the echo of each ray straight into the range bins
+    /// instead of synthesizing its spectrum and transforming each beam.
+    /// The echo of a ray at delay tau is the transform of the band
+    /// limited spectrum, evaluated over 2 * kernelHalfWidth bins around
+    /// tau * bandwidth.
+    bool timeDomain = false;
+
+    /// \brief Half width of the time domain deposit kernel [bins]. The
+    /// magnitudes differ from the spectral path by about 9% (relative L2)
+    /// at 8, 6% at 16 and 3.5% at 64 on the shipped presets, see
+    /// sonar_benchmark --mode compare.
+    int kernelHalfWidth = 8;
+
+    /// \brief Apply a Hamming window (unit mean) to the spectrum of the
+    /// time domain deposit. The windowed echo decays fast and a short
+    /// kernel reproduces it, but the spectral path applies no window, so
+    /// this changes the image levels. Off, the deposit is the truncated
+    /// echo of the spectral path.
+    bool timeDomainWindow = false;
+
+    /// \brief Truncation of the beam corrector, relative to its largest
+    /// entry. Each beam only sums the contiguous band of beams whose
+    /// corrector is above the tolerance. 0 keeps the full matrix.
+    double correctorTolerance = 0.0;
+
+    /// \brief Samples of the range table over [0, maxDistance], at least 2.
+    /// The scattering reads the attenuation exp(-2 * attenuation * d) of a
+    /// ray from the table with linear interpolation, whose relative error
+    /// is below (2 * attenuation * maxDistance / (rangeTableSize - 1))^2 / 8,
+    /// 5e-7 for 256 samples at 60 m and 0.0354 dB/m, the order of the float
+    /// rounding of the amplitude.
+    int rangeTableSize = 256;
+
+    /// \brief Print computation time of each stage
+    bool debugFlag = false;
+  };
+
+  /// \brief Wall time of the stages of one engine frame [ns].
+  /// Scattering and ray summation are fused in both engines and are
+  /// timed together.
+  struct StageTimes
+  {
+    /// \brief Scattering and ray summation
+    int64_t summation = 0;
+
+    /// \brief Beam culling correction
+    int64_t correction = 0;
+
+    /// \brief Range FFT, 0 in time domain mode
+    int64_t fft = 0;
+  };
+
+  /// \brief Stateful sonar calculation engine.
+  /// An engine is created once per sensor and owns all the working memory
+  /// of the sonar calculation. The memory is reused across frames and only
+  /// reallocated when the geometry or the number of frequencies changes.
+  class SonarEngine
+  {
+    /// \brief Destructor
+    public: virtual ~SonarEngine() = default;
+
+    /// \brief Create an engine for a compute backend
+    /// \param[in] _backend "gpu" (CUDA) or "cpu"
+    /// \param[in] _config Sensor configuration
+    /// \return The engine, or nullptr for an unknown backend or one that
+    /// is not built (see Built())
+    public: static std::unique_ptr<SonarEngine> Create(
+                const std::string &_backend, const SonarConfig &_config);
+
+    /// \brief Whether a compute backend is built in. The gpu backend is
+    /// only built when CUDA is found (NPS_SONAR_WITH_CUDA).
+    /// \param[in] _backend "gpu" (CUDA) or "cpu"
+    /// \return True if Create() can make an engine for the backend
+    public: static bool Built(const std::string &_backend);
+
+    /// \brief Update the sensor configuration. Working memory is only
+    /// reallocated if the geometry or the number of frequencies changed.
+    /// \param[in] _config Sensor configuration
+    public: void Configure(const SonarConfig &_config);
+
+    /// \brief Set the beam culling corrector, precalculated by the plugin
+    /// \param[in] _beamCorrector nBeams x nBeams corrector matrix
+    /// \param[in] _beamCorrectorSum Normalization of the corrector
+    public: void SetBeamCorrector(float **_beamCorrector,
+                                  float _beamCorrectorSum);
+
+    /// \brief Sonar calculation of one frame, ComputeSpectrum() followed
+    /// by Transform()
+    /// \param[in] _depth_image Range of each ray (CV_32FC1)
+    /// \param[in] _normal_image Surface normal of each ray (CV_32FC3)
+    /// \param[in] _rand_image Gaussian noise of each ray (CV_32FC2)
+    /// \param[in] _reflectivity_image Reflectivity of each ray (CV_32FC1)
+    /// \param[out] _P_Beams Time series of each beam (beam-major view),
+    /// resized if required
+    public: void Compute(const cv::Mat &_depth_image,
+                         const cv::Mat &_normal_image,
+                         const cv::Mat &_rand_image,
+                         const cv::Mat &_reflectivity_image,
+                         BeamRangeBuffer &_P_Beams);
+
+    /// \brief First stage of a frame: scattering, ray summation and beam
+    /// culling correction. Leaves the corrected beam spectra in _P_Beams,
+    /// or the final time series in time domain mode.
+    /// \param[in] _depth_image Range of each ray (CV_32FC1)
+    /// \param[in] _normal_image Surface normal of each ray (CV_32FC3)
+    /// \param[in] _rand_image Gaussian noise of each ray (CV_32FC2)
+    /// \param[in] _reflectivity_image Reflectivity of each ray (CV_32FC1)
+    /// \param[out] _P_Beams Spectrum of each beam (beam-major view),
+    /// resized if required
+    public: virtual void ComputeSpectrum(const cv::Mat &_depth_image,
+                                         const cv::Mat &_normal_image,
+                                         const cv::Mat &_rand_image,
+                                         const cv::Mat &_reflectivity_image,
+                                         BeamRangeBuffer &_P_Beams) = 0;
+
+    /// \brief Second stage of a frame: range FFT of each beam, in place.
+    /// Does nothing in time domain mode. The two stages share no working
+    /// memory, so the Transform() of one frame may run on another thread
+    /// while ComputeSpectrum() processes the next one into another buffer.
+    /// \param[in,out] _P_Beams Output of ComputeSpectrum()
+    public: virtual void Transform(BeamRangeBuffer &_P_Beams) = 0;
+
+    /// \brief Get the sensor configuration
+    /// \return The configuration the engine was set up with
+    public: const SonarConfig &Config() const;
+
+    /// \brief Get the stage timing of the last frame
+    /// \return Wall time of each stage of the last frame
+    public: const StageTimes &LastStageTimes() const;
+
+    /// \brief (Re)allocate the working memory for the current config
+    protected: virtual void Allocate() = 0;
+
+    /// \brief Called once a new beam corrector or band is set
+    protected: virtual void UpdateBeamCorrector() = 0;
+
+    /// \brief Called once the range table is rebuilt
+    protected: virtual void UpdateRangeTable() = 0;
+
+    /// \brief Build the range table for the current config
+    private: void BuildRangeTable();
+
+    /// \brief Find the band of each beam for the corrector tolerance
+    private: void UpdateCorrectorBand();
+
+    /// \brief Sensor configuration
+    protected: SonarConfig config;
+
+    /// \brief Beam corrector transposed for the correction matmul,
+    /// element [beam_other * nBeams + beam] = corrector[beam][beam_other]
+    protected: std::vector<float> beamCorrector;
+
+    /// \brief Normalization of the beam corrector
+    protected: float beamCorrectorSum = 0.0;
+
+    /// \brief Band [correctorBandStart, correctorBandEnd) of other beams
+    /// summed into each beam by the correction
+    protected: std::vector<int> correctorBandStart;
+    protected: std::vector<int> correctorBandEnd;
+
+    /// \brief Frequency resolution [Hz]
+    protected: float delta_f = 0.0;
+
+    /// \brief Product of the ray widths
+    protected: float area_scaler = 0.0;
+
+    /// \brief Source term from the source level
+    protected: float sourceTerm = 0.0;
+
+    /// \brief Range factor of the ray amplitude without the spreading,
+    /// sourceTerm * sqrt(area_scaler / 2) * exp(-2 * attenuation * d) at
+    /// d = i / rangeTableScale. The 1/sqrt(2) of the complex noise is
+    /// folded in. The spreading d^-3/2 is singular at the sensor and not
+    /// tabulated.
+    protected: std::vector<float> rangeTable;
+
+    /// \brief Samples of the range table per meter
+    protected: float rangeTableScale = 0.0;
+
+    /// \brief Stage timing of the last frame. ComputeSpectrum() fills in
+    /// summation and correction, Transform() the fft.
+    protected: StageTimes stageTimes;
+  };
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include <nps_uw_multibeam_sonar/beam_range_buffer.hh>
+
+/// \brief Stages of the sonar image pipeline around the engine that do
+/// not depend on Gazebo or ROS, shared by the plugins and the benchmark.
+namespace NpsGazeboSonar
+{
+  /// \brief Outputs of a sonar frame that have a consumer, sampled from
+  /// the subscriber counts when the frame is taken. Only these are built.
+  struct SonarOutputs
+  {
+    /// \brief Raw beam intensities
+    bool raw = false;
+
+    /// \brief Fan shaped sonar image
+    bool fan = false;
+
+    /// \brief Depth image
+    bool depth = false;
+
+    /// \brief Normal image
+    bool normal = false;
+
+    /// \brief CSV log of the beam time series
+    bool log = false;
+
+    /// \brief True if the beam spectra have to be computed
+    bool Spectrum() const
+    {
+      return this->raw || this->fan || this->log;
+    }
+
+    /// \brief True if the frame has any output
+    bool Any() const
+    {
+      return this->Spectrum() || this->depth || this->normal;
+    }
+  };
+
+  /// \brief Ray angles of a depth camera and their tangents, per column
+  /// (azimuth) and per row (elevation). The geometry is fixed once the
+  /// sensor is loaded, the tables are only rebuilt when the resolution or
+  /// the field of view changes.
+  class RayAngleTable
+  {
+    /// \brief Rebuild the tables if the camera geometry changed
+    /// \param[in] _width Number of columns
+    /// \param[in] _height Number of rows
+    /// \param[in] _hFOV Horizontal field of view [rad]
+    /// \return True if the tables were rebuilt
+    public: bool Update(int _width, int _height, double _hFOV);
+
+    /// \brief Azimuth of each column [rad]
+    public: const std::vector<float> &Azimuths() const
+            { return this->azimuths; }
+
+    /// \brief Elevation of each row [rad]
+    public: const std::vector<float> &Elevations() const
+            { return this->elevations; }
+
+    /// \brief Tangent of the azimuth of each column
+    public: const std::vector<double> &TanAzimuths() const
+            { return this->tanAzimuths; }
+
+    /// \brief Tangent of the elevation of each row
+    public: const std::vector<double> &TanElevations() const
+            { return this->tanElevations; }
+
+    /// \brief Geometry the tables were built for
+    private: int width = -1;
+    private: int height = -1;
+    private: double hFOV = 0.0;
+
+    /// \brief Angle tables
+    private: std::vector<float> azimuths;
+    private: std::vector<float> elevations;
+    private: std::vector<double> tanAzimuths;
+    private: std::vector<double> tanElevations;
+  };
+
+  /// \brief Surface normals of a depth image
+  /// \param[in] _depth Range of each ray (CV_32FC1)
+  /// \param[in] _focalLength Focal length of the depth camera [px]
+  /// \return Unit normal of each ray (CV_32FC3)
+  cv::Mat ComputeNormalImage(const cv::Mat &_depth, double _focalLength);
+
+  /// \brief Quantize the beam magnitudes into the raw sonar image
+  /// \param[in] _P_Beams Beam time series, range-major view up to date
+  /// \param[in] _gain Sensor gain applied before saturation
+  /// \param[in] _flipBeams Serialize beams in reverse order
+  /// \param[out] _intensities nRanges x nBeams counts, range-major
+  void QuantizeIntensities(const BeamRangeBuffer &_P_Beams, float _gain,
+                           bool _flipBeams, std::vector<uint8_t> &_intensities);
+
+  /// \brief Render the fan shaped sonar image for display
+  /// \param[in] _P_Beams Beam time series, range-major view up to date
+  /// \param[in] _azimuthAngles Azimuth of each beam [rad]
+  /// \param[in] _ranges Range of each range bin [m]
+  /// \param[in] _rangeMax Largest range shown [m]
+  /// \param[in] _plotScaler Lower end of the normalization, 0 to 10
+  /// \return Colorized image (CV_8UC3, BGR)
+  cv::Mat RenderFanImage(const BeamRangeBuffer &_P_Beams,
+                         const std::vector<float> &_azimuthAngles,
+                         const std::vector<float> &_ranges,
+                         float _rangeMax, float _plotScaler);
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Stages of a sonar frame timed by the plugins
+  enum SonarStage
+  {
+    /// \brief Depth image to point cloud
+    STAGE_POINT_CLOUD,
+
+    /// \brief Wait for a free frame of the pipeline (backpressure)
+    STAGE_PIPELINE_WAIT,
+
+    /// \brief Surface normals
+    STAGE_NORMALS,
+
+    /// \brief Scattering and ray summation
+    STAGE_SUMMATION,
+
+    /// \brief Beam culling correction
+    STAGE_CORRECTION,
+
+    /// \brief Range FFT
+    STAGE_FFT,
+
+    /// \brief Range-major view of the beams
+    STAGE_RANGE_MAJOR,
+
+    /// \brief Raw sonar image, quantized and published
+    STAGE_RAW_IMAGE,
+
+    /// \brief Fan shaped sonar image, rendered and published
+    STAGE_FAN_IMAGE,
+
+    /// \brief Whole frame, from normals to the last publish
+    STAGE_FRAME,
+
+    STAGE_COUNT
+  };
+
+  /// \brief Name of a stage, as used in the diagnostics
+  /// \param[in] _stage The stage
+  /// \return Lower case name
+  const char *StageName(SonarStage _stage);
+
+  /// \brief Histogram of durations with log-linear buckets: 8 buckets per
+  /// power of two, so a percentile is known to within 12.5%. Durations
+  /// below 8 ns have a bucket each.
+  class LatencyHistogram
+  {
+    /// \brief Number of buckets, covers all of int64_t
+    public: static const int bucketCount = 8 + 61 * 8;
+
+    /// \brief Add one duration
+    /// \param[in] _ns Duration [ns]
+    public: void Record(int64_t _ns);
+
+    /// \brief Add all durations of another histogram
+    /// \param[in] _other The other histogram
+    public: void Merge(const LatencyHistogram &_other);
+
+    /// \brief Remove all durations
+    public: void Clear();
+
+    /// \brief Number of durations
+    public: uint64_t Count() const { return this->count; }
+
+    /// \brief Largest duration [ns]
+    public: int64_t Max() const { return this->max; }
+
+    /// \brief Duration below which a fraction of the durations fall
+    /// \param[in] _q Fraction, 0 to 1
+    /// \return Upper end of the bucket holding the quantile, at most
+    /// Max() [ns], 0 if empty
+    public: int64_t Percentile(double _q) const;
+
+    /// \brief Bucket of a duration
+    private: static int Bucket(int64_t _ns);
+
+    /// \brief Largest duration of a bucket
+    private: static int64_t BucketUpperBound(int _bucket);
+
+    /// \brief Durations in each bucket
+    private: std::array<uint32_t, bucketCount> counts {};
+
+    /// \brief Number of durations
+    private: uint64_t count = 0;
+
+    /// \brief Largest duration [ns]
+    private: int64_t max = 0;
+  };
+
+  /// \brief Rolling latency statistics of each SonarStage.
+  ///
+  /// Durations go into the histogram of the current interval. Rotate()
+  /// starts a new interval and drops the oldest one, so the statistics
+  /// always cover the last _intervals intervals. Record() may be called
+  /// from any thread; it only takes a lock that is otherwise held by
+  /// Rotate() and Summarize(), once per interval.
+  class StageLatencies
+  {
+    /// \brief Clock the stages are timed with
+    public: typedef std::chrono::steady_clock Clock;
+
+    /// \brief Statistics of one stage over the window
+    public: struct Summary
+    {
+      /// \brief Number of durations
+      uint64_t count = 0;
+
+      /// \brief Percentiles and largest duration [ns]
+      int64_t p50 = 0;
+      int64_t p95 = 0;
+      int64_t p99 = 0;
+      int64_t max = 0;
+    };
+
+    /// \brief Constructor
+    /// \param[in] _intervals Number of intervals in the window
+    public: explicit StageLatencies(int _intervals = 10);
+
+    /// \brief Add a duration of a stage
+    /// \param[in] _stage The stage
+    /// \param[in] _ns Duration [ns]
+    public: void Record(SonarStage _stage, int64_t _ns);
+
+    /// \brief Add the time since _start as a duration of a stage
+    /// \param[in] _stage The stage
+    /// \param[in] _start Start of the stage
+    public: void Record(SonarStage _stage, Clock::time_point _start);
+
+    /// \brief Start a new interval, dropping the oldest one
+    public: void Rotate();
+
+    /// \brief Statistics of each stage over the window
+    /// \return STAGE_COUNT summaries, indexed by SonarStage
+    public: std::vector<Summary> Summarize() const;
+
+    /// \brief Histograms of each interval, [interval][stage]
+    private: std::vector<std::array<LatencyHistogram, STAGE_COUNT>> intervals;
+
+    /// \brief Interval durations are added to
+    private: size_t current = 0;
+
+    /// \brief Protects the histograms
+    private: mutable std::mutex mutex;
+  };
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,208 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  struct StageTimes;
+
+  /// \brief Process wide recorder of spans in the Chrome trace event
+  /// format (JSON array), readable by chrome://tracing and Perfetto.
+  ///
+  /// Each sensor is shown as a process named after the sensor, each
+  /// thread under it with its thread name. A thread records into its own
+  /// single producer ring, without locks; a background thread drains the
+  /// rings every 100 ms into the file. Spans are dropped, and counted,
+  /// when a ring is full. The viewers also load the file if the process
+  /// dies before Stop() writes the closing bracket.
+  class TraceRecorder
+  {
+    /// \brief Get the recorder. The instance is unique in the process
+    /// (GCC makes static locals of inline functions STB_GNU_UNIQUE),
+    /// so the raster and ray based plugin libraries share it.
+    public: static TraceRecorder &Instance()
+    {
+      static TraceRecorder recorder;
+      return recorder;
+    }
+
+    /// \brief Destructor, stops the recorder
+    public: ~TraceRecorder();
+
+    /// \brief Start recording to a file. Only the first call opens a
+    /// file, later calls keep recording to it, whatever their path. Each
+    /// call that returns a file must be matched by a call to Stop().
+    /// \param[in] _path Trace file
+    /// \return The file being recorded to, which differs from _path if
+    /// another file was already open, empty if the file cannot be opened
+    public: std::string Start(const std::string &_path);
+
+    /// \brief Release one Start(). The last one flushes all spans,
+    /// closes the file and stops recording.
+    public: void Stop();
+
+    /// \brief Register a sensor the spans are tagged with
+    /// \param[in] _name Name of the sensor
+    /// \return Sensor id for Record(), -1 if the recorder is not started
+    public: int RegisterSensor(const std::string &_name);
+
+    /// \brief Record a span of the calling thread
+    /// \param[in] _sensor Sensor id, spans of sensor -1 are ignored
+    /// \param[in] _name Name of the span, must be a string literal
+    /// \param[in] _start Start of the span, from Now() [ns]
+    /// \param[in] _end End of the span, from Now() [ns]
+    public: void Record(int _sensor, const char *_name,
+                        int64_t _start, int64_t _end);
+
+    /// \brief Trace clock (steady) [ns]
+    public: static int64_t Now();
+
+    /// \brief Trace file of a sensor plugin: the traceFile SDF element
+    /// if set, else the NPS_SONAR_TRACE environment variable
+    /// \param[in] _sdfPath Value of the SDF element, may be empty
+    /// \return The trace file, empty if tracing is off
+    public: static std::string TraceFile(const std::string &_sdfPath);
+
+    /// \brief One span
+    private: struct Event
+    {
+      const char *name;
+      int sensor;
+      int64_t start;
+      int64_t end;
+    };
+
+    /// \brief Ring of the spans of one thread
+    private: struct ThreadBuffer;
+
+    /// \brief Constructor, not started
+    private: TraceRecorder();
+
+    /// \brief Ring of the calling thread, created on first use
+    private: ThreadBuffer *LocalBuffer();
+
+    /// \brief Background thread, drains the rings into the file
+    private: void Run();
+
+    /// \brief Write the spans of all rings and pending metadata
+    private: void Flush();
+
+    /// \brief Write one JSON event
+    private: void Write(const char *_event);
+
+    /// \brief Flush all spans, close the file and stop recording, called
+    /// with startMutex held
+    private: void Close();
+
+    /// \brief Set while started
+    private: std::atomic<bool> started{false};
+
+    /// \brief Trace file, written by the background thread only
+    private: FILE *file = nullptr;
+
+    /// \brief Path of the trace file
+    private: std::string path;
+
+    /// \brief Start() calls not yet matched by Stop()
+    private: int users = 0;
+
+    /// \brief No event written to the file yet
+    private: bool firstEvent = true;
+
+    /// \brief Registered sensor names, index is the sensor id
+    private: std::vector<std::string> sensors;
+
+    /// \brief Metadata events waiting for the background thread
+    private: std::vector<std::string> metadata;
+
+    /// \brief Rings of all threads that recorded
+    private: std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+    /// \brief Protects everything but the ring contents
+    private: std::mutex mutex;
+
+    /// \brief Serializes Start(), Stop() and the destructor, so that a
+    /// file being closed is not handed to a new user
+    private: std::mutex startMutex;
+
+    /// \brief Wakes up the background thread early to stop
+    private: std::condition_variable condition;
+
+    /// \brief Set by Stop()
+    private: bool stopping = false;
+
+    /// \brief Background thread
+    private: std::thread thread;
+  };
+
+  /// \brief Span of the enclosing scope, recorded on destruction. Costs a
+  /// branch when tracing is off.
+  class TraceSpan
+  {
+    /// \brief Start the span
+    /// \param[in] _sensor Sensor id, -1 if tracing is off
+    /// \param[in] _name Name of the span, must be a string literal
+    public: TraceSpan(int _sensor, const char *_name)
+            : sensor(_sensor), name(_name),
+              start(_sensor >= 0 ? TraceRecorder::Now() : 0)
+    {
+    }
+
+    /// \brief End and record the span
+    public: ~TraceSpan()
+    {
+      if (this->sensor >= 0)
+        TraceRecorder::Instance().Record(this->sensor, this->name,
+                                         this->start, TraceRecorder::Now());
+    }
+
+    /// \brief Not copyable
+    public: TraceSpan(const TraceSpan &) = delete;
+    public: TraceSpan &operator=(const TraceSpan &) = delete;
+
+    /// \brief Sensor id
+    private: int sensor;
+
+    /// \brief Name of the span
+    private: const char *name;
+
+    /// \brief Start of the span [ns]
+    private: int64_t start;
+  };
+
+  /// \brief Record the phases of a sonar engine call that just returned.
+  /// The phases run back to back, so they are laid out backwards from now
+  /// using their measured durations.
+  /// \param[in] _sensor Sensor id, -1 if tracing is off
+  /// \param[in] _times Stage times of the engine
+  /// \param[in] _transform True after Transform() (fft), false after
+  /// ComputeSpectrum() (summation, correction)
+  void TraceEngineStages(int _sensor, const StageTimes &_times,
+                         bool _transform);
+}  // namespace NpsGazeboSonar
@@ -18,8 +18,9 @@
 #ifndef GAZEBO_RENDERING_SELECTIONBUFFER_MATERIALSWITCHER_HH_
 #define GAZEBO_RENDERING_SELECTIONBUFFER_MATERIALSWITCHER_HH_
 
-#include <map>
+#include <stdint.h>
 #include <string>
+#include <vector>
 #include <ignition/math/Color.hh>
 #include "gazebo/rendering/ogre_gazebo.h"
 #include "gazebo/util/system.hh"
@@ -52,6 +53,33 @@ namespace gazebo
       public: const std::string &GetEntityName(
               const ignition::math::Color &_color) const;
 
+      /// \brief Index of the entity with a specific color. Colors are
+      /// handed out in sequence, so the index is the color offset from
+      /// the first one.
+      /// \param[in] _argb The entity's color as read back, the alpha
+      /// channel is ignored.
+      /// \return Index for GetEntity(), -1 if no entity has the color.
+      public: int EntityIndex(uint32_t _argb) const
+      {
+        const int index = static_cast<int>(_argb & 0x00FFFFFF)
+          - static_cast<int>(this->firstColor);
+        return index >= 0 && index < static_cast<int>(this->entities.size())
+          ? index : -1;
+      }
+
+      /// \brief Get the entity of an index from EntityIndex()
+      /// \param[in] _index Entity index.
+      public: Ogre::Entity *GetEntity(int _index) const
+      {
+        return this->entities[_index];
+      }
+
+      /// \brief Number of colors handed out since the last Reset()
+      public: size_t EntityCount() const
+      {
+        return this->entities.size();
+      }
+
       /// \brief Reset the color value incrementor
       public: void Reset();
 
@@ -61,15 +89,18 @@ namespace gazebo
                   Ogre::Material *_originalMaterial, uint16_t _lodIndex,
                   const Ogre::Renderable *_rend);
 
-      // private: typedef std::map<unsigned int, std::string, cmp_color>
-      // ColorMap;
-      private: typedef std::map<unsigned int, std::string> ColorMap;
-      private: typedef ColorMap::const_iterator ColorMapConstIter;
       private: std::string emptyString;
       private: ignition::math::Color currentColor;
-      private: std::string lastEntity;
+      private: const Ogre::Entity *lastEntity = nullptr;
       private: Ogre::Technique *lastTechnique;
-      private: MaterialSwitcher::ColorMap colorDict;
+
+      /// \brief Entity of each color handed out, indexed by the color
+      /// offset from firstColor. An entity rendered again after another
+      /// one gets a new color, so it may be listed more than once.
+      private: std::vector<Ogre::Entity *> entities;
+
+      /// \brief RGB of the first color handed out after Reset()
+      private: uint32_t firstColor = 0;
 
       private: void GetNextColor();
 
@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 #include "gazebo/util/system.hh"
 
 namespace Ogre
@@ -53,6 +54,36 @@ namespace gazebo
       /// \return Returns the Ogre entity at the coordinate.
       public: Ogre::Entity *OnSelectionClick(int _x, int _y);
 
+      /// \brief Render the whole view of the camera into a selection
+      /// texture the size of the render target and read it back once, to
+      /// look up any number of pixels with EntityAt() afterwards.
+      /// \return True if the frame was rendered.
+      public: bool UpdateFrame();
+
+      /// \brief Entity at a pixel of the frame from UpdateFrame()
+      /// \param[in] _x X coordinate in pixels.
+      /// \param[in] _y Y coordinate in pixels.
+      /// \return Returns the Ogre entity at the coordinate, null if there
+      /// is none or the coordinate is outside the frame.
+      public: Ogre::Entity *EntityAt(int _x, int _y) const;
+
+      /// \brief Index of the entity at a pixel of the frame from
+      /// UpdateFrame(). The index is dense, below EntityCount(), so
+      /// callers can keep per entity data in a flat table.
+      /// \param[in] _x X coordinate in pixels.
+      /// \param[in] _y Y coordinate in pixels.
+      /// \return Entity index, -1 if there is no entity or the coordinate
+      /// is outside the frame.
+      public: int EntityIndexAt(int _x, int _y) const;
+
+      /// \brief Entity of an index from EntityIndexAt()
+      /// \param[in] _index Entity index.
+      /// \return Returns the Ogre entity.
+      public: Ogre::Entity *EntityOfIndex(int _index) const;
+
+      /// \brief Number of entity indices of the last rendered frame
+      public: size_t EntityCount() const;
+
       /// \brief Debug show overlay
       /// \param[in] _show True to show the selection buffer in an overlay.
       public: void ShowOverlay(bool _show);
@@ -66,6 +97,15 @@ namespace gazebo
       /// \brief Create the render texture
       private: void CreateRTTBuffer();
 
+      /// \brief Create the full frame render texture
+      /// \param[in] _width Width of the frame in pixels.
+      /// \param[in] _height Height of the frame in pixels.
+      private: void CreateFrameBuffer(unsigned int _width,
+                                      unsigned int _height);
+
+      /// \brief Delete the full frame render texture
+      private: void DeleteFrameBuffer();
+
       /// \brief Create the selection buffer offscreen render texture.
       private: void CreateRTTOverlays();
 
@@ -28,7 +28,7 @@ using namespace rendering;
 MaterialSwitcher::MaterialSwitcher()
 : lastTechnique(nullptr)
 {
-  this->currentColor = ignition::math::Color(0.0, 0.0, 0.1);
+  this->Reset();
 }
 
 /////////////////////////////////////////////////
@@ -57,7 +57,7 @@ Ogre::Technique *MaterialSwitcher::handleSchemeNotFound(
         return nullptr;
       }
 
-      if (this->lastEntity == subEntity->getParent()->getName())
+      if (this->lastEntity == subEntity->getParent())
       {
         const_cast<Ogre::SubEntity *>(subEntity)->setCustomParameter(1,
             Ogre::Vector4(this->currentColor.R(), this->currentColor.G(),
@@ -128,8 +128,8 @@ Ogre::Technique *MaterialSwitcher::handleSchemeNotFound(
             Ogre::Vector4(this->currentColor.R(), this->currentColor.G(),
               this->currentColor.B(), 1.0));
 
-        this->lastEntity = subEntity->getParent()->getName();
-        this->colorDict[this->currentColor.AsRGBA()] = this->lastEntity;
+        this->lastEntity = subEntity->getParent();
+        this->entities.push_back(subEntity->getParent());
       }
 
       return this->lastTechnique;
@@ -149,10 +149,10 @@ Ogre::Technique *MaterialSwitcher::handleSchemeNotFound(
 const std::string &MaterialSwitcher::GetEntityName(
     const ignition::math::Color &_color) const
 {
-  ColorMapConstIter iter = this->colorDict.find(_color.AsRGBA());
+  const int index = this->EntityIndex(_color.AsARGB());
 
-  if (iter != this->colorDict.end())
-    return (*iter).second;
+  if (index >= 0)
+    return this->entities[index]->getName();
   else
     return this->emptyString;
 }
@@ -169,6 +169,9 @@ void MaterialSwitcher::GetNextColor()
 void MaterialSwitcher::Reset()
 {
   this->currentColor = ignition::math::Color(0.0, 0.0, 0.1);
-  this->lastEntity.clear();
-  this->colorDict.clear();
+  this->lastEntity = nullptr;
+  this->entities.clear();
+
+  // GetNextColor() is called before each entity is colored
+  this->firstColor = (this->currentColor.AsARGB() + 1) & 0x00FFFFFF;
 }
@@ -16,6 +16,8 @@
 */
 
 #include <memory>
+#include <string>
+#include <vector>
 #include <ignition/math/Color.hh>
 
 #include "gazebo/common/Console.hh"
@@ -71,10 +73,46 @@ namespace gazebo
       /// \brief A 2D overlay used for debugging the selection buffer. It
       /// is hidden by default.
       Ogre::Overlay *selectionDebugOverlay;
+
+      /// \brief Name of the reference camera
+      std::string cameraName;
+
+      /// \brief Full frame Ogre texture
+      Ogre::TexturePtr frameTexture;
+
+      /// \brief Full frame Ogre render texture
+      Ogre::RenderTexture *frameRenderTexture = nullptr;
+
+      /// \brief Full frame colors, one ARGB word per pixel
+      std::vector<uint32_t> frameBuffer;
+
+      /// \brief Size of the full frame in pixels
+      unsigned int frameWidth = 0;
+      unsigned int frameHeight = 0;
     };
   }
 }
 
+/////////////////////////////////////////////////
+/// \brief Set up the viewport of a selection render texture
+/// \param[in] _renderTexture Render texture
+/// \param[in] _camera Selection camera
+/// \param[in] _listener Listener switching to the selection materials
+static void SetupSelectionViewport(Ogre::RenderTexture *_renderTexture,
+    Ogre::Camera *_camera, Ogre::RenderTargetListener *_listener)
+{
+  _renderTexture->setAutoUpdated(false);
+  _renderTexture->setPriority(0);
+  _renderTexture->addViewport(_camera);
+  _renderTexture->getViewport(0)->setOverlaysEnabled(false);
+  _renderTexture->getViewport(0)->setShadowsEnabled(false);
+  _renderTexture->getViewport(0)->setClearEveryFrame(true);
+  _renderTexture->addListener(_listener);
+  _renderTexture->getViewport(0)->setMaterialScheme("aa");
+  _renderTexture->getViewport(0)->setVisibilityMask(
+      GZ_VISIBILITY_SELECTABLE);
+}
+
 /////////////////////////////////////////////////
 SelectionBuffer::SelectionBuffer(const std::string &_cameraName,
     Ogre::SceneManager *_mgr, Ogre::RenderTarget *_renderTarget)
@@ -82,6 +120,7 @@ SelectionBuffer::SelectionBuffer(const std::string &_cameraName,
 {
   this->dataPtr->sceneMgr = _mgr;
   this->dataPtr->renderTarget = _renderTarget;
+  this->dataPtr->cameraName = _cameraName;
 
   this->dataPtr->camera = this->dataPtr->sceneMgr->getCamera(_cameraName);
 
@@ -99,6 +138,7 @@ SelectionBuffer::SelectionBuffer(const std::string &_cameraName,
 SelectionBuffer::~SelectionBuffer()
 {
   this->DeleteRTTBuffer();
+  this->DeleteFrameBuffer();
 
   // remove selection buffer camera
   this->dataPtr->sceneMgr->destroyCamera(this->dataPtr->selectionCamera);
@@ -166,17 +206,9 @@ void SelectionBuffer::CreateRTTBuffer()
 
   this->dataPtr->renderTexture =
     this->dataPtr->texture->getBuffer()->getRenderTarget();
-  this->dataPtr->renderTexture->setAutoUpdated(false);
-  this->dataPtr->renderTexture->setPriority(0);
-  this->dataPtr->renderTexture->addViewport(this->dataPtr->selectionCamera);
-  this->dataPtr->renderTexture->getViewport(0)->setOverlaysEnabled(false);
-  this->dataPtr->renderTexture->getViewport(0)->setShadowsEnabled(false);
-  this->dataPtr->renderTexture->getViewport(0)->setClearEveryFrame(true);
-  this->dataPtr->renderTexture->addListener(
+  SetupSelectionViewport(this->dataPtr->renderTexture,
+      this->dataPtr->selectionCamera,
       this->dataPtr->selectionTargetListener.get());
-  this->dataPtr->renderTexture->getViewport(0)->setMaterialScheme("aa");
-  this->dataPtr->renderTexture->getViewport(0)->setVisibilityMask(
-      GZ_VISIBILITY_SELECTABLE);
   Ogre::HardwarePixelBufferSharedPtr pixelBuffer =
     this->dataPtr->texture->getBuffer();
   size_t bufferSize = pixelBuffer->getSizeInBytes();
@@ -187,6 +219,126 @@ void SelectionBuffer::CreateRTTBuffer()
       pixelBuffer->getFormat(), this->dataPtr->buffer);
 }
 
+/////////////////////////////////////////////////
+void SelectionBuffer::DeleteFrameBuffer()
+{
+  if (!this->dataPtr->frameTexture.isNull())
+  {
+    Ogre::TextureManager::getSingleton().remove(
+        this->dataPtr->frameTexture->getName());
+    this->dataPtr->frameTexture.setNull();
+  }
+  this->dataPtr->frameRenderTexture = nullptr;
+  this->dataPtr->frameBuffer.clear();
+  this->dataPtr->frameWidth = 0;
+  this->dataPtr->frameHeight = 0;
+}
+
+/////////////////////////////////////////////////
+void SelectionBuffer::CreateFrameBuffer(unsigned int _width,
+    unsigned int _height)
+{
+  this->DeleteFrameBuffer();
+  try
+  {
+    // Unique per camera, each sensor has its own selection buffer
+    this->dataPtr->frameTexture =
+      Ogre::TextureManager::getSingleton().createManual(
+        this->dataPtr->cameraName + "_SelectionFrameTex",
+        Ogre::ResourceGroupManager::DEFAULT_RESOURCE_GROUP_NAME,
+        Ogre::TEX_TYPE_2D, _width, _height, 0, Ogre::PF_R8G8B8,
+        Ogre::TU_RENDERTARGET);
+  }
+  catch(...)
+  {
+    gzerr << "Unable to create full frame selection buffer.\n";
+    return;
+  }
+
+  this->dataPtr->frameRenderTexture =
+    this->dataPtr->frameTexture->getBuffer()->getRenderTarget();
+  SetupSelectionViewport(this->dataPtr->frameRenderTexture,
+      this->dataPtr->selectionCamera,
+      this->dataPtr->selectionTargetListener.get());
+  this->dataPtr->frameBuffer.resize(static_cast<size_t>(_width) * _height);
+  this->dataPtr->frameWidth = _width;
+  this->dataPtr->frameHeight = _height;
+}
+
+/////////////////////////////////////////////////
+bool SelectionBuffer::UpdateFrame()
+{
+  unsigned int targetWidth = this->dataPtr->renderTarget->getWidth();
+  unsigned int targetHeight = this->dataPtr->renderTarget->getHeight();
+  if (targetWidth != this->dataPtr->frameWidth
+      || targetHeight != this->dataPtr->frameHeight)
+    this->CreateFrameBuffer(targetWidth, targetHeight);
+  if (!this->dataPtr->frameRenderTexture)
+    return false;
+
+  // Same view as the reference camera, one texel per pixel
+  this->dataPtr->selectionCamera->setCustomProjectionMatrix(true,
+      this->dataPtr->camera->getProjectionMatrix());
+  this->dataPtr->selectionCamera->setPosition(
+      this->dataPtr->camera->getDerivedPosition());
+  this->dataPtr->selectionCamera->setOrientation(
+      this->dataPtr->camera->getDerivedOrientation());
+
+  this->dataPtr->materialSwitchListener->Reset();
+
+  // See Update() for the deferred rendering workaround
+  try
+  {
+    this->dataPtr->frameRenderTexture->update();
+  }
+  catch(...)
+  {
+  }
+
+  // Read back in one copy, converted to native endian ARGB words
+  Ogre::PixelBox pixelBox(this->dataPtr->frameWidth,
+      this->dataPtr->frameHeight, 1, Ogre::PF_A8R8G8B8,
+      this->dataPtr->frameBuffer.data());
+  this->dataPtr->frameRenderTexture->copyContentsToMemory(pixelBox,
+      Ogre::RenderTarget::FB_FRONT);
+  return true;
+}
+
+/////////////////////////////////////////////////
+Ogre::Entity *SelectionBuffer::EntityAt(int _x, int _y) const
+{
+  const int index = this->EntityIndexAt(_x, _y);
+  if (index < 0)
+    return nullptr;
+  else
+    return this->EntityOfIndex(index);
+}
+
+/////////////////////////////////////////////////
+int SelectionBuffer::EntityIndexAt(int _x, int _y) const
+{
+  if (_x < 0 || _y < 0 || _x >= static_cast<int>(this->dataPtr->frameWidth)
+      || _y >= static_cast<int>(this->dataPtr->frameHeight))
+    return -1;
+
+  // The color of an entity is its index offset from the first color
+  return this->dataPtr->materialSwitchListener->EntityIndex(
+      this->dataPtr->frameBuffer[
+      static_cast<size_t>(_y) * this->dataPtr->frameWidth + _x]);
+}
+
+/////////////////////////////////////////////////
+Ogre::Entity *SelectionBuffer::EntityOfIndex(int _index) const
+{
+  return this->dataPtr->materialSwitchListener->GetEntity(_index);
+}
+
+/////////////////////////////////////////////////
+size_t SelectionBuffer::EntityCount() const
+{
+  return this->dataPtr->materialSwitchListener->EntityCount();
+}
+
 /////////////////////////////////////////////////
 Ogre::Entity *SelectionBuffer::OnSelectionClick(int _x, int _y)
 {
@@ -239,16 +391,13 @@ Ogre::Entity *SelectionBuffer::OnSelectionClick(int _x, int _y)
     return nullptr;
   }
   memcpy(static_cast<void *>(&color), this->dataPtr->buffer + posInStream, 4);
-  ignition::math::Color cv;
-  cv.SetFromARGB(color);
-  cv.A(1.0);
-  const std::string &entName =
-    this->dataPtr->materialSwitchListener->GetEntityName(cv);
+  const int index =
+    this->dataPtr->materialSwitchListener->EntityIndex(color);
 
-  if (entName.empty())
+  if (index < 0)
     return 0;
   else
-    return this->dataPtr->sceneMgr->getEntity(entName);
+    return this->dataPtr->materialSwitchListener->GetEntity(index);
 }
 
 /////////////////////////////////////////////////
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/beam_range_buffer.hh>
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+
+namespace NpsGazeboSonar
+{
+  namespace
+  {
+    ///////////////////////////////////////////////////////////////////////
+    std::complex<float> *aligned_complex(size_t _n)
+    {
+      void *ptr = nullptr;
+      if (posix_memalign(&ptr, bufferAlignment,
+                         std::max<size_t>(_n, 1) * sizeof(std::complex<float>)) != 0)
+        throw std::bad_alloc();
+      return static_cast<std::complex<float> *>(ptr);
+    }
+  }  // namespace
+
+  ///////////////////////////////////////////////////////////////////////////
+  BeamRangeBuffer::~BeamRangeBuffer()
+  {
+    this->Free();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void BeamRangeBuffer::Resize(int _nBeams, int _nRanges)
+  {
+    if (_nBeams == this->nBeams && _nRanges == this->nRanges)
+      return;
+
+    this->Free();
+    const size_t n = static_cast<size_t>(_nBeams) * _nRanges;
+    this->beamMajor = aligned_complex(n);
+    this->rangeMajor = aligned_complex(n);
+    std::fill(this->beamMajor, this->beamMajor + n, std::complex<float>(0.0f, 0.0f));
+    std::fill(this->rangeMajor, this->rangeMajor + n, std::complex<float>(0.0f, 0.0f));
+    this->nBeams = _nBeams;
+    this->nRanges = _nRanges;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void BeamRangeBuffer::UpdateRangeMajor()
+  {
+    // Blocked transpose, one tile of each view stays in cache
+    const int tile = 32;
+    for (int beam0 = 0; beam0 < this->nBeams; beam0 += tile)
+    {
+      const int beamEnd = std::min(beam0 + tile, this->nBeams);
+      for (int range0 = 0; range0 < this->nRanges; range0 += tile)
+      {
+        const int rangeEnd = std::min(range0 + tile, this->nRanges);
+        for (int beam = beam0; beam < beamEnd; beam++)
+        {
+          const std::complex<float> *src = this->Beam(beam);
+          for (int range = range0; range < rangeEnd; range++)
+            this->rangeMajor[static_cast<size_t>(range) * this->nBeams + beam] = src[range];
+        }
+      }
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void BeamRangeBuffer::Free()
+  {
+    free(this->beamMajor);
+    free(this->rangeMajor);
+    this->beamMajor = nullptr;
+    this->rangeMajor = nullptr;
+    this->nBeams = 0;
+    this->nRanges = 0;
+  }
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+
+// Offline compiler of reflectivity databases. Turns a CSV database of the
+// worlds folder into the binary catalog the plugins memory map:
+//
+//   compile_reflectivity_catalog INPUT.csv OUTPUT
+//
+// Fails without writing OUTPUT if a row has errors, so that a broken
+// database is caught here rather than at simulation start.
+
+#include <nps_uw_multibeam_sonar/reflectivity_database.hh>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+  if (argc != 3)
+  {
+    fprintf(stderr, "Usage: %s INPUT.csv OUTPUT\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<char> image;
+  std::string errors;
+  const bool valid =
+    NpsGazeboSonar::ReflectivityDatabase::Compile(argv[1], image, errors);
+  fputs(errors.c_str(), stderr);
+  if (!valid)
+    return EXIT_FAILURE;
+
+  // Written next to the output and renamed, so that a running simulation
+  // mapping the old catalog keeps a consistent file
+  const std::string output = argv[2];
+  const std::string temporary = output + ".tmp";
+  FILE *file = fopen(temporary.c_str(), "wb");
+  if (!file)
+  {
+    perror(temporary.c_str());
+    return EXIT_FAILURE;
+  }
+  const bool written =
+    fwrite(image.data(), 1, image.size(), file) == image.size();
+  if (fclose(file) != 0 || !written
+      || rename(temporary.c_str(), output.c_str()) != 0)
+  {
+    perror(output.c_str());
+    remove(temporary.c_str());
+    return EXIT_FAILURE;
+  }
+
+  NpsGazeboSonar::ReflectivityDatabase database;
+  errors.clear();
+  if (!database.Load(output, errors))
+  {
+    fprintf(stderr, "%s", errors.c_str());
+    return EXIT_FAILURE;
+  }
+  printf("%s: %zu entries, %zu bytes\n", output.c_str(), database.Size(),
+         image.size());
+  return EXIT_SUCCESS;
+}
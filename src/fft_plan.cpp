@@ -0,0 +1,184 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/fft_plan.hh>
+
+#include <omp.h>
+
+#include <math.h>
+
+#include <utility>
+
+namespace NpsGazeboSonar
+{
+  ///////////////////////////////////////////////////////////////////////////
+  void FftPlan::Configure(int _n)
+  {
+    if (_n == this->n)
+      return;
+
+    this->n = _n;
+    if (_n <= 1)
+    {
+      this->m = _n;
+      this->bitReversal.clear();
+      this->twiddles.clear();
+      this->chirp.clear();
+      this->kernelSpectrum.clear();
+      return;
+    }
+
+    // Bluestein convolution length for lengths that are not a power of two
+    const bool powerOfTwo = (_n & (_n - 1)) == 0;
+    this->m = 1;
+    while (this->m < (powerOfTwo ? _n : 2 * _n - 1))
+      this->m <<= 1;
+    const int m = this->m;
+
+    this->bitReversal.clear();
+    for (int i = 1, j = 0; i < m; i++)
+    {
+      int bit = m >> 1;
+      for (; j & bit; bit >>= 1)
+        j ^= bit;
+      j ^= bit;
+      if (i < j)
+        this->bitReversal.emplace_back(i, j);
+    }
+
+    this->twiddles.resize(m / 2);
+    for (int k = 0; k < m / 2; k++)
+    {
+      const double angle = -2.0 * M_PI * k / m;
+      this->twiddles[k] = ComplexD(cos(angle), sin(angle));
+    }
+
+    this->chirp.clear();
+    this->kernelSpectrum.clear();
+    if (powerOfTwo)
+      return;
+
+    // chirp w[k] = exp(-i*pi*k^2/n), k^2 reduced modulo 2n for precision
+    this->chirp.resize(_n);
+    for (int k = 0; k < _n; k++)
+    {
+      const long long k2 = (static_cast<long long>(k) * k) % (2LL * _n);
+      const double angle = -M_PI * static_cast<double>(k2) / _n;
+      this->chirp[k] = ComplexD(cos(angle), sin(angle));
+    }
+
+    // The convolution kernel is the same for every transform
+    this->kernelSpectrum.assign(m, ComplexD(0.0, 0.0));
+    this->kernelSpectrum[0] = std::conj(this->chirp[0]);
+    for (int k = 1; k < _n; k++)
+      this->kernelSpectrum[k] = this->kernelSpectrum[m - k] = std::conj(this->chirp[k]);
+    this->Radix2(this->kernelSpectrum.data(), false);
+    for (auto &value : this->kernelSpectrum)
+      value /= static_cast<double>(m);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t FftPlan::WorkSize() const
+  {
+    return static_cast<size_t>(this->m);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void FftPlan::Radix2(ComplexD *_data, bool _inverse) const
+  {
+    const int m = this->m;
+    for (const auto &swap : this->bitReversal)
+      std::swap(_data[swap.first], _data[swap.second]);
+
+    for (int len = 2; len <= m; len <<= 1)
+    {
+      const int half = len / 2;
+      const int step = m / len;
+      for (int i = 0; i < m; i += len)
+      {
+        for (int j = 0; j < half; j++)
+        {
+          const ComplexD w = _inverse ? std::conj(this->twiddles[j * step])
+                                      : this->twiddles[j * step];
+          const ComplexD u = _data[i + j];
+          const ComplexD v = _data[i + j + half] * w;
+          _data[i + j] = u + v;
+          _data[i + j + half] = u - v;
+        }
+      }
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void FftPlan::Forward(std::complex<float> *_data, float _scale,
+                        ComplexD *_work) const
+  {
+    const int n = this->n;
+    if (n <= 1)
+    {
+      for (int k = 0; k < n; k++)
+        _data[k] *= _scale;
+      return;
+    }
+
+    ComplexD *a = _work;
+    if (this->chirp.empty())
+    {
+      for (int k = 0; k < n; k++)
+        a[k] = ComplexD(_data[k].real(), _data[k].imag());
+      this->Radix2(a, false);
+      for (int k = 0; k < n; k++)
+        _data[k] = std::complex<float>(a[k].real() * _scale, a[k].imag() * _scale);
+      return;
+    }
+
+    // Bluestein: X[k] = w[k] * sum_j (x[j] w[j]) conj(w[k-j])
+    const int m = this->m;
+    for (int k = 0; k < n; k++)
+      a[k] = ComplexD(_data[k].real(), _data[k].imag()) * this->chirp[k];
+    for (int k = n; k < m; k++)
+      a[k] = ComplexD(0.0, 0.0);
+
+    this->Radix2(a, false);
+    for (int k = 0; k < m; k++)
+      a[k] *= this->kernelSpectrum[k];
+    this->Radix2(a, true);
+
+    for (int k = 0; k < n; k++)
+    {
+      const ComplexD X = a[k] * this->chirp[k];
+      _data[k] = std::complex<float>(X.real() * _scale, X.imag() * _scale);
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void FftPlan::ForwardMany(std::complex<float> *_data, int _batch,
+                            size_t _dist, float _scale)
+  {
+    const size_t threads = omp_get_max_threads();
+    if (this->workspaces.size() < threads)
+      this->workspaces.resize(threads);
+    for (auto &work : this->workspaces)
+      if (work.size() < this->WorkSize())
+        work.resize(this->WorkSize());
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < _batch; i++)
+      this->Forward(_data + i * _dist, _scale,
+                    this->workspaces[omp_get_thread_num()].data());
+  }
+}  // namespace NpsGazeboSonar
@@ -17,6 +17,7 @@
 #include "ros/package.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <tf/tf.h>
 #include <sensor_msgs/image_encodings.h>
@@ -24,13 +25,14 @@
 
 #include <sensor_msgs/point_cloud2_iterator.h>
 
-#include <nps_uw_multibeam_sonar/sonar_calculation_cuda.cuh>
+#include <nps_uw_multibeam_sonar/sonar_calculation_cpu.hh>
 
 #include <opencv2/core/core.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/bind.hpp>
 
 #include <nps_uw_multibeam_sonar/gazebo_multibeam_sonar_raster_based.hh>
+#include <gazebo/common/Events.hh>
 #include <gazebo/sensors/Sensor.hh>
 #include <sdf/sdf.hh>
 #include <gazebo/sensors/SensorTypes.hh>
@@ -39,12 +41,34 @@
 #include <gazebo/rendering/Visual.hh>
 
 #include <algorithm>
+#include <map>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <limits>
 
 namespace gazebo
 {
+namespace
+{
+/// \brief Visual id of a pixel that sees no listed fiducial
+const uint32_t noVisualId = std::numeric_limits<uint32_t>::max();
+
+/// \brief A point of the "xyz" and "rgb" PointCloud2 fields, as laid out
+/// by PointCloud2Modifier: x, y, z, padding, then rgb in a 16 byte block
+struct CloudPoint
+{
+  float x;
+  float y;
+  float z;
+  float padding;
+  uint8_t rgb[3];
+  uint8_t rgbPadding[13];
+};
+static_assert(sizeof(CloudPoint) == 32, "PointCloud2 point layout");
+}  // namespace
+
 // Register this plugin with the simulator
 GZ_REGISTER_SENSOR_PLUGIN(NpsGazeboRosMultibeamSonar)
 
@@ -55,15 +79,12 @@ NpsGazeboRosMultibeamSonar::NpsGazeboRosMultibeamSonar() :
 {
   this->depth_image_connect_count_ = 0;
   this->depth_info_connect_count_ = 0;
+  this->normal_image_connect_count_ = 0;
   this->point_cloud_connect_count_ = 0;
+  this->sonar_image_raw_connect_count_ = 0;
   this->sonar_image_connect_count_ = 0;
   this->last_depth_image_camera_info_update_time_ = common::Time(0);
 
-  // frame counter for variational reflectivity
-  this->maxDepth_before = 0.0;
-  this->maxDepth_beforebefore = 0.0;
-  this->maxDepth_prev = 0.0;
-
   // for csv write logs
   this->writeCounter = 0;
   this->writeNumber = 1;
@@ -73,10 +94,29 @@ NpsGazeboRosMultibeamSonar::NpsGazeboRosMultibeamSonar() :
 // Destructor
 NpsGazeboRosMultibeamSonar::~NpsGazeboRosMultibeamSonar()
 {
+  this->diagnosticsTimer.stop();
+  this->addEntityConnection.reset();
+  this->deleteEntityConnection.reset();
   this->newDepthFrameConnection.reset();
   this->newImageFrameConnection.reset();
   this->newRGBPointCloudConnection.reset();
 
+  // Let the sonar worker finish its frame before tearing down
+  {
+    boost::mutex::scoped_lock lock(this->frameMutex);
+    this->stopWorker = true;
+  }
+  this->frameCondition.notify_all();
+  if (this->sonarPipeline)
+    this->sonarPipeline->Stop();
+  if (this->sonarWorkerThread.joinable())
+    this->sonarWorkerThread.join();
+  this->sonarPipeline.reset();
+
+  // The last sensor to stop closes the trace file
+  if (this->traceSensor >= 0)
+    NpsGazeboSonar::TraceRecorder::Instance().Stop();
+
   this->parentSensor.reset();
   this->depthCamera.reset();
 
@@ -181,6 +221,11 @@ void NpsGazeboRosMultibeamSonar::Load(sensors::SensorPtr _parent,
   else
     this->sonar_image_topic_name_ =
       _sdf->GetElement("sonarImageTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("diagnosticsTopicName"))
+    this->diagnostics_topic_name_ = "sonar_diagnostics";
+  else
+    this->diagnostics_topic_name_ =
+      _sdf->GetElement("diagnosticsTopicName")->Get<std::string>();
 
   // Read sonar properties from model.sdf
   if (!_sdf->HasElement("verticalFOV"))
@@ -233,6 +278,26 @@ void NpsGazeboRosMultibeamSonar::Load(sensors::SensorPtr _parent,
   else
     this->raySkips =
       _sdf->GetElement("raySkips")->Get<int>();
+  if (!_sdf->HasElement("changePositionTolerance"))
+    this->changePositionTolerance = 1e-3;
+  else
+    this->changePositionTolerance =
+      _sdf->GetElement("changePositionTolerance")->Get<double>();
+  if (!_sdf->HasElement("changeAngleTolerance"))
+    this->changeAngleTolerance = 1e-3;
+  else
+    this->changeAngleTolerance =
+      _sdf->GetElement("changeAngleTolerance")->Get<double>();
+  if (!_sdf->HasElement("changeRangeTolerance"))
+    this->changeRangeTolerance = 0.01;
+  else
+    this->changeRangeTolerance =
+      _sdf->GetElement("changeRangeTolerance")->Get<double>();
+  if (!_sdf->HasElement("changeFrames"))
+    this->changeFrames = 3;
+  else
+    this->changeFrames =
+      _sdf->GetElement("changeFrames")->Get<int>();
   if (!_sdf->HasElement("plotScaler"))
     this->plotScaler = 10;
   else
@@ -243,8 +308,66 @@ void NpsGazeboRosMultibeamSonar::Load(sensors::SensorPtr _parent,
   else
     this->sensorGain =
       _sdf->GetElement("sensorGain")->Get<float>();
+  if (!_sdf->HasElement("computeBackend"))
+    this->computeBackend = "gpu";
+  else
+    this->computeBackend =
+      _sdf->GetElement("computeBackend")->Get<std::string>();
+  if (!_sdf->HasElement("calculationMode"))
+    this->calculationMode = "spectral";
+  else
+    this->calculationMode =
+      _sdf->GetElement("calculationMode")->Get<std::string>();
+  if (!_sdf->HasElement("kernelHalfWidth"))
+    this->kernelHalfWidth = 8;
+  else
+    this->kernelHalfWidth =
+      _sdf->GetElement("kernelHalfWidth")->Get<int>();
+  if (!_sdf->HasElement("timeDomainWindow"))
+    this->timeDomainWindow = false;
+  else
+    this->timeDomainWindow =
+      _sdf->GetElement("timeDomainWindow")->Get<bool>();
+  if (!_sdf->HasElement("correctorTolerance"))
+    this->correctorTolerance = 0.0;
+  else
+    this->correctorTolerance =
+      _sdf->GetElement("correctorTolerance")->Get<double>();
+  if (!_sdf->HasElement("rangeTableSize"))
+    this->rangeTableSize = 256;
+  else
+    this->rangeTableSize =
+      _sdf->GetElement("rangeTableSize")->Get<int>();
+  if (!_sdf->HasElement("pipelineDepth"))
+    this->pipelineDepth = 1;
+  else
+    this->pipelineDepth =
+      _sdf->GetElement("pipelineDepth")->Get<int>();
   // Configure skips
   if (this->raySkips == 0) this->raySkips = 1;
+  // At least one frame in flight, 1 runs the two stages back to back
+  if (this->pipelineDepth < 1) this->pipelineDepth = 1;
+  // Configure compute backend
+  if (this->computeBackend != "gpu" && this->computeBackend != "cpu")
+  {
+    gzerr << "Unknown computeBackend [" << this->computeBackend
+          << "], falling back to gpu" << std::endl;
+    this->computeBackend = "gpu";
+  }
+  if (!NpsGazeboSonar::SonarEngine::Built(this->computeBackend))
+  {
+    gzerr << "computeBackend [" << this->computeBackend << "] is not built "
+          << "(CUDA was not found at build time), falling back to cpu"
+          << std::endl;
+    this->computeBackend = "cpu";
+  }
+  // Configure calculation mode
+  if (this->calculationMode != "spectral" && this->calculationMode != "timedomain")
+  {
+    gzerr << "Unknown calculationMode [" << this->calculationMode
+          << "], falling back to spectral" << std::endl;
+    this->calculationMode = "spectral";
+  }
 
   // --- Variational Reflectivity --- //
   // Read the variational reflectivity database file path from the SDF file
@@ -289,42 +412,34 @@ void NpsGazeboRosMultibeamSonar::Load(sensors::SensorPtr _parent,
     ros::package::getPath("nps_uw_multibeam_sonar")
         + "/worlds/" + this->customTagDatabaseFileName;
 
-  // Read csv file
-  std::ifstream csvFile; std::string line;
-  if (!this->customTag)
-    csvFile.open(this->reflectivityDatabaseFilePath);
-  else
-    csvFile.open(this->customTagDatabaseFilePath);
-  // skip the 3 lines
-  getline(csvFile, line); getline(csvFile, line); getline(csvFile, line);
-  while (getline(csvFile, line))
+  // Read the database, a catalog from compile_reflectivity_catalog or a
+  // csv file
+  if (!this->constMu)
   {
-      if (line.empty())  // skip empty lines:
-      {
-          continue;
-      }
-      std::istringstream iss(line);
-      std::string lineStream;
-      std::string::size_type sz;
-      std::vector <std::string> row;
-      while (getline(iss, lineStream, ','))
-      {
-          row.push_back(lineStream);
-      }
-      this->objectNames.push_back(row[0]);
-      this->reflectivities.push_back(stof(row[1], &sz));
+    std::string errors;
+    if (!this->reflectivityDatabase.Load(this->customTag
+          ? this->customTagDatabaseFilePath
+          : this->reflectivityDatabaseFilePath, errors))
+      gzerr << "Reflectivity database errors:\n" << errors;
   }
 
   // Read coefficient for Biofouling and roughness
   if (this->customTag)
   {
-    for (int k=0; k<objectNames.size(); k++)
-    {
-      if (objectNames[k] == "biofouling_rating")
-        this->biofouling_rating_coeff = reflectivities[k];
-      if (objectNames[k] == "roughness")
-        this->roughness_coeff = reflectivities[k];
-    }
+    int id = this->reflectivityDatabase.Find("biofouling_rating");
+    if (id >= 0)
+      this->biofouling_rating_coeff = this->reflectivityDatabase.Reflectivity(id);
+    id = this->reflectivityDatabase.Find("roughness");
+    if (id >= 0)
+      this->roughness_coeff = this->reflectivityDatabase.Reflectivity(id);
+
+    // Resolved surface reflectivities are dropped when models come and go
+    this->addEntityConnection = event::Events::ConnectAddEntity(
+        [this](const std::string &)
+        {this->surfaceReflectivitiesStale = true;});
+    this->deleteEntityConnection = event::Events::ConnectDeleteEntity(
+        [this](const std::string &)
+        {this->surfaceReflectivitiesStale = true;});
   }
 
   // From FiducialCameraPlugin
@@ -398,6 +513,20 @@ void NpsGazeboRosMultibeamSonar::Load(sensors::SensorPtr _parent,
   ROS_INFO_STREAM("Calculation skips (Elevation) = "
       << this->raySkips);
   ROS_INFO_STREAM("# of Time data / Beam = " << this->nFreq);
+  if (this->computeBackend == "cpu")
+    ROS_INFO_STREAM("Compute backend : CPU ("
+        << NpsGazeboSonar::cpu_thread_count() << " threads)");
+  else
+    ROS_INFO_STREAM("Compute backend : GPU (CUDA)");
+  if (this->calculationMode == "timedomain")
+    ROS_INFO_STREAM("Calculation mode : Time domain (kernel half width "
+        << this->kernelHalfWidth << " bins"
+        << (this->timeDomainWindow ? ", Hamming window)" : ")"));
+  else
+    ROS_INFO_STREAM("Calculation mode : Spectral");
+  if (this->correctorTolerance > 0.0)
+    ROS_INFO_STREAM("Beam corrector tolerance = " << this->correctorTolerance);
+  ROS_INFO_STREAM("Sonar frames in flight = " << this->pipelineDepth);
   if (!this->constMu)
   {
     if (this->customTag)
@@ -466,6 +595,83 @@ void NpsGazeboRosMultibeamSonar::Load(sensors::SensorPtr _parent,
   for (int i = 0; i < nBeams; i++)
       this->beamCorrector[i] = new float[nBeams];
   this->beamCorrectorSum = 0.0;
+  this->ComputeCorrector();
+
+  // Sonar engine is set up once, its working memory is reused every frame.
+  // Configuration and allocation errors show up here, at startup.
+  double vFOV = this->parentSensor->DepthCamera()->VFOV().Radian();
+  double hFOV = this->parentSensor->DepthCamera()->HFOV().Radian();
+  double vPixelSize = vFOV / this->height;
+  double hPixelSize = hFOV / this->width;
+  NpsGazeboSonar::SonarConfig config;
+  config.nBeams = this->nBeams;
+  config.nRays = this->nRays;
+  config.raySkips = this->raySkips;
+  config.nFreq = this->nFreq;
+  config.hPixelSize = hPixelSize;
+  config.vPixelSize = vPixelSize;
+  config.hFOV = hFOV;
+  config.vFOV = vFOV;
+  config.beamAzimuthAngleWidth = hPixelSize;
+  config.beamElevationAngleWidth = verticalFOV/180*M_PI;
+  config.rayAzimuthAngleWidth = hPixelSize;
+  config.rayElevationAngleWidth = vPixelSize*(raySkips+1);
+  config.rayElevationAngles = this->elevation_angles;
+  config.soundSpeed = this->soundSpeed;
+  config.maxDistance = this->maxDistance;
+  config.sourceLevel = this->sourceLevel;
+  config.sonarFreq = this->sonarFreq;
+  config.bandwidth = this->bandwidth;
+  config.attenuation = this->attenuation;
+  config.window = this->window;
+  config.timeDomain = (this->calculationMode == "timedomain");
+  config.kernelHalfWidth = this->kernelHalfWidth;
+  config.timeDomainWindow = this->timeDomainWindow;
+  config.correctorTolerance = this->correctorTolerance;
+  config.rangeTableSize = this->rangeTableSize;
+  config.debugFlag = this->debugFlag;
+  this->sonarEngine =
+    NpsGazeboSonar::SonarEngine::Create(this->computeBackend, config);
+  this->sonarEngine->SetBeamCorrector(this->beamCorrector,
+                                      this->beamCorrectorSum);
+
+  // Depth frames are copied into preallocated slots and processed by the
+  // sonar worker, off the rendering thread. The worker computes the beam
+  // spectra and leaves the FFT and publishing to the pipeline thread.
+  for (auto &frame : this->depthFrames)
+    frame.depth.resize(this->width * this->height);
+  this->sonarPipeline.reset(new NpsGazeboSonar::FramePipeline<SonarFrame>(
+    this->pipelineDepth, boost::bind(
+      &NpsGazeboRosMultibeamSonar::PublishSonarImage, this, _1)));
+  this->sonarWorkerThread =
+    boost::thread(boost::bind(&NpsGazeboRosMultibeamSonar::SonarWorker, this));
+
+  // Optional Chrome trace of the frame work
+  std::string traceFile;
+  if (_sdf->HasElement("traceFile"))
+    traceFile = _sdf->GetElement("traceFile")->Get<std::string>();
+  traceFile = NpsGazeboSonar::TraceRecorder::TraceFile(traceFile);
+  if (!traceFile.empty())
+  {
+    // The recorder is shared by all sensors of the process and records
+    // to the file of the first one
+    const std::string recording =
+      NpsGazeboSonar::TraceRecorder::Instance().Start(traceFile);
+    if (recording.empty())
+    {
+      gzwarn << "Sonar trace file [" << traceFile
+             << "] could not be opened\n";
+    }
+    else
+    {
+      if (recording != traceFile)
+        gzwarn << "Sonar trace file [" << traceFile << "] ignored, the "
+               << "process already records to [" << recording << "]\n";
+      this->traceSensor = NpsGazeboSonar::TraceRecorder::Instance().
+        RegisterSensor(this->parentSensor->ScopedName());
+      ROS_INFO_STREAM("Sonar trace file : " << recording);
+    }
+  }
 
   load_connection_ =
     GazeboRosCameraUtils::OnLoad(
@@ -526,18 +732,55 @@ void NpsGazeboRosMultibeamSonar::Advertise()
   ros::AdvertiseOptions sonar_image_raw_ao =
     ros::AdvertiseOptions::create<acoustic_msgs::SonarImage>(
       this->sonar_image_raw_topic_name_, 1,
-      boost::bind(&NpsGazeboRosMultibeamSonar::DepthImageConnect, this),
-      boost::bind(&NpsGazeboRosMultibeamSonar::DepthImageDisconnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonar::SonarImageRawConnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonar::SonarImageRawDisconnect, this),
       ros::VoidPtr(), &this->camera_queue_);
   this->sonar_image_raw_pub_ = this->rosnode_->advertise(sonar_image_raw_ao);
 
   ros::AdvertiseOptions sonar_image_ao =
     ros::AdvertiseOptions::create<sensor_msgs::Image>(
       this->sonar_image_topic_name_, 1,
-      boost::bind(&NpsGazeboRosMultibeamSonar::DepthImageConnect, this),
-      boost::bind(&NpsGazeboRosMultibeamSonar::DepthImageDisconnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonar::SonarImageConnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonar::SonarImageDisconnect, this),
       ros::VoidPtr(), &this->camera_queue_);
   this->sonar_image_pub_ = this->rosnode_->advertise(sonar_image_ao);
+
+  // Stage latencies and frame counters, published at 1 Hz
+  this->diagnostics_pub_ =
+    this->rosnode_->advertise<diagnostic_msgs::DiagnosticArray>(
+      this->diagnostics_topic_name_, 1);
+  ros::WallTimerOptions diagnostics_to(ros::WallDuration(1.0),
+      boost::bind(&NpsGazeboRosMultibeamSonar::PublishDiagnostics, this, _1),
+      &this->camera_queue_);
+  this->diagnosticsTimer = this->rosnode_->createWallTimer(diagnostics_to);
+}
+
+/////////////////////////////////////////////////
+void NpsGazeboRosMultibeamSonar::PublishDiagnostics(
+    const ros::WallTimerEvent &_event)
+{
+  NpsGazeboSonar::SonarCounters counters;
+  {
+    boost::mutex::scoped_lock lock(this->frameMutex);
+    counters.droppedFrames = this->droppedFrames;
+  }
+  if (!this->constMu)
+    counters.reflectivityDirtyPixels = this->reflectivityDirtyPixels;
+  counters.framesInFlight = this->sonarPipeline->InFlight();
+  counters.pipelineDepth = this->sonarPipeline->Depth();
+  const double updateRate = this->parentSensor->UpdateRate();
+
+  diagnostic_msgs::DiagnosticArray diagnostics;
+  diagnostics.header.stamp = ros::Time::now();
+  diagnostics.status.resize(1);
+  NpsGazeboSonar::FillSonarDiagnostics(
+    this->parentSensor->ScopedName(), this->frame_name_,
+    this->stageLatencies, counters,
+    updateRate > 0.0 ? 1.0 / updateRate : 0.0, diagnostics.status[0]);
+  this->diagnostics_pub_.publish(diagnostics);
+
+  // The statistics cover the last intervals only
+  this->stageLatencies.Rotate();
 }
 
 
@@ -560,13 +803,35 @@ void NpsGazeboRosMultibeamSonar::DepthImageDisconnect()
 
 void NpsGazeboRosMultibeamSonar::NormalImageConnect()
 {
-  this->depth_image_connect_count_++;
+  this->normal_image_connect_count_++;
   this->parentSensor->SetActive(true);
 }
 
 void NpsGazeboRosMultibeamSonar::NormalImageDisconnect()
 {
-  this->depth_image_connect_count_--;
+  this->normal_image_connect_count_--;
+}
+
+void NpsGazeboRosMultibeamSonar::SonarImageRawConnect()
+{
+  this->sonar_image_raw_connect_count_++;
+  this->parentSensor->SetActive(true);
+}
+
+void NpsGazeboRosMultibeamSonar::SonarImageRawDisconnect()
+{
+  this->sonar_image_raw_connect_count_--;
+}
+
+void NpsGazeboRosMultibeamSonar::SonarImageConnect()
+{
+  this->sonar_image_connect_count_++;
+  this->parentSensor->SetActive(true);
+}
+
+void NpsGazeboRosMultibeamSonar::SonarImageDisconnect()
+{
+  this->sonar_image_connect_count_--;
 }
 
 void NpsGazeboRosMultibeamSonar::DepthInfoConnect()
@@ -590,10 +855,33 @@ void NpsGazeboRosMultibeamSonar::PointCloudDisconnect()
 {
   this->point_cloud_connect_count_--;
   (*this->image_connect_count_)--;
-  if (this->point_cloud_connect_count_ <= 0)
+  if (!this->HasSubscribers())
     this->parentSensor->SetActive(false);
 }
 
+/////////////////////////////////////////////////
+NpsGazeboSonar::SonarOutputs
+NpsGazeboRosMultibeamSonar::SubscribedOutputs() const
+{
+  NpsGazeboSonar::SonarOutputs outputs;
+  outputs.raw = this->sonar_image_raw_connect_count_ > 0;
+  outputs.fan = this->sonar_image_connect_count_ > 0;
+  outputs.depth = this->depth_image_connect_count_ > 0;
+  outputs.normal = this->normal_image_connect_count_ > 0;
+  // The log is only written along with a subscribed output
+  outputs.log = this->writeLogFlag && (outputs.raw || outputs.fan
+                                       || outputs.depth || outputs.normal);
+  return outputs;
+}
+
+/////////////////////////////////////////////////
+bool NpsGazeboRosMultibeamSonar::HasSubscribers() const
+{
+  return this->SubscribedOutputs().Any()
+         || this->point_cloud_connect_count_ > 0
+         || (*this->image_connect_count_) > 0;
+}
+
 // Update everything when Gazebo provides a new depth frame (texture)
 void NpsGazeboRosMultibeamSonar::OnNewDepthFrame(const float *_image,
                                              unsigned int _width,
@@ -603,34 +891,99 @@ void NpsGazeboRosMultibeamSonar::OnNewDepthFrame(const float *_image,
 {
   if (!this->initialized_ || this->height_ <=0 || this->width_ <=0)
     return;
-
-  this->depth_sensor_update_time_ = this->parentSensor->LastMeasurementTime();
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "OnNewDepthFrame");
 
   if (this->parentSensor->IsActive())
   {
     // Deactivate if no subscribers
-    if (this->depth_image_connect_count_ <= 0 &&
-        this->point_cloud_connect_count_ <= 0 &&
-        (*this->image_connect_count_) <= 0)
+    if (!this->HasSubscribers())
     {
       this->parentSensor->SetActive(false);
     }
     else
     {
-      this->ComputePointCloud(_image);
-
-      if (this->depth_image_connect_count_ > 0)
-        this->ComputeSonarImage(_image);
+      // Hand the frame over to the sonar worker. Only a slot that is
+      // neither pending nor being processed is written to.
+      int slot = 0;
+      {
+        boost::mutex::scoped_lock lock(this->frameMutex);
+        while (slot == this->pendingFrame || slot == this->workingFrame)
+          slot++;
+      }
+      DepthFrame &frame = this->depthFrames[slot];
+      const size_t size = static_cast<size_t>(this->width) * this->height;
+      if (frame.depth.size() != size)
+        frame.depth.resize(size);
+      std::copy(_image, _image + size, frame.depth.begin());
+      frame.stamp = this->parentSensor->LastMeasurementTime();
+      frame.outputs = this->SubscribedOutputs();
+
+      // Latest frame wins if the worker is still busy with an older one
+      {
+        boost::mutex::scoped_lock lock(this->frameMutex);
+        if (this->pendingFrame >= 0)
+          this->droppedFrames++;
+        this->pendingFrame = slot;
+      }
+      this->frameCondition.notify_one();
     }
   }
   else
   {
-    if (this->depth_image_connect_count_ <= 0 ||
-        this->point_cloud_connect_count_ > 0)
+    if (this->HasSubscribers())
       this->parentSensor->SetActive(true);
   }
 }
 
+/////////////////////////////////////////////////
+// Sonar worker, processes the latest depth frame off the rendering thread
+void NpsGazeboRosMultibeamSonar::SonarWorker()
+{
+  pthread_setname_np(pthread_self(), "sonar_worker");
+  while (true)
+  {
+    int slot;
+    {
+      boost::mutex::scoped_lock lock(this->frameMutex);
+      this->workingFrame = -1;
+      while (this->pendingFrame < 0 && !this->stopWorker)
+        this->frameCondition.wait(lock);
+      if (this->stopWorker)
+        return;
+      slot = this->pendingFrame;
+      this->pendingFrame = -1;
+      this->workingFrame = slot;
+      if (this->debugFlag && this->droppedFrames > this->loggedDroppedFrames)
+      {
+        ROS_INFO_STREAM("Sonar worker behind, dropped " <<
+                        this->droppedFrames - this->loggedDroppedFrames <<
+                        " depth frames");
+        this->loggedDroppedFrames = this->droppedFrames;
+      }
+    }
+
+    // Outputs are stamped with the time of the frame they come from
+    const DepthFrame &frame = this->depthFrames[slot];
+    this->depth_sensor_update_time_ = frame.stamp;
+    auto stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+    this->ComputePointCloud(frame.depth.data());
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_POINT_CLOUD, stageStart);
+    if (!frame.outputs.Any())
+      continue;
+
+    // Waits while the publisher is behind by the whole pipeline depth
+    stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+    SonarFrame *sonarFrame = this->sonarPipeline->Acquire();
+    if (!sonarFrame)
+      return;
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_PIPELINE_WAIT, stageStart);
+    sonarFrame->stamp = frame.stamp;
+    sonarFrame->outputs = frame.outputs;
+    sonarFrame->start = NpsGazeboSonar::StageLatencies::Clock::now();
+    this->ComputeSonarImage(*sonarFrame);
+    this->sonarPipeline->Submit(sonarFrame);
+  }
+}
 
 // Process the camera image when Gazebo provides one. Do we actually need this?
 void NpsGazeboRosMultibeamSonar::OnNewImageFrame(const unsigned char *_image,
@@ -641,6 +994,7 @@ void NpsGazeboRosMultibeamSonar::OnNewImageFrame(const unsigned char *_image,
 {
   if (!this->initialized_ || this->height_ <=0 || this->width_ <=0)
     return;
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "OnNewImageFrame");
 
   this->sensor_update_time_ = this->parentSensor->LastMeasurementTime();
 
@@ -659,35 +1013,42 @@ void NpsGazeboRosMultibeamSonar::OnNewImageFrame(const unsigned char *_image,
     }
   }
 
-  // Calculate only if the maxDepth from depth camera is changed and stabled
-  double min; cv::minMaxLoc(this->point_cloud_image_, &min, &this->maxDepth);
-  if (this->maxDepth == this->maxDepth_before
-      && this->maxDepth == this->maxDepth_beforebefore
-      && this->calculateReflectivity == false
-      && this->maxDepth != this->maxDepth_prev)
+  // Calculate only if the sensor or the scene moved since the last time
+  this->calculateReflectivity = this->SceneChanged();
+  if (this->calculateReflectivity)
   {
-    this->calculateReflectivity = true;
-    this->maxDepth_prev = this->maxDepth;
 
-    // Regenerate rand image
+    // Regenerate rand image, swapped in whole for the sonar worker
+    cv::Mat rand_image(this->height, this->width, CV_32FC2);
     uint64 randN = static_cast<uint64>(std::rand());
     cv::theRNG().state = randN;
     cv::RNG rng = cv::theRNG();
-    rng.fill(this->rand_image, cv::RNG::NORMAL, 0.f, 1.f);
+    rng.fill(rand_image, cv::RNG::NORMAL, 0.f, 1.f);
+    this->lock_.lock();
+    this->rand_image = rand_image;
+    this->lock_.unlock();
   }
-  else
-    this->calculateReflectivity = false;
-
-  this->maxDepth_beforebefore = this->maxDepth_before;
-  this->maxDepth_before = this->maxDepth;
 
   // For variational reflectivity
   if (!this->constMu)
   {
     if (calculateReflectivity)
     {
-      // Generate reflectivity opencv image palette
-      cv::Mat reflectivity_image = cv::Mat(width, height, CV_32FC1, cv::Scalar(this->mu));
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "reflectivity");
+      // Generate reflectivity opencv image palette, kept across updates
+      // along with the visual seen by each pixel, so that only pixels
+      // whose visual changed are written again
+      // (rays x beams, as the engines read it)
+      cv::Mat &reflectivity_image = this->reflectivityWork;
+      if (reflectivity_image.rows != static_cast<int>(height)
+          || reflectivity_image.cols != static_cast<int>(width))
+      {
+        reflectivity_image =
+          cv::Mat(height, width, CV_32FC1, cv::Scalar(this->mu));
+        this->reflectivityVisualIds.assign(
+          static_cast<size_t>(width) * height, noVisualId);
+        this->lastVisualReflectivities.clear();
+      }
 
       if (!this->selectionBuffer)
       {
@@ -702,117 +1063,318 @@ void NpsGazeboRosMultibeamSonar::OnNewImageFrame(const unsigned char *_image,
       if (this->detectAll)
         this->PopulateFiducials();
 
-      std::vector<FiducialData> results;
+      // Fiducials visible within the frustum, by their root visual
+      std::set<rendering::VisualPtr> visible;
       for (const auto &f : this->fiducials)
       {
-        // check if fiducial is visible within the frustum
         rendering::VisualPtr vis = this->scene->GetVisual(f);
-        if (!vis)
-          continue;
-
-        if (!this->depthCamera->IsVisible(vis))
-          continue;
+        if (vis && this->depthCamera->IsVisible(vis))
+          visible.insert(vis);
+      }
 
-        // Loop over every pixel
-        for (int i=0; i<reflectivity_image.rows; i++)
+      // Reflectivity of each visible fiducial met, looked up once, and
+      // the index of it for each entity, -1 if the entity is not part
+      // of one or the database does not list it
+      std::vector<VisualReflectivity> visuals;
+      std::map<rendering::VisualPtr, int> visualIndices;
+
+      // One render of the whole view tells which entity every pixel
+      // sees, so occlusion by other entities is accounted for. Without
+      // a visible fiducial every pixel falls back to mu.
+      const bool selected =
+        !visible.empty() && this->selectionBuffer->UpdateFrame();
+
+      // Flat table by the dense entity index of the selection frame
+      const int unresolved = -2;
+      std::vector<int> entityIndices(
+        selected ? this->selectionBuffer->EntityCount() : 0, unresolved);
+
+      // Loop over every pixel
+      int64_t dirtyPixels = 0;
+      for (int i=0; i<reflectivity_image.cols; i++)
+      {
+        uint32_t *visualIds = this->reflectivityVisualIds.data()
+          + static_cast<size_t>(i) * reflectivity_image.rows;
+        for (int j=0; j<reflectivity_image.rows; j+=raySkips)
         {
-          for (int j=0; j<reflectivity_image.cols; j+=raySkips)
+          int index = -1;
+          const int entity =
+            selected ? this->selectionBuffer->EntityIndexAt(i, j) : -1;
+          if (entity >= 0)
           {
-            // target pixel
-            ignition::math::Vector2i pt = ignition::math::Vector2i(i, j);
-
-            // use selection buffer to check if visual is occluded by other entities
-            // in the camera view
-            Ogre::Entity *entity =
-              this->selectionBuffer->OnSelectionClick(pt.X(), pt.Y());
-
-            rendering::VisualPtr result;
-            if (entity && !entity->getUserObjectBindings().getUserAny().isEmpty())
-            {
-              try
-              {
-                result = this->scene->GetVisual(
-                    Ogre::any_cast<std::string>(
-                    entity->getUserObjectBindings().getUserAny()));
-              }
-              catch(Ogre::Exception &_e)
-              {
-                gzerr << "Ogre Error:" << _e.getFullDescription() << "\n";
-                continue;
-              }
-            }
-
-            if (result && result->GetRootVisual() == vis)
+            if (entityIndices[entity] == unresolved)
             {
-              FiducialData fd;
-              fd.id = vis->Name();
-              fd.pt = pt;
-
-              // this->world;
-
-
-              // Assign variational reflectivity
-              if (!this->customTag)
-              {
-                for (int k=0; k<objectNames.size(); k++)
-                  if (vis->Name() == objectNames[k])
-                    reflectivity_image.at<float>(j, i) = reflectivities[k];
-              }
-              else
-              {
-                // Read custom tags for surface properties
-                sdf::ElementPtr modelElt =
-                  this->world->BaseByName(vis->Name())->GetSDF();
-
-                int biofoulingRating = 0; // Biofouling rating, [0, 100]
-                if (modelElt->HasElement("surface_props:biofouling_rating"))
-                  biofoulingRating = modelElt->Get<int>("surface_props:biofouling_rating");
-
-                double roughness = 0.0; // Surface roughness, [0.0, 1.0]
-                if (modelElt->HasElement("surface_props:roughness"))
-                  roughness = modelElt->Get<double>("surface_props:roughness");
-
-                std::string material = "default"; // Surface material
-                if (modelElt->HasElement("surface_props:material"))
-                  material = modelElt->Get<std::string>("surface_props:material");
-
-                for (int k=0; k<objectNames.size(); k++)
-                  if (material == objectNames[k])
-                    reflectivity_image.at<float>(j, i) =
-                      reflectivities[k] * (1.0/(roughness + 1)) / this->roughness_coeff
-                      * (1.0/(biofoulingRating + 1)) / this->biofouling_rating_coeff;
-
-              }
-              // results.push_back(fd);  // Redundant
+              entityIndices[entity] = this->VisualIndex(
+                  this->selectionBuffer->EntityOfIndex(entity), visible,
+                  visualIndices, visuals);
             }
+            index = entityIndices[entity];
           }
-        }  // end of pixel loop
-      }  // end of selection buffer
 
-      // Save reflectivity image
-      this->reflectivityImage = reflectivity_image;
+          const uint32_t visualId = index >= 0 ? visuals[index].id : noVisualId;
+          if (visualId == visualIds[j] && (index < 0 || !visuals[index].changed))
+            continue;
+          visualIds[j] = visualId;
+          reflectivity_image.at<float>(j, i) =
+            index >= 0 ? visuals[index].reflectivity : this->mu;
+          dirtyPixels++;
+        }
+      }  // end of pixel loop
+
+      this->lastVisualReflectivities.clear();
+      for (const VisualReflectivity &visual : visuals)
+        this->lastVisualReflectivities[visual.id] = visual.reflectivity;
+      this->reflectivityDirtyPixels = dirtyPixels;
+
+      // Save reflectivity image, swapped in whole for the sonar worker,
+      // which may still read the previous one. Both start out as mu.
+      if (dirtyPixels > 0)
+      {
+        cv::Mat reflectivity_copy = reflectivity_image.clone();
+        this->lock_.lock();
+        this->reflectivityImage = reflectivity_copy;
+        this->lock_.unlock();
+      }
     }  // end of variational reflectivity calculation
   }  // end of variational reflectivity bool
 
 }
 
-// Most of the plugin work happens here
-void NpsGazeboRosMultibeamSonar::ComputeSonarImage(const float *_src)
+/////////////////////////////////////////////////
+bool NpsGazeboRosMultibeamSonar::SceneChanged()
 {
+  // Poses of the sensor and of every model, the ids tell when models
+  // are added or deleted. Links moved by the joints of a model that
+  // stays put show up in the range image below.
+  ScenePoses poses;
+  poses.reserve(this->scenePoses.size());
+  poses.emplace_back(0, this->depthCamera->WorldPose());
+  for (const physics::ModelPtr &model : this->world->Models())
+    poses.emplace_back(model->GetId(), model->WorldPose());
+
+  // Fallback for changes that move no model, such as joints or animated
+  // visuals: a sparse grid of the range image (the point cloud image is
+  // written by the sonar worker)
+  const int samples = 32;
+  std::vector<float> grid(samples * samples, 0.0f);
   this->lock_.lock();
-  cv::Mat depth_image = this->point_cloud_image_;
-  cv::Mat normal_image = this->ComputeNormalImage(depth_image);
-  double vFOV = this->parentSensor->DepthCamera()->VFOV().Radian();
-  double hFOV = this->parentSensor->DepthCamera()->HFOV().Radian();
-  double vPixelSize = vFOV / this->height;
-  double hPixelSize = hFOV / this->width;
+  const cv::Mat &range = this->point_cloud_image_;
+  for (int r = 0; r < samples && !range.empty(); r++)
+  {
+    const float *row = range.ptr<float>(r * range.rows / samples);
+    for (int c = 0; c < samples; c++)
+      grid[r * samples + c] = row[c * range.cols / samples];
+  }
+  this->lock_.unlock();
+
+  // The first frame always refreshes
+  if (this->scenePoses.empty())
+  {
+    this->framePoses = poses;
+    this->frameGrid = grid;
+    this->scenePoses.swap(poses);
+    this->sceneGrid.swap(grid);
+    return true;
+  }
+
+  // A change refreshes once it ends, when the scene has stayed still
+  // from frame to frame for changeFrames frames, so that a scene in
+  // continuous motion is not refreshed on the way and the refresh shows
+  // where it came to rest
+  if (this->SceneDiffers(poses, grid, this->framePoses, this->frameGrid))
+    this->sceneStillFrames = 0;
+  else if (this->sceneStillFrames < this->changeFrames)
+    this->sceneStillFrames++;
+  this->framePoses = poses;
+  this->frameGrid = grid;
+  if (this->sceneStillFrames < this->changeFrames)
+    return false;
+
+  // Compared against the scene of the last refresh, so that slow drifts
+  // add up until they exceed the tolerances
+  if (!this->SceneDiffers(poses, grid, this->scenePoses, this->sceneGrid))
+    return false;
+  this->scenePoses.swap(poses);
+  this->sceneGrid.swap(grid);
+  return true;
+}
 
-  if (this->beamCorrectorSum == 0)
-    ComputeCorrector();
+/////////////////////////////////////////////////
+bool NpsGazeboRosMultibeamSonar::SceneDiffers(const ScenePoses &_poses,
+    const std::vector<float> &_grid, const ScenePoses &_lastPoses,
+    const std::vector<float> &_lastGrid) const
+{
+  if (_poses.size() != _lastPoses.size())
+    return true;
+  for (size_t k = 0; k < _poses.size(); k++)
+  {
+    const ignition::math::Pose3d &pose = _poses[k].second;
+    const ignition::math::Pose3d &last = _lastPoses[k].second;
+    const ignition::math::Quaterniond rotation =
+      last.Rot().Inverse() * pose.Rot();
+    if (_poses[k].first != _lastPoses[k].first
+        || pose.Pos().Distance(last.Pos()) > this->changePositionTolerance
+        || 2.0 * acos(std::min(1.0, std::abs(rotation.W())))
+           > this->changeAngleTolerance)
+      return true;
+  }
+
+  // A range image sample moves when it differs by more than the position
+  // tolerance plus changeRangeTolerance of its range, and the grid
+  // changes when more than 1/32 of its samples move, so that depth noise
+  // does not count
+  if (_grid.size() != _lastGrid.size())
+    return true;
+  size_t moved = 0;
+  for (size_t k = 0; k < _grid.size(); k++)
+  {
+    const float last = _lastGrid[k];
+    if (std::abs(_grid[k] - last) > this->changePositionTolerance
+        + this->changeRangeTolerance * std::abs(last))
+      moved++;
+  }
+  return moved > _grid.size() / 32;
+}
+
+/////////////////////////////////////////////////
+int NpsGazeboRosMultibeamSonar::VisualIndex(Ogre::Entity *_entity,
+    const std::set<rendering::VisualPtr> &_visible,
+    std::map<rendering::VisualPtr, int> &_indices,
+    std::vector<VisualReflectivity> &_visuals)
+{
+  rendering::VisualPtr result;
+  if (!_entity->getUserObjectBindings().getUserAny().isEmpty())
+  {
+    try
+    {
+      result = this->scene->GetVisual(
+          Ogre::any_cast<std::string>(
+          _entity->getUserObjectBindings().getUserAny()));
+    }
+    catch(Ogre::Exception &_e)
+    {
+      gzerr << "Ogre Error:" << _e.getFullDescription() << "\n";
+    }
+  }
+  if (!result)
+    return -1;
+
+  // Only fiducials in the frustum are assigned a reflectivity
+  rendering::VisualPtr vis = result->GetRootVisual();
+  if (_visible.count(vis) == 0)
+    return -1;
+  auto index = _indices.find(vis);
+  if (index != _indices.end())
+    return index->second;
+
+  float reflectivity = 0.0;
+  bool listed = false;
+  if (!this->customTag)
+  {
+    int id = this->reflectivityDatabase.Find(vis->Name());
+    if (id >= 0)
+    {
+      reflectivity = this->reflectivityDatabase.Reflectivity(id);
+      listed = true;
+    }
+  }
+  else
+  {
+    listed = this->ModelSurfaceReflectivity(vis->Name(), reflectivity);
+  }
 
+  int indexOfVisual = -1;
+  if (listed)
+  {
+    VisualReflectivity visual;
+    visual.id = vis->GetId();
+    visual.reflectivity = reflectivity;
+    auto last = this->lastVisualReflectivities.find(visual.id);
+    visual.changed = last == this->lastVisualReflectivities.end()
+                     || last->second != reflectivity;
+    indexOfVisual = static_cast<int>(_visuals.size());
+    _visuals.push_back(visual);
+  }
+  _indices[vis] = indexOfVisual;
+  return indexOfVisual;
+}
+
+/////////////////////////////////////////////////
+bool NpsGazeboRosMultibeamSonar::ModelSurfaceReflectivity(
+    const std::string &_model, float &_reflectivity)
+{
+  if (this->surfaceReflectivitiesStale.exchange(false))
+    this->surfaceReflectivities.clear();
+
+  physics::BasePtr model = this->world->BaseByName(_model);
+  if (!model)
+    return false;
+  sdf::ElementPtr modelElt = model->GetSDF();
+
+  // The tags are read again only if the model got a new SDF
+  SurfaceReflectivity &surface = this->surfaceReflectivities[_model];
+  if (surface.sdf != modelElt)
+  {
+    surface.sdf = modelElt;
+
+    // Read custom tags for surface properties
+    int biofoulingRating = 0; // Biofouling rating, [0, 100]
+    if (modelElt->HasElement("surface_props:biofouling_rating"))
+      biofoulingRating = modelElt->Get<int>("surface_props:biofouling_rating");
+
+    double roughness = 0.0; // Surface roughness, [0.0, 1.0]
+    if (modelElt->HasElement("surface_props:roughness"))
+      roughness = modelElt->Get<double>("surface_props:roughness");
+
+    std::string material = "default"; // Surface material
+    if (modelElt->HasElement("surface_props:material"))
+      material = modelElt->Get<std::string>("surface_props:material");
+
+    int id = this->reflectivityDatabase.Find(material);
+    surface.listed = id >= 0;
+    if (surface.listed)
+      surface.reflectivity =
+        this->reflectivityDatabase.Reflectivity(id) * (1.0/(roughness + 1))
+        / this->roughness_coeff
+        * (1.0/(biofoulingRating + 1)) / this->biofouling_rating_coeff;
+  }
+
+  _reflectivity = surface.reflectivity;
+  return surface.listed;
+}
+
+// Most of the plugin work happens here
+void NpsGazeboRosMultibeamSonar::ComputeSonarImage(SonarFrame &_frame)
+{
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "ComputeSonarImage");
+  // The frame keeps its own copy, the next point cloud overwrites the
+  // image while this frame is still being published
+  this->point_cloud_image_.copyTo(_frame.depth_image);
+  // Normals and beams are only computed for the outputs that need them
+  const NpsGazeboSonar::SonarOutputs &outputs = _frame.outputs;
+  if (!outputs.Spectrum() && !outputs.normal)
+    return;
+  auto stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+  {
+    NpsGazeboSonar::TraceSpan span(this->traceSensor, "normals");
+    _frame.normal_image =
+      NpsGazeboSonar::ComputeNormalImage(_frame.depth_image, this->focal_length_);
+  }
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_NORMALS, stageStart);
+  if (!outputs.Spectrum())
+    return;
+  const cv::Mat &depth_image = _frame.depth_image;
+  const cv::Mat &normal_image = _frame.normal_image;
+
+  // The rendering thread swaps in new rand and reflectivity images, hold
+  // on to the current ones for this frame
+  this->lock_.lock();
   // Default value for reflectivity
   if (this->reflectivityImage.rows == 0)
-    this->reflectivityImage = cv::Mat(width, height, CV_32FC1, cv::Scalar(this->mu));
+    this->reflectivityImage = cv::Mat(height, width, CV_32FC1, cv::Scalar(this->mu));
+  cv::Mat reflectivity_image = this->reflectivityImage;
+  cv::Mat rand_image = this->rand_image;
+  this->lock_.unlock();
 
   // If artifical vehicle vibration flag is on
   if (this->artificialVehicleVibration)
@@ -821,7 +1383,7 @@ void NpsGazeboRosMultibeamSonar::ComputeSonarImage(const float *_src)
     uint64 randN = static_cast<uint64>(std::rand());
     cv::theRNG().state = randN;
     cv::RNG rng = cv::theRNG();
-    rng.fill(this->rand_image, cv::RNG::NORMAL, 0.f, 1.f);
+    rng.fill(rand_image, cv::RNG::NORMAL, 0.f, 1.f);
   }
 
   // For calc time measure
@@ -829,42 +1391,119 @@ void NpsGazeboRosMultibeamSonar::ComputeSonarImage(const float *_src)
   // ------------------------------------------------//
   // --------      Sonar calculations       -------- //
   // ------------------------------------------------//
-  CArray2D P_Beams = NpsGazeboSonar::sonar_calculation_wrapper(
+  // Up to the range FFT, which runs with the rest of the frame on the
+  // publisher thread while the next frame is computed here
+  this->sonarEngine->ComputeSpectrum(
                   depth_image,   // cv::Mat& depth_image
                   normal_image,  // cv::Mat& normal_image
-                  rand_image,    // cv::Mat& rand_image
-                  hPixelSize,    // hPixelSize
-                  vPixelSize,    // vPixelSize
-                  hFOV,          // hFOV
-                  vFOV,          // VFOV
-                  hPixelSize,    // _beam_azimuthAngleWidth
-                  verticalFOV/180*M_PI,  // _beam_elevationAngleWidth
-                  hPixelSize,    // _ray_azimuthAngleWidth
-                  this->elevation_angles, // _ray_elevationAngles
-                  vPixelSize*(raySkips+1),  // _ray_elevationAngleWidth
-                  this->soundSpeed,    // _soundSpeed
-                  this->maxDistance,   // _maxDistance
-                  this->sourceLevel,   // _sourceLevel
-                  this->nBeams,        // _nBeams
-                  this->nRays,         // _nRays
-                  this->raySkips,      // _raySkips
-                  this->sonarFreq,     // _sonarFreq
-                  this->bandwidth,     // _bandwidth
-                  this->nFreq,         // _nFreq
-                  this->reflectivityImage,  // reflectivity_image
-                  this->attenuation,   // _attenuation
-                  this->window,        // _window
-                  this->beamCorrector,      // _beamCorrector
-                  this->beamCorrectorSum,   // _beamCorrectorSum
-                  this->debugFlag);
+                  rand_image,          // cv::Mat& rand_image
+                  reflectivity_image,  // reflectivity_image
+                  _frame.P_Beams);
+
+  // For calc time measure
+  auto stop = std::chrono::high_resolution_clock::now();
+  _frame.calcTime = std::chrono::duration_cast<
+                    std::chrono::microseconds>(stop - start);
+  const NpsGazeboSonar::StageTimes &times = this->sonarEngine->LastStageTimes();
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_SUMMATION, times.summation);
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_CORRECTION, times.correction);
+  NpsGazeboSonar::TraceEngineStages(this->traceSensor, times, false);
+}
+
+/////////////////////////////////////////////////
+// Second stage of a sonar frame, on the publisher thread
+void NpsGazeboRosMultibeamSonar::PublishSonarImage(SonarFrame &_frame)
+{
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "PublishSonarImage");
+  const NpsGazeboSonar::SonarOutputs &outputs = _frame.outputs;
+  if (outputs.Spectrum())
+    this->PublishBeams(_frame);
+
+  const cv::Mat &depth_image = _frame.depth_image;
+  const cv::Mat &normal_image = _frame.normal_image;
+  const common::Time &stamp = _frame.stamp;
+  cv_bridge::CvImage img_bridge;
+
+  // Still publishing the depth and normal image (just because)
+  if (outputs.depth)
+  {
+    // Depth image
+    this->depth_image_msg_.header.frame_id
+          = this->frame_name_;
+    this->depth_image_msg_.header.stamp.sec
+          = stamp.sec;
+    this->depth_image_msg_.header.stamp.nsec
+          = stamp.nsec;
+    img_bridge = cv_bridge::CvImage(this->depth_image_msg_.header,
+                                    sensor_msgs::image_encodings::TYPE_32FC1,
+                                    depth_image);
+    // from cv_bridge to sensor_msgs::Image
+    img_bridge.toImageMsg(this->depth_image_msg_);
+    {
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish depth_image");
+      this->depth_image_pub_.publish(this->depth_image_msg_);
+    }
+  }
+
+  if (outputs.normal)
+  {
+    // Normal image
+    this->normal_image_msg_.header.frame_id
+          = this->frame_name_;
+    this->normal_image_msg_.header.stamp.sec
+          = stamp.sec;
+    this->normal_image_msg_.header.stamp.nsec
+          = stamp.nsec;
+    cv::Mat normal_image8;
+    normal_image.convertTo(normal_image8, CV_8UC3, 255.0);
+    img_bridge = cv_bridge::CvImage(this->normal_image_msg_.header,
+                                    sensor_msgs::image_encodings::RGB8,
+                                    normal_image8);
+    img_bridge.toImageMsg(this->normal_image_msg_);
+    // from cv_bridge to sensor_msgs::Image
+    {
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish normal_image");
+      this->normal_image_pub_.publish(this->normal_image_msg_);
+    }
+  }
+
+  if (outputs.Spectrum())
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_FRAME, _frame.start);
+}
+
+/////////////////////////////////////////////////
+// Range FFT of a frame and the outputs built from its beams
+void NpsGazeboRosMultibeamSonar::PublishBeams(SonarFrame &_frame)
+{
+  const common::Time &stamp = _frame.stamp;
+  double hFOV = this->parentSensor->DepthCamera()->HFOV().Radian();
+  double hPixelSize = hFOV / this->width;
+
+  // For calc time measure
+  auto start = std::chrono::high_resolution_clock::now();
+  this->sonarEngine->Transform(_frame.P_Beams);
+  if (this->calculationMode != "timedomain")
+  {
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_FFT,
+                                this->sonarEngine->LastStageTimes().fft);
+    NpsGazeboSonar::TraceEngineStages(this->traceSensor,
+                                      this->sonarEngine->LastStageTimes(), true);
+  }
+  // Everything below serializes range by range
+  auto stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+  {
+    NpsGazeboSonar::TraceSpan span(this->traceSensor, "range_major");
+    _frame.P_Beams.UpdateRangeMajor();
+  }
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_RANGE_MAJOR, stageStart);
 
   // For calc time measure
   auto stop = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<
+  auto duration = _frame.calcTime + std::chrono::duration_cast<
                   std::chrono::microseconds>(stop - start);
   if (debugFlag)
   {
-    ROS_INFO_STREAM("GPU Sonar Frame Calc Time " <<
+    ROS_INFO_STREAM("Sonar Frame Calc Time " <<
                     duration.count()/10000 << "/100 [s]\n");
   }
 
@@ -874,13 +1513,14 @@ void NpsGazeboRosMultibeamSonar::ComputeSonarImage(const float *_src)
 
   // CSV log write stream
   // Each cols corresponds to each beams
-  if (this->writeLogFlag)
+  if (_frame.outputs.log)
   {
     this->writeCounter = this->writeCounter + 1;
     if (this->writeCounter == 1
         ||this->writeCounter % this->writeInterval == 0)
     {
-      double time = this->parentSensor_->LastMeasurementTime().Double();
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "csv_log");
+      double time = stamp.Double();
       std::stringstream filename;
       filename << "/tmp/SonarRawData_" << std::setw(6) <<  std::setfill('0')
                << this->writeNumber << ".csv";
@@ -890,18 +1530,19 @@ void NpsGazeboRosMultibeamSonar::ComputeSonarImage(const float *_src)
       writeLog << "# First column is range vector\n";
       writeLog << "#  nBeams : " << nBeams << "\n";
       writeLog << "# Simulation time : " << time << "\n";
-      for (size_t i = 0; i < P_Beams[0].size(); i++)
+      for (int i = 0; i < _frame.P_Beams.Ranges(); i++)
       {
         // writing range vector at first column
         writeLog << this->rangeVector[i];
+        const Complex *P_Range = _frame.P_Beams.Range(i);
         for (size_t b = 0; b < nBeams; b ++)
         {
-          if (P_Beams[b][i].imag() > 0)
-            writeLog << "," << P_Beams[b][i].real()
-                     << "+" << P_Beams[b][i].imag() << "i";
+          if (P_Range[b].imag() > 0)
+            writeLog << "," << P_Range[b].real()
+                     << "+" << P_Range[b].imag() << "i";
           else
-            writeLog << "," << P_Beams[b][i].real()
-                     << P_Beams[b][i].imag() << "i";
+            writeLog << "," << P_Range[b].real()
+                     << P_Range[b].imag() << "i";
         }
         writeLog << "\n";
       }
@@ -912,12 +1553,13 @@ void NpsGazeboRosMultibeamSonar::ComputeSonarImage(const float *_src)
   }
 
   // Sonar image ROS msg
+  stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
   this->sonar_image_raw_msg_.header.frame_id
         = this->frame_name_.c_str();
   this->sonar_image_raw_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
+        = stamp.sec;
   this->sonar_image_raw_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
+        = stamp.nsec;
   this->sonar_image_raw_msg_.frequency = this->sonarFreq;
   this->sonar_image_raw_msg_.sound_speed = this->soundSpeed;
   this->sonar_image_raw_msg_.azimuth_beamwidth = hPixelSize;
@@ -929,258 +1571,188 @@ void NpsGazeboRosMultibeamSonar::ComputeSonarImage(const float *_src)
                     0.5 * static_cast<double>(width), fl));
   this->sonar_image_raw_msg_.azimuth_angles = azimuth_angles;
   std::vector<float> ranges;
-  for (size_t i = 0; i < P_Beams[0].size(); i ++)
+  for (int i = 0; i < _frame.P_Beams.Ranges(); i ++)
     ranges.push_back(rangeVector[i]);
   this->sonar_image_raw_msg_.ranges = ranges;
 
   // this->sonar_image_raw_msg_.is_bigendian = false;
   this->sonar_image_raw_msg_.data_size = 1;  // sizeof(float) * nFreq * nBeams;
-  std::vector<uchar> intensities;
-  int Intensity[nBeams][nFreq];
-  for (size_t f = 0; f < nFreq; f ++)
+  if (_frame.outputs.raw)
   {
-    for (size_t beam = 0; beam < nBeams; beam ++)
+    // Serialize beams in reverse order to flip the data left to right
+    NpsGazeboSonar::QuantizeIntensities(_frame.P_Beams, this->sensorGain, true,
+                                        this->sonar_image_raw_msg_.intensities);
     {
-      // Serialize beams in reverse order to flip the data left to right
-      const size_t beam_idx = nBeams-beam-1;
-      Intensity[beam_idx][f] = static_cast<int>(this->sensorGain * abs(P_Beams[beam_idx][f]));
-      uchar counts = static_cast<uchar>(std::min(UCHAR_MAX, Intensity[beam_idx][f]));
-
-      intensities.push_back(counts);
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish sonar_image_raw");
+      this->sonar_image_raw_pub_.publish(this->sonar_image_raw_msg_);
     }
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_RAW_IMAGE, stageStart);
   }
-  this->sonar_image_raw_msg_.intensities = intensities;
-  this->sonar_image_raw_pub_.publish(this->sonar_image_raw_msg_);
-
-  // Construct visual sonar image for rqt plot in sensor::image msg format
-  cv_bridge::CvImage img_bridge;
-
-  // Generate image of 328UC1
-  cv::Mat Intensity_image = cv::Mat::zeros(cv::Size(nBeams, nFreq), CV_8UC1);
 
-  const float rangeMax = maxDistance;
-  const float rangeRes = ranges[1]-ranges[0];
-  const int nEffectiveRanges = ceil(rangeMax / rangeRes);
-  const unsigned int radius = Intensity_image.size().height;
-  const cv::Point origin(Intensity_image.size().width/2,
-                         Intensity_image.size().height);
-  const float binThickness = 2 * ceil(radius / nEffectiveRanges);
-
-  struct BearingEntry
+  if (_frame.outputs.fan)
   {
-    float begin, center, end;
-    BearingEntry(float b, float c, float e)
-      : begin(b), center(c), end(e)
-        {;}
-  };
-
-  std::vector<BearingEntry> angles;
-  angles.reserve(nBeams);
+    // Construct visual sonar image for rqt plot in sensor::image msg format
+    stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+    cv_bridge::CvImage img_bridge;
 
-  for ( int b = 0; b < nBeams; ++b )
-  {
-    const float center = azimuth_angles[b];
-    float begin = 0.0, end = 0.0;
-    if (b == 0)
-    {
-      end = (azimuth_angles[b + 1] + center) / 2.0;
-      begin = 2 * center - end;
-    }
-    else if (b == nBeams - 1)
+    // Fan shaped image of the range-major beams
+    cv::Mat Itensity_image_color;
     {
-      begin = angles[b - 1].end;
-      end = 2 * center - begin;
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "fan_image");
+      Itensity_image_color = NpsGazeboSonar::RenderFanImage(
+        _frame.P_Beams, azimuth_angles, ranges, this->maxDistance, this->plotScaler);
     }
-    else
-    {
-      begin = angles[b - 1].end;
-      end = (azimuth_angles[b + 1] + center) / 2.0;
-    }
-    angles.push_back(BearingEntry(begin, center, end));
-  }
 
-  const float ThetaShift = 1.5*M_PI;
-  for ( int r = 0; r < ranges.size(); ++r )
-  {
-    if ( ranges[r] > rangeMax ) continue;
-    for ( int b = 0; b < nBeams; ++b )
+    // Publish final sonar image
+    this->sonar_image_msg_.header.frame_id
+          = this->frame_name_;
+    this->sonar_image_msg_.header.stamp.sec
+          = stamp.sec;
+    this->sonar_image_msg_.header.stamp.nsec
+          = stamp.nsec;
+    img_bridge = cv_bridge::CvImage(this->sonar_image_msg_.header,
+                                    sensor_msgs::image_encodings::BGR8,
+                                    Itensity_image_color);
+    // from cv_bridge to sensor_msgs::Image
+    img_bridge.toImageMsg(this->sonar_image_msg_);
+
     {
-      const float range = ranges[r];
-      const int intensity = floor(10.0*log(abs(P_Beams[nBeams - 1 - b][r])));
-      const float begin = angles[b].begin + ThetaShift,
-                  end = angles[b].end + ThetaShift;
-      const float rad = static_cast<float>(radius) * range/rangeMax;
-      // Assume angles are in image frame x-right, y-down
-      cv::ellipse(Intensity_image, origin, cv::Size(rad, rad), 0,
-                  begin * 180/M_PI, end * 180/M_PI,
-                  intensity, binThickness);
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish sonar_image");
+      this->sonar_image_pub_.publish(this->sonar_image_msg_);
     }
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_FAN_IMAGE, stageStart);
   }
-
-  // Normlize and colorize
-  cv::normalize(Intensity_image,Intensity_image,
-                -255 + this->plotScaler/10*255, 255, cv::NORM_MINMAX);
-  cv::Mat Itensity_image_color;
-  cv::applyColorMap(Intensity_image, Itensity_image_color, cv::COLORMAP_HOT);
-
-  // Publish final sonar image
-  this->sonar_image_msg_.header.frame_id
-        = this->frame_name_;
-  this->sonar_image_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->sonar_image_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
-  img_bridge = cv_bridge::CvImage(this->sonar_image_msg_.header,
-                                  sensor_msgs::image_encodings::BGR8,
-                                  Itensity_image_color);
-  // from cv_bridge to sensor_msgs::Image
-  img_bridge.toImageMsg(this->sonar_image_msg_);
-
-  this->sonar_image_pub_.publish(this->sonar_image_msg_);
-
-  // ---------------------------------------- End of sonar calculation
-
-  // Still publishing the depth and normal image (just because)
-  // Depth image
-  this->depth_image_msg_.header.frame_id
-        = this->frame_name_;
-  this->depth_image_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->depth_image_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
-  img_bridge = cv_bridge::CvImage(this->depth_image_msg_.header,
-                                  sensor_msgs::image_encodings::TYPE_32FC1,
-                                  depth_image);
-  // from cv_bridge to sensor_msgs::Image
-  img_bridge.toImageMsg(this->depth_image_msg_);
-  this->depth_image_pub_.publish(this->depth_image_msg_);
-
-  // Normal image
-  this->normal_image_msg_.header.frame_id
-        = this->frame_name_;
-  this->normal_image_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->normal_image_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
-  cv::Mat normal_image8;
-  normal_image.convertTo(normal_image8, CV_8UC3, 255.0);
-  img_bridge = cv_bridge::CvImage(this->normal_image_msg_.header,
-                                  sensor_msgs::image_encodings::RGB8,
-                                  normal_image8);
-  img_bridge.toImageMsg(this->normal_image_msg_);
-  // from cv_bridge to sensor_msgs::Image
-  this->normal_image_pub_.publish(this->normal_image_msg_);
-
-  this->lock_.unlock();
 }
 
 
 void NpsGazeboRosMultibeamSonar::ComputePointCloud(const float *_src)
 {
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "ComputePointCloud");
   this->lock_.lock();
 
-  this->point_cloud_msg_.header.frame_id
-        = this->frame_name_;
-  this->point_cloud_msg_.header.stamp.sec
-        = this->depth_sensor_update_time_.sec;
-  this->point_cloud_msg_.header.stamp.nsec
-        = this->depth_sensor_update_time_.nsec;
-  this->point_cloud_msg_.width = this->width;
-  this->point_cloud_msg_.height = this->height;
-  this->point_cloud_msg_.row_step
-        = this->point_cloud_msg_.point_step * this->width;
-
-  sensor_msgs::PointCloud2Modifier pcd_modifier(point_cloud_msg_);
-  pcd_modifier.setPointCloud2FieldsByString(2, "xyz", "rgb");
-  pcd_modifier.resize(this->height * this->width);
-
   // resize if point cloud image to camera parameters if required
   this->point_cloud_image_.create(this->height, this->width, CV_32FC1);
 
-  sensor_msgs::PointCloud2Iterator<float> iter_x(point_cloud_msg_, "x");
-  sensor_msgs::PointCloud2Iterator<float> iter_y(point_cloud_msg_, "y");
-  sensor_msgs::PointCloud2Iterator<float> iter_z(point_cloud_msg_, "z");
-  sensor_msgs::PointCloud2Iterator<uint8_t> iter_rgb(point_cloud_msg_, "rgb");
-  cv::MatIterator_<float> iter_image = this->point_cloud_image_.begin<float>();
-
-  point_cloud_msg_.is_dense = true;
-
-  float* toCopyFrom = const_cast<float*>(_src);
-  int index = 0;
-
+  // Ray angles only change with the resolution or the FOV
   double hfov = this->parentSensor->DepthCamera()->HFOV().Radian();
-  double fl = static_cast<double>(this->width) / (2.0 * tan(hfov/2.0));
-
-  for (uint32_t j = 0; j < this->height; j++)
+  if (this->rayAngles.Update(this->width, this->height, hfov))
+    std::copy(this->rayAngles.Elevations().begin(),
+              this->rayAngles.Elevations().end(), this->elevation_angles);
+  const double *tanAzimuths = this->rayAngles.TanAzimuths().data();
+  const double *tanElevations = this->rayAngles.TanElevations().data();
+
+  // The cloud is only assembled for subscribers, the range image is
+  // always needed by the sonar
+  CloudPoint *points = nullptr;
+  if (this->point_cloud_connect_count_ > 0)
   {
-    double elevation;
-    if (this->height > 1)
-      elevation = atan2(static_cast<double>(j) -
-                        0.5 * static_cast<double>(this->height), fl);
-    else
-      elevation = 0.0;
+    // A message still held by a subscriber must not change
+    if (!this->point_cloud_msg_ || !this->point_cloud_msg_.unique())
+      this->point_cloud_msg_.reset(new sensor_msgs::PointCloud2());
+    sensor_msgs::PointCloud2 &cloud = *this->point_cloud_msg_;
+    cloud.header.frame_id = this->frame_name_;
+    cloud.header.stamp.sec = this->depth_sensor_update_time_.sec;
+    cloud.header.stamp.nsec = this->depth_sensor_update_time_.nsec;
+    cloud.width = this->width;
+    cloud.height = this->height;
+    cloud.row_step = cloud.point_step * this->width;
+
+    sensor_msgs::PointCloud2Modifier pcd_modifier(cloud);
+    pcd_modifier.setPointCloud2FieldsByString(2, "xyz", "rgb");
+    pcd_modifier.resize(this->height * this->width);
+    assert(cloud.point_step == sizeof(CloudPoint));
+    points = reinterpret_cast<CloudPoint *>(cloud.data.data());
+  }
 
-    this->elevation_angles[j] = static_cast<float>(elevation);
+  // Color of each point from the camera image, if there is one
+  const size_t pixels = static_cast<size_t>(this->height) * this->width;
+  const uint8_t *image_src = this->image_msg_.data.data();
+  const int image_channels = this->image_msg_.data.size() == pixels * 3 ? 3
+    : (this->image_msg_.data.size() == pixels ? 1 : 0);
+
+  // Rows are independent: each is a multiply of the depth row by the
+  // column tangents and the row tangent
+  bool is_dense = true;
+  #pragma omp parallel for schedule(static) reduction(&&:is_dense)
+  for (int j = 0; j < static_cast<int>(this->height); j++)
+  {
+    const size_t rowStart = static_cast<size_t>(j) * this->width;
+    const float *depthRow = _src + rowStart;
+    float *imageRow = this->point_cloud_image_.ptr<float>(j);
+    CloudPoint *pointRow = points ? points + rowStart : nullptr;
+    const double tanElevation = tanElevations[j];
 
-    for (uint32_t i = 0; i < this->width;
-         i++, ++iter_x, ++iter_y, ++iter_z, ++iter_rgb, ++iter_image)
+    for (uint32_t i = 0; i < this->width; i++)
     {
-      double azimuth;
-      if (this->width > 1)
-        azimuth = atan2(static_cast<double>(i) -
-                        0.5 * static_cast<double>(this->width), fl);
-      else
-        azimuth = 0.0;
-
-      double depth = toCopyFrom[index++];
+      double depth = depthRow[i];
 
       // in optical frame hardcoded rotation
       // rpy(-M_PI/2, 0, -M_PI/2) is built-in
       // to urdf, where the *_optical_frame should have above relative
       // rotation from the physical camera *_frame
-      *iter_x = depth * tan(azimuth);
-      *iter_y = depth * tan(elevation);
+      float x = depth * tanAzimuths[i];
+      float y = depth * tanElevation;
+      float z = depth;
       if (depth > this->point_cloud_cutoff_)
       {
-        *iter_z = depth;
-        *iter_image = sqrt(*iter_x * *iter_x +
-                           *iter_y * *iter_y +
-                           *iter_z * *iter_z);
+        imageRow[i] = sqrt(x * x + y * y + z * z);
       }
       else  // point in the unseeable range
       {
-        *iter_x = *iter_y = *iter_z = std::numeric_limits<float>::quiet_NaN();
-        *iter_image = 0.0;
-        point_cloud_msg_.is_dense = false;
+        x = y = z = std::numeric_limits<float>::quiet_NaN();
+        imageRow[i] = 0.0;
+        is_dense = false;
+      }
+      if (pointRow)
+      {
+        pointRow[i].x = x;
+        pointRow[i].y = y;
+        pointRow[i].z = z;
       }
+    }
 
-      // put image color data for each point
-      uint8_t*  image_src = static_cast<uint8_t*>(&(this->image_msg_.data[0]));
-      if (this->image_msg_.data.size() == this->height * this->width*3)
+    // put image color data for each point
+    if (!pointRow)
+      continue;
+    const uint8_t *colorRow = image_src + rowStart * image_channels;
+    if (image_channels == 3)
+    {
+      // color
+      for (uint32_t i = 0; i < this->width; i++)
       {
-        // color
-        iter_rgb[0] = image_src[i*3+j*this->width*3+0];
-        iter_rgb[1] = image_src[i*3+j*this->width*3+1];
-        iter_rgb[2] = image_src[i*3+j*this->width*3+2];
+        pointRow[i].rgb[0] = colorRow[i*3+0];
+        pointRow[i].rgb[1] = colorRow[i*3+1];
+        pointRow[i].rgb[2] = colorRow[i*3+2];
       }
-      else if (this->image_msg_.data.size() == this->height * this->width)
+    }
+    else if (image_channels == 1)
+    {
+      // mono (or bayer?  @todo; fix for bayer)
+      for (uint32_t i = 0; i < this->width; i++)
       {
-        // mono (or bayer?  @todo; fix for bayer)
-        iter_rgb[0] = image_src[i+j*this->width];
-        iter_rgb[1] = image_src[i+j*this->width];
-        iter_rgb[2] = image_src[i+j*this->width];
+        pointRow[i].rgb[0] = colorRow[i];
+        pointRow[i].rgb[1] = colorRow[i];
+        pointRow[i].rgb[2] = colorRow[i];
       }
-      else
+    }
+    else
+    {
+      // no image, a reused message still has the last colors
+      for (uint32_t i = 0; i < this->width; i++)
       {
-        // no image
-        iter_rgb[0] = 0;
-        iter_rgb[1] = 0;
-        iter_rgb[2] = 0;
+        pointRow[i].rgb[0] = 0;
+        pointRow[i].rgb[1] = 0;
+        pointRow[i].rgb[2] = 0;
       }
     }
   }
-  if (this->point_cloud_connect_count_ > 0)
+
+  if (points)
+  {
+    this->point_cloud_msg_->is_dense = is_dense;
+    NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish point_cloud");
     this->point_cloud_pub_.publish(this->point_cloud_msg_);
+  }
 
   this->lock_.unlock();
 }
@@ -1211,58 +1783,6 @@ void NpsGazeboRosMultibeamSonar::ComputeCorrector()
   this->beamCorrectorSum = sqrt(this->beamCorrectorSum);
 }
 
-/////////////////////////////////////////////////
-cv::Mat NpsGazeboRosMultibeamSonar::ComputeNormalImage(cv::Mat& depth)
-{
-  // filters
-  cv::Mat_<float> f1 = (cv::Mat_<float>(3, 3) << 1,  2,  1,
-                                                 0,  0,  0,
-                                                -1, -2, -1) / 8;
-
-  cv::Mat_<float> f2 = (cv::Mat_<float>(3, 3) << 1, 0, -1,
-                                                 2, 0, -2,
-                                                 1, 0, -1) / 8;
-
-  cv::Mat f1m, f2m;
-  cv::flip(f1, f1m, 0);
-  cv::flip(f2, f2m, 1);
-
-  cv::Mat n1, n2;
-  cv::filter2D(depth, n1, -1, f1m, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
-  cv::filter2D(depth, n2, -1, f2m, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
-
-  cv::Mat no_readings;
-  cv::erode(depth == 0, no_readings, cv::Mat(), cv::Point(-1, -1), 2, 1, 1);
-  // cv::dilate(no_readings, no_readings, cv::Mat(),
-  //            cv::Point(-1, -1), 2, 1, 1);
-  n1.setTo(0, no_readings);
-  n2.setTo(0, no_readings);
-
-  std::vector<cv::Mat> images(3);
-  cv::Mat white = cv::Mat::ones(depth.rows, depth.cols, CV_32FC1);
-
-  // NOTE: with different focal lengths, the expression becomes
-  // (-dzx*fy, -dzy*fx, fx*fy)
-  images.at(0) = n1;    // for green channel
-  images.at(1) = n2;    // for red channel
-  images.at(2) = 1.0/this->focal_length_*depth;  // for blue channel
-
-  cv::Mat normal_image;
-  cv::merge(images, normal_image);
-
-  for (int i = 0; i < normal_image.rows; ++i)
-  {
-    for (int j = 0; j < normal_image.cols; ++j)
-    {
-      cv::Vec3f& n = normal_image.at<cv::Vec3f>(i, j);
-      n = cv::normalize(n);
-      float& d = depth.at<float>(i, j);
-    }
-  }
-  return normal_image;
-}
-
-
 /////////////////////////////////////////////////
 void NpsGazeboRosMultibeamSonar::PublishCameraInfo()
 {
@@ -17,6 +17,7 @@
 #include "ros/package.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <tf/tf.h>
 #include <sensor_msgs/image_encodings.h>
@@ -30,7 +31,7 @@
 #include <pcl/point_cloud.h>
 #include <pcl/features/normal_3d.h>
 
-#include <nps_uw_multibeam_sonar/sonar_calculation_cuda.cuh>
+#include <nps_uw_multibeam_sonar/sonar_calculation_cpu.hh>
 
 #include <opencv2/core/core.hpp>
 #include <boost/thread/thread.hpp>
@@ -61,6 +62,8 @@ NpsGazeboRosMultibeamSonarRay::NpsGazeboRosMultibeamSonarRay()
 : SensorPlugin(), width(0), height(0)
 {
   this->point_cloud_connect_count_ = 0;
+  this->normal_image_connect_count_ = 0;
+  this->sonar_image_raw_connect_count_ = 0;
   this->sonar_image_connect_count_ = 0;
 
   // for csv write logs
@@ -71,7 +74,13 @@ NpsGazeboRosMultibeamSonarRay::NpsGazeboRosMultibeamSonarRay()
 /////////////////////////////////////////////////
 NpsGazeboRosMultibeamSonarRay::~NpsGazeboRosMultibeamSonarRay()
 {
+  this->diagnosticsTimer.stop();
   this->newLaserFrameConnection.reset();
+  this->sonarPipeline.reset();
+
+  // The last sensor to stop closes the trace file
+  if (this->traceSensor >= 0)
+    NpsGazeboSonar::TraceRecorder::Instance().Stop();
 
   this->parentSensor.reset();
   this->laserCamera.reset();
@@ -134,6 +143,11 @@ void NpsGazeboRosMultibeamSonarRay::Load(sensors::SensorPtr _sensor,
   else
     this->sonar_image_topic_name_ =
       _sdf->GetElement("sonarImageTopicName")->Get<std::string>();
+  if (!_sdf->HasElement("diagnosticsTopicName"))
+    this->diagnostics_topic_name_ = "sonar_diagnostics";
+  else
+    this->diagnostics_topic_name_ =
+      _sdf->GetElement("diagnosticsTopicName")->Get<std::string>();
 
   // Read sonar properties from model.sdf
   if (!_sdf->HasElement("verticalFOV"))
@@ -181,8 +195,66 @@ void NpsGazeboRosMultibeamSonarRay::Load(sensors::SensorPtr _sensor,
   else
     this->sensorGain =
       _sdf->GetElement("sensorGain")->Get<float>();
+  if (!_sdf->HasElement("computeBackend"))
+    this->computeBackend = "gpu";
+  else
+    this->computeBackend =
+      _sdf->GetElement("computeBackend")->Get<std::string>();
+  if (!_sdf->HasElement("calculationMode"))
+    this->calculationMode = "spectral";
+  else
+    this->calculationMode =
+      _sdf->GetElement("calculationMode")->Get<std::string>();
+  if (!_sdf->HasElement("kernelHalfWidth"))
+    this->kernelHalfWidth = 8;
+  else
+    this->kernelHalfWidth =
+      _sdf->GetElement("kernelHalfWidth")->Get<int>();
+  if (!_sdf->HasElement("timeDomainWindow"))
+    this->timeDomainWindow = false;
+  else
+    this->timeDomainWindow =
+      _sdf->GetElement("timeDomainWindow")->Get<bool>();
+  if (!_sdf->HasElement("correctorTolerance"))
+    this->correctorTolerance = 0.0;
+  else
+    this->correctorTolerance =
+      _sdf->GetElement("correctorTolerance")->Get<double>();
+  if (!_sdf->HasElement("rangeTableSize"))
+    this->rangeTableSize = 256;
+  else
+    this->rangeTableSize =
+      _sdf->GetElement("rangeTableSize")->Get<int>();
+  if (!_sdf->HasElement("pipelineDepth"))
+    this->pipelineDepth = 1;
+  else
+    this->pipelineDepth =
+      _sdf->GetElement("pipelineDepth")->Get<int>();
   // Configure skips
   if (this->raySkips == 0) this->raySkips = 1;
+  // At least one frame in flight, 1 runs the two stages back to back
+  if (this->pipelineDepth < 1) this->pipelineDepth = 1;
+  // Configure compute backend
+  if (this->computeBackend != "gpu" && this->computeBackend != "cpu")
+  {
+    gzerr << "Unknown computeBackend [" << this->computeBackend
+          << "], falling back to gpu" << std::endl;
+    this->computeBackend = "gpu";
+  }
+  if (!NpsGazeboSonar::SonarEngine::Built(this->computeBackend))
+  {
+    gzerr << "computeBackend [" << this->computeBackend << "] is not built "
+          << "(CUDA was not found at build time), falling back to cpu"
+          << std::endl;
+    this->computeBackend = "cpu";
+  }
+  // Configure calculation mode
+  if (this->calculationMode != "spectral" && this->calculationMode != "timedomain")
+  {
+    gzerr << "Unknown calculationMode [" << this->calculationMode
+          << "], falling back to spectral" << std::endl;
+    this->calculationMode = "spectral";
+  }
 
   this->constMu = true;
   this->mu = 1e-3;  // default constant mu
@@ -231,6 +303,20 @@ void NpsGazeboRosMultibeamSonarRay::Load(sensors::SensorPtr _sensor,
   ROS_INFO_STREAM("Calculation skips (Elevation) = "
       << this->raySkips);
   ROS_INFO_STREAM("# of Time data / Beam = " << this->nFreq);
+  if (this->computeBackend == "cpu")
+    ROS_INFO_STREAM("Compute backend : CPU ("
+        << NpsGazeboSonar::cpu_thread_count() << " threads)");
+  else
+    ROS_INFO_STREAM("Compute backend : GPU (CUDA)");
+  if (this->calculationMode == "timedomain")
+    ROS_INFO_STREAM("Calculation mode : Time domain (kernel half width "
+        << this->kernelHalfWidth << " bins"
+        << (this->timeDomainWindow ? ", Hamming window)" : ")"));
+  else
+    ROS_INFO_STREAM("Calculation mode : Spectral");
+  if (this->correctorTolerance > 0.0)
+    ROS_INFO_STREAM("Beam corrector tolerance = " << this->correctorTolerance);
+  ROS_INFO_STREAM("Sonar frames in flight = " << this->pipelineDepth);
   ROS_INFO_STREAM("==================================================");
   ROS_INFO_STREAM("");
 
@@ -292,6 +378,78 @@ void NpsGazeboRosMultibeamSonarRay::Load(sensors::SensorPtr _sensor,
   for (int i = 0; i < nBeams; i++)
       this->beamCorrector[i] = new float[nBeams];
   this->beamCorrectorSum = 0.0;
+  this->ComputeCorrector();
+
+  // Sonar engine is set up once, its working memory is reused every frame.
+  // Configuration and allocation errors show up here, at startup.
+  double vFOV = this->parentSensor->VertFOV();
+  double hFOV = this->parentSensor->HorzFOV();
+  double vPixelSize = vFOV / (this->height-1);
+  double hPixelSize = hFOV / (this->width-1);
+  NpsGazeboSonar::SonarConfig config;
+  config.nBeams = this->nBeams;
+  config.nRays = this->nRays;
+  config.raySkips = this->raySkips;
+  config.nFreq = this->nFreq;
+  config.hPixelSize = hPixelSize;
+  config.vPixelSize = vPixelSize;
+  config.hFOV = hFOV;
+  config.vFOV = vFOV;
+  config.beamAzimuthAngleWidth = hPixelSize;
+  config.beamElevationAngleWidth = verticalFOV/180*M_PI;
+  config.rayAzimuthAngleWidth = hPixelSize;
+  config.rayElevationAngleWidth = vPixelSize*(raySkips+1);
+  config.rayElevationAngles = this->elevation_angles;
+  config.soundSpeed = this->soundSpeed;
+  config.maxDistance = this->maxDistance;
+  config.sourceLevel = this->sourceLevel;
+  config.sonarFreq = this->sonarFreq;
+  config.bandwidth = this->bandwidth;
+  config.attenuation = this->attenuation;
+  config.window = this->window;
+  config.timeDomain = (this->calculationMode == "timedomain");
+  config.kernelHalfWidth = this->kernelHalfWidth;
+  config.timeDomainWindow = this->timeDomainWindow;
+  config.correctorTolerance = this->correctorTolerance;
+  config.rangeTableSize = this->rangeTableSize;
+  config.debugFlag = this->debugFlag;
+  this->sonarEngine =
+    NpsGazeboSonar::SonarEngine::Create(this->computeBackend, config);
+  this->sonarEngine->SetBeamCorrector(this->beamCorrector,
+                                      this->beamCorrectorSum);
+
+  // The laser callback computes the beam spectra, the FFT and publishing
+  // of a frame overlap the next frame on the pipeline thread
+  this->sonarPipeline.reset(new NpsGazeboSonar::FramePipeline<SonarFrame>(
+    this->pipelineDepth, boost::bind(
+      &NpsGazeboRosMultibeamSonarRay::PublishSonarImage, this, _1)));
+
+  // Optional Chrome trace of the frame work
+  std::string traceFile;
+  if (_sdf->HasElement("traceFile"))
+    traceFile = _sdf->GetElement("traceFile")->Get<std::string>();
+  traceFile = NpsGazeboSonar::TraceRecorder::TraceFile(traceFile);
+  if (!traceFile.empty())
+  {
+    // The recorder is shared by all sensors of the process and records
+    // to the file of the first one
+    const std::string recording =
+      NpsGazeboSonar::TraceRecorder::Instance().Start(traceFile);
+    if (recording.empty())
+    {
+      gzwarn << "Sonar trace file [" << traceFile
+             << "] could not be opened\n";
+    }
+    else
+    {
+      if (recording != traceFile)
+        gzwarn << "Sonar trace file [" << traceFile << "] ignored, the "
+               << "process already records to [" << recording << "]\n";
+      this->traceSensor = NpsGazeboSonar::TraceRecorder::Instance().
+        RegisterSensor(this->parentSensor->ScopedName());
+      ROS_INFO_STREAM("Sonar trace file : " << recording);
+    }
+  }
 
   this->load_connection_ =
     GazeboRosCameraUtils::OnLoad(
@@ -301,6 +459,7 @@ void NpsGazeboRosMultibeamSonarRay::Load(sensors::SensorPtr _sensor,
 
 void NpsGazeboRosMultibeamSonarRay::pointCloudSubThread()
 {
+  pthread_setname_np(pthread_self(), "sonar_cloud_sub");
   static const double timeout = 0.01;
   while (this->rosnode_->ok())
   {
@@ -333,8 +492,8 @@ void NpsGazeboRosMultibeamSonarRay::Advertise()
   ros::AdvertiseOptions normal_image_ao =
     ros::AdvertiseOptions::create<sensor_msgs::Image>(
       "/" + this->point_cloud_topic_name_ + "_normal_image", 1,
-      boost::bind(&NpsGazeboRosMultibeamSonarRay::SonarImageConnect, this),
-      boost::bind(&NpsGazeboRosMultibeamSonarRay::SonarImageDisconnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonarRay::NormalImageConnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonarRay::NormalImageDisconnect, this),
       ros::VoidPtr(), &this->camera_queue_);
   this->normal_image_pub_ = this->rosnode_->advertise(normal_image_ao);
 
@@ -342,8 +501,8 @@ void NpsGazeboRosMultibeamSonarRay::Advertise()
   ros::AdvertiseOptions sonar_image_raw_ao =
     ros::AdvertiseOptions::create<acoustic_msgs::SonarImage>(
       this->sonar_image_raw_topic_name_, 1,
-      boost::bind(&NpsGazeboRosMultibeamSonarRay::SonarImageConnect, this),
-      boost::bind(&NpsGazeboRosMultibeamSonarRay::SonarImageDisconnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonarRay::SonarImageRawConnect, this),
+      boost::bind(&NpsGazeboRosMultibeamSonarRay::SonarImageRawDisconnect, this),
       ros::VoidPtr(), &this->camera_queue_);
   this->sonar_image_raw_pub_ = this->rosnode_->advertise(sonar_image_raw_ao);
 
@@ -355,6 +514,38 @@ void NpsGazeboRosMultibeamSonarRay::Advertise()
       boost::bind(&NpsGazeboRosMultibeamSonarRay::SonarImageDisconnect, this),
       ros::VoidPtr(), &this->camera_queue_);
   this->sonar_image_pub_ = this->rosnode_->advertise(sonar_image_ao);
+
+  // Stage latencies and frame counters, published at 1 Hz
+  this->diagnostics_pub_ =
+    this->rosnode_->advertise<diagnostic_msgs::DiagnosticArray>(
+      this->diagnostics_topic_name_, 1);
+  ros::WallTimerOptions diagnostics_to(ros::WallDuration(1.0),
+      boost::bind(&NpsGazeboRosMultibeamSonarRay::PublishDiagnostics, this, _1),
+      &this->camera_queue_);
+  this->diagnosticsTimer = this->rosnode_->createWallTimer(diagnostics_to);
+}
+
+/////////////////////////////////////////////////
+void NpsGazeboRosMultibeamSonarRay::PublishDiagnostics(
+    const ros::WallTimerEvent &_event)
+{
+  NpsGazeboSonar::SonarCounters counters;
+  // The laser callback waits for a free frame, no frames are dropped
+  counters.framesInFlight = this->sonarPipeline->InFlight();
+  counters.pipelineDepth = this->sonarPipeline->Depth();
+  const double updateRate = this->parentSensor->UpdateRate();
+
+  diagnostic_msgs::DiagnosticArray diagnostics;
+  diagnostics.header.stamp = ros::Time::now();
+  diagnostics.status.resize(1);
+  NpsGazeboSonar::FillSonarDiagnostics(
+    this->parentSensor->ScopedName(), this->frame_name_,
+    this->stageLatencies, counters,
+    updateRate > 0.0 ? 1.0 / updateRate : 0.0, diagnostics.status[0]);
+  this->diagnostics_pub_.publish(diagnostics);
+
+  // The statistics cover the last intervals only
+  this->stageLatencies.Rotate();
 }
 
 void NpsGazeboRosMultibeamSonarRay::PointCloudConnect()
@@ -366,7 +557,33 @@ void NpsGazeboRosMultibeamSonarRay::PointCloudConnect()
 void NpsGazeboRosMultibeamSonarRay::PointCloudDisconnect()
 {
   this->point_cloud_connect_count_--;
-  if (this->point_cloud_connect_count_ <= 0)
+  if (!this->HasSubscribers())
+    this->parentSensor->SetActive(false);
+}
+
+void NpsGazeboRosMultibeamSonarRay::NormalImageConnect()
+{
+  this->normal_image_connect_count_++;
+  this->parentSensor->SetActive(true);
+}
+
+void NpsGazeboRosMultibeamSonarRay::NormalImageDisconnect()
+{
+  this->normal_image_connect_count_--;
+  if (!this->HasSubscribers())
+    this->parentSensor->SetActive(false);
+}
+
+void NpsGazeboRosMultibeamSonarRay::SonarImageRawConnect()
+{
+  this->sonar_image_raw_connect_count_++;
+  this->parentSensor->SetActive(true);
+}
+
+void NpsGazeboRosMultibeamSonarRay::SonarImageRawDisconnect()
+{
+  this->sonar_image_raw_connect_count_--;
+  if (!this->HasSubscribers())
     this->parentSensor->SetActive(false);
 }
 
@@ -379,102 +596,204 @@ void NpsGazeboRosMultibeamSonarRay::SonarImageConnect()
 void NpsGazeboRosMultibeamSonarRay::SonarImageDisconnect()
 {
   this->sonar_image_connect_count_--;
-  if (this->sonar_image_connect_count_ <= 0)
+  if (!this->HasSubscribers())
     this->parentSensor->SetActive(false);
 }
 
+/////////////////////////////////////////////////
+NpsGazeboSonar::SonarOutputs
+NpsGazeboRosMultibeamSonarRay::SubscribedOutputs() const
+{
+  NpsGazeboSonar::SonarOutputs outputs;
+  outputs.raw = this->sonar_image_raw_connect_count_ > 0;
+  outputs.fan = this->sonar_image_connect_count_ > 0;
+  outputs.normal = this->normal_image_connect_count_ > 0;
+  // The log is only written along with a subscribed output
+  outputs.log = this->writeLogFlag && (outputs.raw || outputs.fan
+                                       || outputs.normal);
+  return outputs;
+}
+
+/////////////////////////////////////////////////
+bool NpsGazeboRosMultibeamSonarRay::HasSubscribers() const
+{
+  return this->SubscribedOutputs().Any()
+         || this->point_cloud_connect_count_ > 0;
+}
+
 /////////////////////////////////////////////////
 void NpsGazeboRosMultibeamSonarRay::OnNewLaserFrame(const float *_image,
     unsigned int _width, unsigned int _height,
     unsigned int _depth, const std::string &_format)
 {
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "OnNewLaserFrame");
   this->sensor_update_time_ = this->parentSensor->LastMeasurementTime();
   if (this->parentSensor->IsActive())
   {
-    if (this->sonar_image_connect_count_ > 0
-        && this->point_cloud_image_.size().width != 0 )
-      this->ComputeSonarImage();
+    const NpsGazeboSonar::SonarOutputs outputs = this->SubscribedOutputs();
+    if (outputs.Any() && this->point_cloud_image_.size().width != 0 )
+    {
+      // Waits while the publisher is behind by the whole pipeline depth
+      auto stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+      SonarFrame *frame = this->sonarPipeline->Acquire();
+      if (!frame)
+        return;
+      this->stageLatencies.Record(NpsGazeboSonar::STAGE_PIPELINE_WAIT,
+                                  stageStart);
+      frame->stamp = this->sensor_update_time_;
+      frame->outputs = outputs;
+      frame->start = NpsGazeboSonar::StageLatencies::Clock::now();
+      this->ComputeSonarImage(*frame);
+      this->sonarPipeline->Submit(frame);
+    }
   }
   else
   {
-    if (this->sonar_image_connect_count_ > 0)
+    if (this->HasSubscribers())
       this->parentSensor->SetActive(true);
   }
 }
 
 /////////////////////////////////////////////////
 // Most of the plugin work happens here
-void NpsGazeboRosMultibeamSonarRay::ComputeSonarImage()
+void NpsGazeboRosMultibeamSonarRay::ComputeSonarImage(SonarFrame &_frame)
 {
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "ComputeSonarImage");
+  // The point cloud subscriber refills the image, the frame keeps its
+  // own copy until it is published
   this->lock_.lock();
+  this->point_cloud_image_.copyTo(_frame.depth_image);
+  this->lock_.unlock();
 
-  cv::Mat depth_image = this->point_cloud_image_;
-  cv::Mat normal_image = this->ComputeNormalImage(depth_image);
-  double vFOV = this->parentSensor->VertFOV();
-  double hFOV = this->parentSensor->HorzFOV();
-  double vPixelSize = vFOV / (this->height-1);
-  double hPixelSize = hFOV / (this->width-1);
-
-  if (this->beamCorrectorSum == 0)
-    ComputeCorrector();
+  // Normals and beams are only computed for the outputs that need them
+  const NpsGazeboSonar::SonarOutputs &outputs = _frame.outputs;
+  if (!outputs.Spectrum() && !outputs.normal)
+    return;
+  auto stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+  {
+    NpsGazeboSonar::TraceSpan span(this->traceSensor, "normals");
+    _frame.normal_image =
+      NpsGazeboSonar::ComputeNormalImage(_frame.depth_image, this->focal_length_);
+  }
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_NORMALS, stageStart);
+  if (!outputs.Spectrum())
+    return;
+  const cv::Mat &depth_image = _frame.depth_image;
+  const cv::Mat &normal_image = _frame.normal_image;
 
   // Default value for reflectivity
   if (this->reflectivityImage.rows == 0)
-    this->reflectivityImage = cv::Mat(width, height, CV_32FC1, cv::Scalar(this->mu));
+    this->reflectivityImage = cv::Mat(height, width, CV_32FC1, cv::Scalar(this->mu));
 
   // For calc time measure
   auto start = std::chrono::high_resolution_clock::now();
   // ------------------------------------------------//
   // --------      Sonar calculations       -------- //
   // ------------------------------------------------//
-  CArray2D P_Beams = NpsGazeboSonar::sonar_calculation_wrapper(
+  // Up to the range FFT, which runs with the rest of the frame on the
+  // publisher thread while the next frame is computed here
+  this->sonarEngine->ComputeSpectrum(
                   depth_image,   // cv::Mat& depth_image
                   normal_image,  // cv::Mat& normal_image
-                  rand_image,    // cv::Mat& rand_image
-                  hPixelSize,    // hPixelSize
-                  vPixelSize,    // vPixelSize
-                  hFOV,          // hFOV
-                  vFOV,          // VFOV
-                  hPixelSize,    // _beam_azimuthAngleWidth
-                  verticalFOV/180*M_PI,  // _beam_elevationAngleWidth
-                  hPixelSize,    // _ray_azimuthAngleWidth
-                  this->elevation_angles, // _ray_elevationAngles
-                  vPixelSize*(raySkips+1),  // _ray_elevationAngleWidth
-                  this->soundSpeed,    // _soundSpeed
-                  this->maxDistance,   // _maxDistance
-                  this->sourceLevel,   // _sourceLevel
-                  this->nBeams,        // _nBeams
-                  this->nRays,         // _nRays
-                  this->raySkips,      // _raySkips
-                  this->sonarFreq,     // _sonarFreq
-                  this->bandwidth,     // _bandwidth
-                  this->nFreq,         // _nFreq
+                  this->rand_image,         // cv::Mat& rand_image
                   this->reflectivityImage,  // reflectivity_image
-                  this->attenuation,   // _attenuation
-                  this->window,        // _window
-                  this->beamCorrector,      // _beamCorrector
-                  this->beamCorrectorSum,   // _beamCorrectorSum
-                  this->debugFlag);
+                  _frame.P_Beams);
+
+  // For calc time measure
+  auto stop = std::chrono::high_resolution_clock::now();
+  _frame.calcTime = std::chrono::duration_cast<
+                    std::chrono::microseconds>(stop - start);
+  const NpsGazeboSonar::StageTimes &times = this->sonarEngine->LastStageTimes();
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_SUMMATION, times.summation);
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_CORRECTION, times.correction);
+  NpsGazeboSonar::TraceEngineStages(this->traceSensor, times, false);
+}
+
+/////////////////////////////////////////////////
+// Second stage of a sonar frame, on the publisher thread
+void NpsGazeboRosMultibeamSonarRay::PublishSonarImage(SonarFrame &_frame)
+{
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "PublishSonarImage");
+  const NpsGazeboSonar::SonarOutputs &outputs = _frame.outputs;
+  if (outputs.Spectrum())
+    this->PublishBeams(_frame);
+
+  const cv::Mat &normal_image = _frame.normal_image;
+  const common::Time &stamp = _frame.stamp;
+  cv_bridge::CvImage img_bridge;
+
+  // Still publishing the normal image (just because)
+  if (outputs.normal)
+  {
+    this->normal_image_msg_.header.frame_id
+          = this->frame_name_;
+    this->normal_image_msg_.header.stamp.sec
+          = stamp.sec;
+    this->normal_image_msg_.header.stamp.nsec
+          = stamp.nsec;
+    cv::Mat normal_image8;
+    normal_image.convertTo(normal_image8, CV_8UC3, 255.0);
+    img_bridge = cv_bridge::CvImage(this->normal_image_msg_.header,
+                                    sensor_msgs::image_encodings::RGB8,
+                                    normal_image8);
+    img_bridge.toImageMsg(this->normal_image_msg_);
+    // from cv_bridge to sensor_msgs::Image
+    {
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish normal_image");
+      this->normal_image_pub_.publish(this->normal_image_msg_);
+    }
+  }
+
+  if (outputs.Spectrum())
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_FRAME, _frame.start);
+}
+
+/////////////////////////////////////////////////
+// Range FFT of a frame and the outputs built from its beams
+void NpsGazeboRosMultibeamSonarRay::PublishBeams(SonarFrame &_frame)
+{
+  const common::Time &stamp = _frame.stamp;
+  double hFOV = this->parentSensor->HorzFOV();
+  double hPixelSize = hFOV / (this->width-1);
+
+  // For calc time measure
+  auto start = std::chrono::high_resolution_clock::now();
+  this->sonarEngine->Transform(_frame.P_Beams);
+  if (this->calculationMode != "timedomain")
+  {
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_FFT,
+                                this->sonarEngine->LastStageTimes().fft);
+    NpsGazeboSonar::TraceEngineStages(this->traceSensor,
+                                      this->sonarEngine->LastStageTimes(), true);
+  }
+  // Everything below serializes range by range
+  auto stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+  {
+    NpsGazeboSonar::TraceSpan span(this->traceSensor, "range_major");
+    _frame.P_Beams.UpdateRangeMajor();
+  }
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_RANGE_MAJOR, stageStart);
 
   // For calc time measure
   auto stop = std::chrono::high_resolution_clock::now();
-  auto duration = std::chrono::duration_cast<
+  auto duration = _frame.calcTime + std::chrono::duration_cast<
                   std::chrono::microseconds>(stop - start);
   if (debugFlag)
   {
-    ROS_INFO_STREAM("GPU Sonar Frame Calc Time " <<
+    ROS_INFO_STREAM("Sonar Frame Calc Time " <<
                     duration.count()/10000 << "/100 [s]\n");
   }
 
   // CSV log write stream
   // Each cols corresponds to each beams
-  if (this->writeLogFlag)
+  if (_frame.outputs.log)
   {
     this->writeCounter = this->writeCounter + 1;
     if (this->writeCounter == 1
         ||this->writeCounter % this->writeInterval == 0)
     {
-      double time = this->parentSensor_->LastMeasurementTime().Double();
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "csv_log");
+      double time = stamp.Double();
       std::stringstream filename;
       filename << "/tmp/SonarRawData_" << std::setw(6) <<  std::setfill('0')
                << this->writeNumber << ".csv";
@@ -484,18 +803,19 @@ void NpsGazeboRosMultibeamSonarRay::ComputeSonarImage()
       writeLog << "# First column is range vector\n";
       writeLog << "#  nBeams : " << nBeams << "\n";
       writeLog << "# Simulation time : " << time << "\n";
-      for (size_t i = 0; i < P_Beams[0].size(); i++)
+      for (int i = 0; i < _frame.P_Beams.Ranges(); i++)
       {
         // writing range vector at first column
         writeLog << this->rangeVector[i];
+        const Complex *P_Range = _frame.P_Beams.Range(i);
         for (size_t b = 0; b < nBeams; b ++)
         {
-          if (P_Beams[b][i].imag() > 0)
-            writeLog << "," << P_Beams[b][i].real()
-                     << "+" << P_Beams[b][i].imag() << "i";
+          if (P_Range[b].imag() > 0)
+            writeLog << "," << P_Range[b].real()
+                     << "+" << P_Range[b].imag() << "i";
           else
-            writeLog << "," << P_Beams[b][i].real()
-                     << P_Beams[b][i].imag() << "i";
+            writeLog << "," << P_Range[b].real()
+                     << P_Range[b].imag() << "i";
         }
         writeLog << "\n";
       }
@@ -522,147 +842,75 @@ void NpsGazeboRosMultibeamSonarRay::ComputeSonarImage()
   }
 
   // Sonar image ROS msg
+  stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
   this->sonar_image_raw_msg_.header.frame_id
         = this->frame_name_.c_str();
   this->sonar_image_raw_msg_.header.stamp.sec
-        = this->sensor_update_time_.sec;
+        = stamp.sec;
   this->sonar_image_raw_msg_.header.stamp.nsec
-        = this->sensor_update_time_.nsec;
+        = stamp.nsec;
   this->sonar_image_raw_msg_.frequency = this->sonarFreq;
   this->sonar_image_raw_msg_.sound_speed = this->soundSpeed;
   this->sonar_image_raw_msg_.azimuth_beamwidth = hPixelSize;
   this->sonar_image_raw_msg_.elevation_beamwidth = hPixelSize*this->nRays;
   this->sonar_image_raw_msg_.azimuth_angles = this->azimuth_angles;
   std::vector<float> ranges;
-  for (size_t i = 0; i < P_Beams[0].size(); i ++)
+  for (int i = 0; i < _frame.P_Beams.Ranges(); i ++)
     ranges.push_back(rangeVector[i]);
   this->sonar_image_raw_msg_.ranges = ranges;
   // this->sonar_image_raw_msg_.is_bigendian = false;
   this->sonar_image_raw_msg_.data_size = 1;  // sizeof(float) * nFreq * nBeams;
-  std::vector<uchar> intensities;
-  int Intensity[nBeams][nFreq];
-  for (size_t f = 0; f < nFreq; f ++)
+  if (_frame.outputs.raw)
   {
-    for (size_t beam = 0; beam < nBeams; beam ++)
+    NpsGazeboSonar::QuantizeIntensities(_frame.P_Beams, this->sensorGain, false,
+                                        this->sonar_image_raw_msg_.intensities);
     {
-      Intensity[beam][f] = static_cast<int>(this->sensorGain * abs(P_Beams[beam][f]));
-      uchar counts = static_cast<uchar>(std::min(UCHAR_MAX, Intensity[beam][f]));
-      intensities.push_back(counts);
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish sonar_image_raw");
+      this->sonar_image_raw_pub_.publish(this->sonar_image_raw_msg_);
     }
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_RAW_IMAGE, stageStart);
   }
-  this->sonar_image_raw_msg_.intensities = intensities;
-  this->sonar_image_raw_pub_.publish(this->sonar_image_raw_msg_);
-
-  // Construct visual sonar image for rqt plot in sensor::image msg format
-  cv_bridge::CvImage img_bridge;
 
-  // Generate image of CV_8UC1
-  cv::Mat Intensity_image = cv::Mat::zeros(cv::Size(nBeams, nFreq), CV_8UC1);
-
-  const float rangeMax = maxDistance;
-  const float rangeRes = ranges[1]-ranges[0];
-  const int nEffectiveRanges = ceil(rangeMax / rangeRes);
-  const unsigned int radius = Intensity_image.size().height;
-  const cv::Point origin(Intensity_image.size().width/2,
-                         Intensity_image.size().height);
-  const float binThickness = 2 * ceil(radius / nEffectiveRanges);
-
-  struct BearingEntry
+  if (_frame.outputs.fan)
   {
-    float begin, center, end;
-    BearingEntry(float b, float c, float e)
-      : begin(b), center(c), end(e)
-        {;}
-  };
+    // Construct visual sonar image for rqt plot in sensor::image msg format
+    stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
+    cv_bridge::CvImage img_bridge;
 
-  std::vector<BearingEntry> angles;
-  angles.reserve(nBeams);
-
-  for ( int b = 0; b < nBeams; ++b )
-  {
-    const float center = this->azimuth_angles[b];
-    float begin = 0.0, end = 0.0;
-    if (b == 0)
+    // Fan shaped image of the range-major beams
+    cv::Mat Itensity_image_color;
     {
-      end = (this->azimuth_angles[b + 1] + center) / 2.0;
-      begin = 2 * center - end;
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "fan_image");
+      Itensity_image_color = NpsGazeboSonar::RenderFanImage(
+        _frame.P_Beams, this->azimuth_angles, ranges, this->maxDistance, this->plotScaler);
     }
-    else if (b == nBeams - 1)
-    {
-      begin = angles[b - 1].end;
-      end = 2 * center - begin;
-    }
-    else
-    {
-      begin = angles[b - 1].end;
-      end = (this->azimuth_angles[b + 1] + center) / 2.0;
-    }
-    angles.push_back(BearingEntry(begin, center, end));
-  }
 
-  const float ThetaShift = 1.5*M_PI;
-  for ( int r = 0; r < ranges.size(); ++r )
-  {
-    if ( ranges[r] > rangeMax ) continue;
-    for ( int b = 0; b < nBeams; ++b )
+    // Publish final sonar image
+    this->sonar_image_msg_.header.frame_id
+          = this->frame_name_;
+    this->sonar_image_msg_.header.stamp.sec
+          = stamp.sec;
+    this->sonar_image_msg_.header.stamp.nsec
+          = stamp.nsec;
+    img_bridge = cv_bridge::CvImage(this->sonar_image_msg_.header,
+                                    sensor_msgs::image_encodings::BGR8,
+                                    Itensity_image_color);
+    // from cv_bridge to sensor_msgs::Image
+    img_bridge.toImageMsg(this->sonar_image_msg_);
+
     {
-      const float range = ranges[r];
-      const int intensity = floor(10.0*log(abs(P_Beams[nBeams - 1 - b][r])));
-      const float begin = angles[b].begin + ThetaShift,
-                  end = angles[b].end + ThetaShift;
-      const float rad = static_cast<float>(radius) * range/rangeMax;
-      // Assume angles are in image frame x-right, y-down
-      cv::ellipse(Intensity_image, origin, cv::Size(rad, rad), 0.0,
-                  begin * 180.0/M_PI, end * 180.0/M_PI,
-                  intensity, binThickness);
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish sonar_image");
+      this->sonar_image_pub_.publish(this->sonar_image_msg_);
     }
+    this->stageLatencies.Record(NpsGazeboSonar::STAGE_FAN_IMAGE, stageStart);
   }
-
-  // Normlize and colorize
-  cv::normalize(Intensity_image,Intensity_image,
-                -255 + this->plotScaler/10*255, 255, cv::NORM_MINMAX);
-  cv::Mat Itensity_image_color;
-  cv::applyColorMap(Intensity_image, Itensity_image_color, cv::COLORMAP_HOT);
-
-  // Publish final sonar image
-  this->sonar_image_msg_.header.frame_id
-        = this->frame_name_;
-  this->sonar_image_msg_.header.stamp.sec
-        = this->sensor_update_time_.sec;
-  this->sonar_image_msg_.header.stamp.nsec
-        = this->sensor_update_time_.nsec;
-  img_bridge = cv_bridge::CvImage(this->sonar_image_msg_.header,
-                                  sensor_msgs::image_encodings::BGR8,
-                                  Itensity_image_color);
-  // from cv_bridge to sensor_msgs::Image
-  img_bridge.toImageMsg(this->sonar_image_msg_);
-
-  this->sonar_image_pub_.publish(this->sonar_image_msg_);
-
-  // ---------------------------------------- End of sonar calculation
-
-  // Still publishing the normal image (just because)
-  this->normal_image_msg_.header.frame_id
-        = this->frame_name_;
-  this->normal_image_msg_.header.stamp.sec
-        = this->sensor_update_time_.sec;
-  this->normal_image_msg_.header.stamp.nsec
-        = this->sensor_update_time_.nsec;
-  cv::Mat normal_image8;
-  normal_image.convertTo(normal_image8, CV_8UC3, 255.0);
-  img_bridge = cv_bridge::CvImage(this->normal_image_msg_.header,
-                                  sensor_msgs::image_encodings::RGB8,
-                                  normal_image8);
-  img_bridge.toImageMsg(this->normal_image_msg_);
-  // from cv_bridge to sensor_msgs::Image
-  this->normal_image_pub_.publish(this->normal_image_msg_);
-
-  this->lock_.unlock();
 }
 
 /////////////////////////////////////////////////
 void NpsGazeboRosMultibeamSonarRay::UpdatePointCloud(const sensor_msgs::PointCloud2ConstPtr& _msg)
 {
+  NpsGazeboSonar::TraceSpan span(this->traceSensor, "UpdatePointCloud");
+  auto stageStart = NpsGazeboSonar::StageLatencies::Clock::now();
   this->lock_.lock();
 
   pcl::PointCloud<pcl::PointXYZI>::Ptr pcl_pointcloud(new pcl::PointCloud<pcl::PointXYZI>);
@@ -707,9 +955,13 @@ void NpsGazeboRosMultibeamSonarRay::UpdatePointCloud(const sensor_msgs::PointClo
   }
 
     if (this->point_cloud_connect_count_ > 0)
+    {
+      NpsGazeboSonar::TraceSpan span(this->traceSensor, "publish point_cloud");
       this->point_cloud_pub_.publish(this->point_cloud_msg_);
+    }
 
   this->lock_.unlock();
+  this->stageLatencies.Record(NpsGazeboSonar::STAGE_POINT_CLOUD, stageStart);
 }
 
 /////////////////////////////////////////////////
@@ -733,56 +985,4 @@ void NpsGazeboRosMultibeamSonarRay::ComputeCorrector()
   this->beamCorrectorSum = sqrt(this->beamCorrectorSum);
 }
 
-/////////////////////////////////////////////////
-cv::Mat NpsGazeboRosMultibeamSonarRay::ComputeNormalImage(cv::Mat& depth)
-{
-  // filters
-  cv::Mat_<float> f1 = (cv::Mat_<float>(3, 3) << 1,  2,  1,
-                                                 0,  0,  0,
-                                                -1, -2, -1) / 8;
-
-  cv::Mat_<float> f2 = (cv::Mat_<float>(3, 3) << 1, 0, -1,
-                                                 2, 0, -2,
-                                                 1, 0, -1) / 8;
-
-  cv::Mat f1m, f2m;
-  cv::flip(f1, f1m, 0);
-  cv::flip(f2, f2m, 1);
-
-  cv::Mat n1, n2;
-  cv::filter2D(depth, n1, -1, f1m, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
-  cv::filter2D(depth, n2, -1, f2m, cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
-
-  cv::Mat no_readings;
-  cv::erode(depth == 0, no_readings, cv::Mat(), cv::Point(-1, -1), 2, 1, 1);
-  // cv::dilate(no_readings, no_readings, cv::Mat(),
-  //            cv::Point(-1, -1), 2, 1, 1);
-  n1.setTo(0, no_readings);
-  n2.setTo(0, no_readings);
-
-  std::vector<cv::Mat> images(3);
-  cv::Mat white = cv::Mat::ones(depth.rows, depth.cols, CV_32FC1);
-
-  // NOTE: with different focal lengths, the expression becomes
-  // (-dzx*fy, -dzy*fx, fx*fy)
-  images.at(0) = n1;    // for green channel
-  images.at(1) = n2;    // for red channel
-  images.at(2) = 1.0/this->focal_length_*depth;  // for blue channel
-
-  cv::Mat normal_image;
-  cv::merge(images, normal_image);
-
-  for (int i = 0; i < normal_image.rows; ++i)
-  {
-    for (int j = 0; j < normal_image.cols; ++j)
-    {
-      cv::Vec3f& n = normal_image.at<cv::Vec3f>(i, j);
-      n = cv::normalize(n);
-      float& d = depth.at<float>(i, j);
-    }
-  }
-
-  return normal_image;
-}
-
 }
\ No newline at end of file
@@ -0,0 +1,366 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/reflectivity_database.hh>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <utility>
+
+namespace NpsGazeboSonar
+{
+  const char ReflectivityDatabase::catalogMagic[8] =
+    {'N', 'P', 'S', 'R', 'E', 'F', 'L', '\0'};
+
+  /// \brief Catalog header
+  struct CatalogHeader
+  {
+    /// \brief catalogMagic
+    char magic[8];
+
+    /// \brief catalogVersion
+    uint32_t version;
+
+    /// \brief Number of entries
+    uint32_t entries;
+
+    /// \brief Number of hash slots, a power of two
+    uint32_t slots;
+
+    /// \brief Bytes of the names
+    uint32_t namesSize;
+  };
+
+  /// \brief Catalog entry, entries are sorted by name
+  struct CatalogEntry
+  {
+    /// \brief Offset of the name in the names
+    uint32_t nameOffset;
+
+    /// \brief Length of the name
+    uint32_t nameLength;
+
+    /// \brief Hash of the name
+    uint32_t hash;
+
+    /// \brief Reflectivity
+    float reflectivity;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// \brief Hash of a name (FNV-1a)
+  static uint32_t NameHash(const char *_name, size_t _length)
+  {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < _length; i++)
+      hash = (hash ^ static_cast<uint8_t>(_name[i])) * 16777619u;
+    return hash;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  struct ReflectivityDatabase::Catalog
+  {
+    /// \brief Unmap the file
+    ~Catalog()
+    {
+      if (this->mapped)
+        munmap(this->mapped, this->mappedSize);
+    }
+
+    /// \brief Point the sections to an image after checking its layout
+    /// \param[in] _data Image
+    /// \param[in] _size Bytes of the image
+    /// \return Empty if the image is valid, else the problem
+    std::string Attach(const char *_data, size_t _size)
+    {
+      if (_size < sizeof(CatalogHeader))
+        return "truncated header";
+      this->header = reinterpret_cast<const CatalogHeader *>(_data);
+      if (memcmp(this->header->magic, catalogMagic, sizeof(catalogMagic)))
+        return "not a reflectivity catalog";
+      if (this->header->version != catalogVersion)
+        return "catalog version " + std::to_string(this->header->version)
+               + ", expected " + std::to_string(catalogVersion);
+      const uint32_t slots = this->header->slots;
+      if (slots == 0 || (slots & (slots - 1)) || slots <= this->header->entries)
+        return "bad hash table size";
+      const size_t size = sizeof(CatalogHeader)
+        + sizeof(CatalogEntry) * static_cast<size_t>(this->header->entries)
+        + sizeof(uint32_t) * static_cast<size_t>(slots)
+        + this->header->namesSize;
+      if (_size != size)
+        return "size does not match the header";
+
+      this->entries = reinterpret_cast<const CatalogEntry *>(
+        _data + sizeof(CatalogHeader));
+      this->slots = reinterpret_cast<const uint32_t *>(
+        this->entries + this->header->entries);
+      this->names = reinterpret_cast<const char *>(this->slots + slots);
+      for (uint32_t i = 0; i < this->header->entries; i++)
+      {
+        if (static_cast<uint64_t>(this->entries[i].nameOffset)
+            + this->entries[i].nameLength > this->header->namesSize)
+          return "name out of bounds";
+      }
+      for (uint32_t i = 0; i < slots; i++)
+      {
+        if (this->slots[i] > this->header->entries)
+          return "hash slot out of bounds";
+      }
+      return "";
+    }
+
+    /// \brief Image compiled in memory from a CSV file
+    std::vector<char> image;
+
+    /// \brief Mapped catalog file
+    void *mapped = nullptr;
+    size_t mappedSize = 0;
+
+    /// \brief Sections of the image
+    const CatalogHeader *header = nullptr;
+    const CatalogEntry *entries = nullptr;
+    /// \brief Entry index + 1 of each slot, 0 for empty
+    const uint32_t *slots = nullptr;
+    const char *names = nullptr;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  bool ReflectivityDatabase::Compile(const std::string &_csvPath,
+                                     std::vector<char> &_image,
+                                     std::string &_errors)
+  {
+    _image.clear();
+    std::ifstream csvFile(_csvPath);
+    if (!csvFile.is_open())
+    {
+      _errors += _csvPath + ": " + strerror(errno) + "\n";
+      return false;
+    }
+
+    // Last reflectivity of each name
+    std::map<std::string, float> rows;
+    bool valid = true;
+    std::string line;
+    int lineNumber = 0;
+    while (getline(csvFile, line))
+    {
+      // Data starts at the 4th line
+      if (++lineNumber <= 3)
+        continue;
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (line.empty())  // skip empty lines
+        continue;
+
+      const std::string where =
+        _csvPath + ":" + std::to_string(lineNumber) + ": ";
+      const size_t comma = line.find(',');
+      if (comma == std::string::npos || comma == 0)
+      {
+        _errors += where + "expected name,reflectivity\n";
+        valid = false;
+        continue;
+      }
+      const std::string name = line.substr(0, comma);
+      const std::string value = line.substr(comma + 1);
+      const size_t end = value.find(',');
+      std::string number = value.substr(0, end);
+      number.erase(0, number.find_first_not_of(" \t"));
+      number.erase(number.find_last_not_of(" \t") + 1);
+      char *parsed = nullptr;
+      errno = 0;
+      const float reflectivity = strtof(number.c_str(), &parsed);
+      if (number.empty() || errno == ERANGE
+          || parsed != number.c_str() + number.size())
+      {
+        _errors += where + "bad reflectivity '" + number + "'\n";
+        valid = false;
+        continue;
+      }
+      if (end != std::string::npos)
+        _errors += where + "extra columns ignored\n";
+      if (rows.count(name))
+        _errors += where + "'" + name + "' listed again, the last one is kept\n";
+      rows[name] = reflectivity;
+    }
+
+    // Sorted entries, hash table at most half full
+    uint32_t slots = 2;
+    while (slots < 2 * rows.size())
+      slots *= 2;
+    std::vector<CatalogEntry> entries;
+    std::vector<uint32_t> table(slots, 0);
+    std::string names;
+    for (const auto &row : rows)
+    {
+      CatalogEntry entry;
+      entry.nameOffset = static_cast<uint32_t>(names.size());
+      entry.nameLength = static_cast<uint32_t>(row.first.size());
+      entry.hash = NameHash(row.first.data(), row.first.size());
+      entry.reflectivity = row.second;
+      names += row.first;
+
+      uint32_t slot = entry.hash & (slots - 1);
+      while (table[slot])
+        slot = (slot + 1) & (slots - 1);
+      entries.push_back(entry);
+      table[slot] = static_cast<uint32_t>(entries.size());
+    }
+
+    CatalogHeader header;
+    memcpy(header.magic, catalogMagic, sizeof(catalogMagic));
+    header.version = catalogVersion;
+    header.entries = static_cast<uint32_t>(entries.size());
+    header.slots = slots;
+    header.namesSize = static_cast<uint32_t>(names.size());
+
+    const char *sections[] = {
+      reinterpret_cast<const char *>(&header),
+      reinterpret_cast<const char *>(entries.data()),
+      reinterpret_cast<const char *>(table.data()),
+      names.data()};
+    const size_t sizes[] = {
+      sizeof(header), sizeof(CatalogEntry) * entries.size(),
+      sizeof(uint32_t) * table.size(), names.size()};
+    for (int i = 0; i < 4; i++)
+      _image.insert(_image.end(), sections[i], sections[i] + sizes[i]);
+    return valid;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  std::string ReflectivityDatabase::MapCatalog(const std::string &_path,
+      std::shared_ptr<const Catalog> &_catalog)
+  {
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<const Catalog>> mapped;
+    std::lock_guard<std::mutex> lock(mutex);
+    _catalog = mapped[_path].lock();
+    if (_catalog)
+      return "";
+
+    const int fd = open(_path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return strerror(errno);
+    struct stat status;
+    if (fstat(fd, &status) < 0 || status.st_size <= 0)
+    {
+      close(fd);
+      return "empty catalog";
+    }
+    std::shared_ptr<Catalog> catalog(new Catalog());
+    catalog->mappedSize = static_cast<size_t>(status.st_size);
+    void *data = mmap(nullptr, catalog->mappedSize, PROT_READ, MAP_SHARED,
+                      fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+      return strerror(errno);
+    catalog->mapped = data;
+
+    const std::string problem =
+      catalog->Attach(static_cast<const char *>(data), catalog->mappedSize);
+    if (!problem.empty())
+      return problem;
+    mapped[_path] = catalog;
+    _catalog = catalog;
+    return "";
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  bool ReflectivityDatabase::Load(const std::string &_path,
+                                  std::string &_errors)
+  {
+    this->catalog.reset();
+
+    // A catalog starts with the magic, anything else is read as CSV
+    char magic[sizeof(catalogMagic)] = {};
+    {
+      std::ifstream file(_path, std::ios::binary);
+      if (!file.is_open())
+      {
+        _errors += _path + ": " + strerror(errno) + "\n";
+        return false;
+      }
+      file.read(magic, sizeof(magic));
+    }
+
+    if (!memcmp(magic, catalogMagic, sizeof(catalogMagic)))
+    {
+      std::shared_ptr<const Catalog> mapped;
+      const std::string problem = MapCatalog(_path, mapped);
+      if (!problem.empty())
+      {
+        _errors += _path + ": " + problem + "\n";
+        return false;
+      }
+      this->catalog = mapped;
+      return true;
+    }
+
+    std::shared_ptr<Catalog> compiled(new Catalog());
+    const bool valid = Compile(_path, compiled->image, _errors);
+    if (compiled->image.empty())
+      return false;
+    compiled->Attach(compiled->image.data(), compiled->image.size());
+    this->catalog = compiled;
+    return valid;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  int ReflectivityDatabase::Find(const std::string &_name) const
+  {
+    if (!this->catalog)
+      return -1;
+    const Catalog &catalog = *this->catalog;
+    const uint32_t mask = catalog.header->slots - 1;
+    const uint32_t hash = NameHash(_name.data(), _name.size());
+    uint32_t slot = hash & mask;
+    for (uint32_t probe = 0; probe <= mask && catalog.slots[slot];
+         probe++, slot = (slot + 1) & mask)
+    {
+      const uint32_t id = catalog.slots[slot] - 1;
+      const CatalogEntry &entry = catalog.entries[id];
+      if (entry.hash == hash && entry.nameLength == _name.size()
+          && !memcmp(catalog.names + entry.nameOffset, _name.data(),
+                     _name.size()))
+        return static_cast<int>(id);
+    }
+    return -1;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  float ReflectivityDatabase::Reflectivity(int _id) const
+  {
+    return this->catalog->entries[_id].reflectivity;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  size_t ReflectivityDatabase::Size() const
+  {
+    return this->catalog ? this->catalog->header->entries : 0;
+  }
+}  // namespace NpsGazeboSonar
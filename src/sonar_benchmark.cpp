@@ -0,0 +1,675 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+// Stage level benchmark of the sonar pipeline on synthetic images, without
+// Gazebo or ROS. The presets follow the shipped model.sdf files.
+//
+//   sonar_benchmark [--preset NAME|all] [--backend cpu|gpu] [--frames N]
+//                   [--mode spectral|timedomain|compare] [--tolerance TOL]
+//                   [--threads N,N,...]
+//
+// Reports wall time per frame, heap bytes allocated per frame and
+// throughput of each stage. Scattering and ray summation are fused in the
+// engines and are reported as one stage. The pipelined frame times are the
+// measured periods of the frame loop of the plugins, with one frame in
+// flight (the stages alternate) and with two (the stages overlap and split
+// the OpenMP threads). With --threads the presets are run once per OpenMP
+// thread count, followed by the speedup of the engine over the first count.
+// --mode compare instead reports the relative L2 error of the time domain
+// deposit magnitudes against the spectral path, per kernel half width,
+// with and without the Hamming window. The gpu backend also reports the
+// device memory the engine holds, as measured by cudaMemGetInfo.
+
+#include <nps_uw_multibeam_sonar/beam_range_buffer.hh>
+#include <nps_uw_multibeam_sonar/frame_pipeline.hh>
+#include <nps_uw_multibeam_sonar/sonar_engine.hh>
+#include <nps_uw_multibeam_sonar/sonar_pipeline.hh>
+
+#include <errno.h>
+#include <math.h>
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#ifdef NPS_SONAR_WITH_CUDA
+#include <cuda_runtime.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Heap byte counter. On glibc the malloc family is interposed, which also
+// catches cv::Mat and aligned buffers; elsewhere only operator new is.
+namespace
+{
+  std::atomic<uint64_t> allocatedBytes(0);
+}
+
+#if defined(__GLIBC__)
+extern "C"
+{
+  void *__libc_malloc(size_t _size);
+  void *__libc_calloc(size_t _n, size_t _size);
+  void *__libc_realloc(void *_ptr, size_t _size);
+  void *__libc_memalign(size_t _alignment, size_t _size);
+
+  void *malloc(size_t _size)
+  {
+    allocatedBytes += _size;
+    return __libc_malloc(_size);
+  }
+
+  void *calloc(size_t _n, size_t _size)
+  {
+    allocatedBytes += _n * _size;
+    return __libc_calloc(_n, _size);
+  }
+
+  void *realloc(void *_ptr, size_t _size)
+  {
+    allocatedBytes += _size;
+    return __libc_realloc(_ptr, _size);
+  }
+
+  void *memalign(size_t _alignment, size_t _size)
+  {
+    allocatedBytes += _size;
+    return __libc_memalign(_alignment, _size);
+  }
+
+  void *aligned_alloc(size_t _alignment, size_t _size)
+  {
+    allocatedBytes += _size;
+    return __libc_memalign(_alignment, _size);
+  }
+
+  int posix_memalign(void **_ptr, size_t _alignment, size_t _size)
+  {
+    allocatedBytes += _size;
+    *_ptr = __libc_memalign(_alignment, _size);
+    return *_ptr ? 0 : ENOMEM;
+  }
+}
+#else
+void *operator new(size_t _size)
+{
+  allocatedBytes += _size;
+  if (void *ptr = malloc(_size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *_ptr) noexcept
+{
+  free(_ptr);
+}
+#endif
+
+namespace
+{
+  /// \brief Sensor parameters of a shipped model.sdf
+  struct Preset
+  {
+    const char *name;
+    int width;              // beams
+    int height;             // rays
+    double hFOV;            // [rad]
+    double verticalFOV;     // [deg]
+    double sonarFreq;       // [Hz]
+    double bandwidth;       // [Hz]
+    double sourceLevel;     // [dB]
+    double maxDistance;     // [m]
+    int raySkips;
+    double sensorGain;
+  };
+
+  const Preset presets[] =
+  {
+    {"blueview_p900", 512, 228, 1.57079632679, 20, 900e3, 29.9e3, 220, 10, 10, 0.02},
+    {"blueview_m450", 512, 114, 1.54719755, 10, 450e3, 29.9e3, 220, 10, 10, 0.02},
+    {"seabat_f50", 256, 43, 2.44346, 24, 400e3, 29.9e3, 220, 10, 1, 0.02},
+    {"oculus_m1200d", 256, 102, 1.0471975512, 12, 2100e3, 265.5e3, 150, 1.2, 0, 1},
+  };
+
+  /// \brief Accumulated time and allocation of a stage
+  struct Stage
+  {
+    const char *name;
+    const char *unit;
+    double items = 0.0;     // per frame
+    int64_t ns = 0;
+    uint64_t bytes = 0;
+    bool measured = true;   // bytes are only known for separately run stages
+  };
+
+  /// \brief Frame of the two stage loop, as in the plugins
+  struct PipelineFrame
+  {
+    NpsGazeboSonar::BeamRangeBuffer P_Beams;
+    cv::Mat normal_image;
+  };
+
+  /// \brief Device memory in use by the process
+  /// \return Bytes in use, 0 without CUDA
+  uint64_t DeviceBytes()
+  {
+#ifdef NPS_SONAR_WITH_CUDA
+    size_t free = 0, total = 0;
+    if (cudaMemGetInfo(&free, &total) == cudaSuccess)
+      return total - free;
+#endif
+    return 0;
+  }
+
+  /// \brief Run a stage and charge its time and allocations
+  template <typename F>
+  void Measure(Stage &_stage, F _f)
+  {
+    const uint64_t bytes = allocatedBytes.load();
+    const auto start = std::chrono::steady_clock::now();
+    _f();
+    const auto stop = std::chrono::steady_clock::now();
+    _stage.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+    _stage.bytes += allocatedBytes.load() - bytes;
+  }
+
+  /// \brief Range of each ray to a flat seafloor seen from a tilted sensor,
+  /// with a sphere sitting on it. Rays that hit nothing read twice the
+  /// maximum range, as a depth camera reads its far clip, so that the
+  /// engines skip them.
+  cv::Mat SyntheticDepth(const Preset &_p, double _fl)
+  {
+    const double altitude = 0.5 * _p.maxDistance;
+    const double tilt = 30.0 / 180.0 * M_PI;
+    const double far = 2.0 * _p.maxDistance;
+    // sphere center in the optical frame (x right, y down, z forward)
+    const double cx = 0.1 * _p.maxDistance, cy = 0.35 * _p.maxDistance,
+                 cz = 0.6 * _p.maxDistance, radius = 0.1 * _p.maxDistance;
+
+    cv::Mat depth(_p.height, _p.width, CV_32FC1, cv::Scalar(0.0f));
+    for (int j = 0; j < _p.height; j++)
+    {
+      for (int i = 0; i < _p.width; i++)
+      {
+        double x = (i - 0.5 * _p.width) / _fl;
+        double y = (j - 0.5 * _p.height) / _fl;
+        double z = 1.0;
+        const double norm = sqrt(x * x + y * y + z * z);
+        x /= norm;
+        y /= norm;
+        z /= norm;
+
+        double range = far;
+        const double down = y * cos(tilt) + z * sin(tilt);
+        if (down > 0.0 && altitude / down < range)
+          range = altitude / down;
+
+        const double b = x * cx + y * cy + z * cz;
+        const double c = cx * cx + cy * cy + cz * cz - radius * radius;
+        if (b * b - c > 0.0)
+        {
+          const double hit = b - sqrt(b * b - c);
+          if (hit > 0.0 && hit < range)
+            range = hit;
+        }
+        depth.at<float>(j, i) = static_cast<float>(range);
+      }
+    }
+    return depth;
+  }
+
+  /// \brief Sensor parameters and synthetic inputs of a preset, derived
+  /// as in the plugin Load()
+  struct Sensor
+  {
+    explicit Sensor(const Preset &_p)
+    {
+      const double soundSpeed = 1500.0;
+      const float max_T = _p.maxDistance * 2.0 / soundSpeed;
+      nFreq = ceil(_p.bandwidth * max_T);
+      nBeams = _p.width;
+      nRays = _p.height;
+      const double hPixelSize = _p.hFOV / _p.width;
+      fl = _p.width / (2.0 * tan(_p.hFOV / 2.0));
+      const double vFOV = 2.0 * atan(0.5 * _p.height / fl);
+      const double vPixelSize = vFOV / _p.height;
+
+      elevation.resize(nRays);
+      for (int j = 0; j < nRays; j++)
+        elevation[j] = atan2(j - 0.5 * nRays, fl);
+      azimuth.resize(nBeams);
+      for (int i = 0; i < nBeams; i++)
+        azimuth[i] = atan2(i - 0.5 * nBeams, fl);
+      ranges.resize(nFreq);
+      for (int i = 0; i < nFreq; i++)
+        ranges[i] = i / _p.bandwidth * soundSpeed / 2.0;
+
+      window.resize(nFreq);
+      float windowSum = 0;
+      for (int f = 0; f < nFreq; f++)
+      {
+        window[f] = 0.54 - 0.46 * cos(2.0 * M_PI * (f + 1) / nFreq);
+        windowSum += window[f] * window[f];
+      }
+      for (int f = 0; f < nFreq; f++)
+        window[f] /= sqrt(windowSum);
+
+      correctorData.resize(nBeams * nBeams);
+      corrector.resize(nBeams);
+      correctorSum = 0;
+      for (int beam = 0; beam < nBeams; beam++)
+      {
+        corrector[beam] = &correctorData[beam * nBeams];
+        for (int other = 0; other < nBeams; other++)
+        {
+          const double t = M_PI * 0.884 / hPixelSize * sin(azimuth[beam] - azimuth[other]);
+          const double pattern = t == 0.0 ? 1.0 : sin(t) / t;
+          corrector[beam][other] = fabs(pattern);
+          correctorSum += pattern * pattern;
+        }
+      }
+      correctorSum = sqrt(correctorSum);
+
+      config.nBeams = nBeams;
+      config.nRays = nRays;
+      config.raySkips = _p.raySkips;
+      config.nFreq = nFreq;
+      config.hPixelSize = hPixelSize;
+      config.vPixelSize = vPixelSize;
+      config.hFOV = _p.hFOV;
+      config.vFOV = vFOV;
+      config.beamAzimuthAngleWidth = hPixelSize;
+      config.beamElevationAngleWidth = _p.verticalFOV / 180 * M_PI;
+      config.rayAzimuthAngleWidth = hPixelSize;
+      config.rayElevationAngleWidth = vPixelSize * (_p.raySkips + 1);
+      config.rayElevationAngles = elevation.data();
+      config.soundSpeed = soundSpeed;
+      config.maxDistance = _p.maxDistance;
+      config.sourceLevel = _p.sourceLevel;
+      config.sonarFreq = _p.sonarFreq;
+      config.bandwidth = _p.bandwidth;
+      config.attenuation = 0.0354 * log(10) / 20.0;
+      config.window = window.data();
+
+      depth = SyntheticDepth(_p, fl);
+      rand_image = cv::Mat(nRays, nBeams, CV_32FC2);
+      cv::RNG rng(12345);
+      rng.fill(rand_image, cv::RNG::NORMAL, 0.f, 1.f);
+      reflectivity = cv::Mat(nRays, nBeams, CV_32FC1, cv::Scalar(1e-3));
+    }
+
+    /// \brief Not copyable, the config points into the vectors
+    Sensor(const Sensor &) = delete;
+    Sensor &operator=(const Sensor &) = delete;
+
+    int nFreq;
+    int nBeams;
+    int nRays;
+    double fl;
+    std::vector<float> elevation;
+    std::vector<float> azimuth;
+    std::vector<float> ranges;
+    std::vector<float> window;
+    std::vector<float> correctorData;
+    std::vector<float *> corrector;
+    float correctorSum;
+    NpsGazeboSonar::SonarConfig config;
+    cv::Mat depth;
+    cv::Mat rand_image;
+    cv::Mat reflectivity;
+  };
+
+  /// \brief Create an engine, exits if the backend is not built
+  std::unique_ptr<NpsGazeboSonar::SonarEngine> CreateEngine(
+      const std::string &_backend, const Sensor &_sensor,
+      const NpsGazeboSonar::SonarConfig &_config)
+  {
+    std::unique_ptr<NpsGazeboSonar::SonarEngine> engine =
+      NpsGazeboSonar::SonarEngine::Create(_backend, _config);
+    if (!engine)
+    {
+      fprintf(stderr, "Unknown backend [%s]%s\n", _backend.c_str(),
+              _backend == "gpu" ? ", built without CUDA" : "");
+      exit(EXIT_FAILURE);
+    }
+    engine->SetBeamCorrector(
+      const_cast<float **>(_sensor.corrector.data()), _sensor.correctorSum);
+    return engine;
+  }
+
+  /// \brief Benchmark all stages of one preset
+  /// \return Engine time per frame [ns]
+  double Run(const Preset &_p, const std::string &_backend, int _frames,
+           bool _timeDomain, double _tolerance)
+  {
+    const Sensor sensor(_p);
+    const int nFreq = sensor.nFreq;
+    const int nBeams = sensor.nBeams;
+    const int nRays = sensor.nRays;
+    const double fl = sensor.fl;
+    const std::vector<float> &azimuth = sensor.azimuth;
+    const std::vector<float> &ranges = sensor.ranges;
+    const cv::Mat &depth = sensor.depth;
+    const cv::Mat &rand_image = sensor.rand_image;
+    const cv::Mat &reflectivity = sensor.reflectivity;
+
+    NpsGazeboSonar::SonarConfig config = sensor.config;
+    config.timeDomain = _timeDomain;
+    config.correctorTolerance = _tolerance;
+
+    // Taken before the engine exists, after the CUDA context does
+    const uint64_t deviceBytes = DeviceBytes();
+    std::unique_ptr<NpsGazeboSonar::SonarEngine> engine =
+      CreateEngine(_backend, sensor, config);
+
+    const int raySkips = std::max(1, _p.raySkips);
+    const double samples = static_cast<double>(nBeams) * nFreq;
+    Stage normals = {"normals", "Mpx/s", static_cast<double>(nBeams) * nRays};
+    Stage summation = {"scattering+summation", "Mray-bins/s",
+                       static_cast<double>(nBeams) * (nRays / raySkips) * nFreq};
+    Stage correction = {"beam correction", "Msamples/s", samples};
+    Stage fft = {"fft", "Msamples/s", _timeDomain ? 0.0 : samples};
+    Stage engineTotal = {"engine total", "Msamples/s", samples};
+    Stage transpose = {"range-major view", "Msamples/s", samples};
+    Stage quantize = {"intensity quantization", "Msamples/s", samples};
+    Stage fan = {"fan image", "Msamples/s", samples};
+    summation.measured = correction.measured = fft.measured = false;
+
+    NpsGazeboSonar::BeamRangeBuffer P_Beams;
+    std::vector<uint8_t> intensities;
+    cv::Mat normal_image, fanImage;
+
+    const int warmup = 2;
+    for (int frame = -warmup; frame < _frames; frame++)
+    {
+      // Warm up frames fill the caches and the reused buffers
+      if (frame == 0)
+      {
+        for (Stage *stage : {&normals, &summation, &correction, &fft,
+                             &engineTotal, &transpose, &quantize, &fan})
+        {
+          stage->ns = 0;
+          stage->bytes = 0;
+        }
+      }
+
+      Measure(normals, [&]
+        { normal_image = NpsGazeboSonar::ComputeNormalImage(depth, fl); });
+      Measure(engineTotal, [&]
+        { engine->Compute(depth, normal_image, rand_image, reflectivity, P_Beams); });
+      const NpsGazeboSonar::StageTimes &times = engine->LastStageTimes();
+      summation.ns += times.summation;
+      correction.ns += times.correction;
+      fft.ns += times.fft;
+      Measure(transpose, [&] { P_Beams.UpdateRangeMajor(); });
+      Measure(quantize, [&]
+        {
+          NpsGazeboSonar::QuantizeIntensities(P_Beams, _p.sensorGain, true,
+                                              intensities);
+        });
+      Measure(fan, [&]
+        {
+          fanImage = NpsGazeboSonar::RenderFanImage(P_Beams, azimuth, ranges,
+                                                    _p.maxDistance, 0.0);
+        });
+    }
+
+    printf("\n%s [%s, %s] %d beams x %d rays, raySkips %d, nFreq %d, %d frames\n",
+           _p.name, _backend.c_str(), _timeDomain ? "timedomain" : "spectral",
+           nBeams, nRays, _p.raySkips, nFreq, _frames);
+    printf("  %-24s %14s %14s %14s\n", "stage", "ns/frame", "bytes/frame",
+           "throughput");
+    int64_t total = 0;
+    for (const Stage *stage : {&normals, &summation, &correction, &fft,
+                               &engineTotal, &transpose, &quantize, &fan})
+    {
+      const double ns = static_cast<double>(stage->ns) / _frames;
+      char bytes[32] = "-";
+      if (stage->measured)
+        snprintf(bytes, sizeof(bytes), "%llu",
+                 static_cast<unsigned long long>(stage->bytes / _frames));
+      char throughput[32] = "-";
+      if (stage->items > 0.0 && ns > 0.0)
+        snprintf(throughput, sizeof(throughput), "%.1f %s",
+                 stage->items / ns * 1e3, stage->unit);
+      printf("  %-24s %14.0f %14s %14s\n", stage->name, ns, bytes, throughput);
+      if (stage->measured)
+        total += stage->ns;
+    }
+    printf("  %-24s %14.0f\n", "frame", static_cast<double>(total) / _frames);
+    // Working memory of the engine after the frames, including cuFFT plans
+    if (_backend == "gpu")
+      printf("  %-24s %14s %14llu\n", "device memory", "-",
+             static_cast<unsigned long long>(DeviceBytes() - deviceBytes));
+
+
+    // The plugins compute the spectra on their worker thread and leave the
+    // FFT and publishing to the pipeline thread. Time that loop as it runs.
+    const int threads = omp_get_max_threads();
+    for (size_t inFlight : {1, 2})
+    {
+      std::vector<uint8_t> stageIntensities;
+      cv::Mat stageFan;
+      NpsGazeboSonar::FramePipeline<PipelineFrame> pipeline(inFlight,
+        [&](PipelineFrame &_frame)
+        {
+          engine->Transform(_frame.P_Beams);
+          _frame.P_Beams.UpdateRangeMajor();
+          NpsGazeboSonar::QuantizeIntensities(_frame.P_Beams, _p.sensorGain,
+                                              true, stageIntensities);
+          stageFan = NpsGazeboSonar::RenderFanImage(_frame.P_Beams, azimuth,
+                                                    ranges, _p.maxDistance, 0.0);
+        });
+
+      auto start = std::chrono::steady_clock::now();
+      for (int frame = -warmup; frame < _frames; frame++)
+      {
+        if (frame == 0)
+          start = std::chrono::steady_clock::now();
+        PipelineFrame *next = pipeline.Acquire();
+        next->normal_image = NpsGazeboSonar::ComputeNormalImage(depth, fl);
+        engine->ComputeSpectrum(depth, next->normal_image, rand_image,
+                                reflectivity, next->P_Beams);
+        pipeline.Submit(next);
+      }
+      // Wait for the second stage of the last frames
+      while (pipeline.InFlight() > 0)
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      const auto stop = std::chrono::steady_clock::now();
+
+      char name[32];
+      snprintf(name, sizeof(name), "frame (pipelined, %zu)", inFlight);
+      printf("  %-24s %14.0f\n", name, static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          stop - start).count()) / _frames);
+    }
+    // Acquire() sets the team size of this thread for the first stage
+    omp_set_num_threads(threads);
+    printf("  %-24s %14d\n", "OpenMP threads", threads);
+    return static_cast<double>(engineTotal.ns) / _frames;
+  }
+
+  /// \brief Compare the time domain deposit with the spectral path of
+  /// one preset, as the relative L2 error of the magnitudes
+  void Compare(const Preset &_p, const std::string &_backend,
+               double _tolerance)
+  {
+    const Sensor sensor(_p);
+    NpsGazeboSonar::SonarConfig config = sensor.config;
+    config.correctorTolerance = _tolerance;
+    const cv::Mat normal_image =
+      NpsGazeboSonar::ComputeNormalImage(sensor.depth, sensor.fl);
+
+    auto compute = [&](NpsGazeboSonar::BeamRangeBuffer &_P_Beams)
+      {
+        CreateEngine(_backend, sensor, config)->Compute(
+          sensor.depth, normal_image, sensor.rand_image, sensor.reflectivity,
+          _P_Beams);
+      };
+    NpsGazeboSonar::BeamRangeBuffer spectral;
+    config.timeDomain = false;
+    compute(spectral);
+
+    printf("\n%s [%s] %d beams x %d rays, raySkips %d, nFreq %d\n",
+           _p.name, _backend.c_str(), sensor.nBeams, sensor.nRays,
+           _p.raySkips, sensor.nFreq);
+    printf("  timedomain vs spectral, relative L2 error of |P|\n");
+    printf("  %-24s %14s %14s\n", "kernelHalfWidth", "no window",
+           "window");
+    const int defaultHalfWidth = NpsGazeboSonar::SonarConfig().kernelHalfWidth;
+    for (int halfWidth : {4, 8, 16, 32, 64})
+    {
+      double error[2];
+      for (int window = 0; window < 2; window++)
+      {
+        NpsGazeboSonar::BeamRangeBuffer timeDomain;
+        config.timeDomain = true;
+        config.kernelHalfWidth = halfWidth;
+        config.timeDomainWindow = window == 1;
+        compute(timeDomain);
+
+        double difference = 0.0, reference = 0.0;
+        for (int beam = 0; beam < sensor.nBeams; beam++)
+        {
+          for (int f = 0; f < sensor.nFreq; f++)
+          {
+            const double a = std::abs(timeDomain(beam, f));
+            const double b = std::abs(spectral(beam, f));
+            difference += (a - b) * (a - b);
+            reference += b * b;
+          }
+        }
+        error[window] = reference > 0.0 ? sqrt(difference / reference) : 0.0;
+      }
+      char name[32];
+      snprintf(name, sizeof(name), "%d%s", halfWidth,
+               halfWidth == defaultHalfWidth ? " (default)" : "");
+      printf("  %-24s %13.1f%% %13.1f%%\n", name, 100.0 * error[0],
+             100.0 * error[1]);
+    }
+  }
+
+  void Usage(const char *_argv0)
+  {
+    fprintf(stderr, "Usage: %s [--preset NAME|all] [--backend cpu|gpu] "
+                    "[--frames N] [--mode spectral|timedomain|compare] "
+                    "[--tolerance TOL] [--threads N,N,...]\nPresets:", _argv0);
+    for (const Preset &p : presets)
+      fprintf(stderr, " %s", p.name);
+    fprintf(stderr, "\n");
+  }
+}  // namespace
+
+///////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+  std::string preset = "all";
+  std::string backend = "cpu";
+  std::string mode = "spectral";
+  int frames = 10;
+  double tolerance = 0.0;
+  std::vector<int> threads;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string arg = argv[i];
+    if (i + 1 >= argc)
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (arg == "--preset")
+      preset = argv[++i];
+    else if (arg == "--backend")
+      backend = argv[++i];
+    else if (arg == "--frames")
+      frames = std::max(1, atoi(argv[++i]));
+    else if (arg == "--mode")
+      mode = argv[++i];
+    else if (arg == "--tolerance")
+      tolerance = atof(argv[++i]);
+    else if (arg == "--threads")
+    {
+      for (char *n = strtok(argv[++i], ","); n; n = strtok(nullptr, ","))
+        threads.push_back(std::max(1, atoi(n)));
+    }
+    else
+    {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (mode != "spectral" && mode != "timedomain" && mode != "compare")
+  {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  bool found = false;
+  for (const Preset &p : presets)
+  {
+    if (preset != "all" && preset != p.name)
+      continue;
+    found = true;
+    if (mode == "compare")
+    {
+      Compare(p, backend, tolerance);
+      continue;
+    }
+    if (threads.empty())
+    {
+      Run(p, backend, frames, mode == "timedomain", tolerance);
+      continue;
+    }
+
+    // Scaling of the engine with the OpenMP thread count
+    std::vector<double> engineNs;
+    for (int n : threads)
+    {
+      omp_set_num_threads(n);
+      engineNs.push_back(Run(p, backend, frames, mode == "timedomain",
+                             tolerance));
+    }
+    printf("\n%s scaling [%s] on %d processors\n", p.name, backend.c_str(),
+           omp_get_num_procs());
+    printf("  %-24s %14s %14s %14s\n", "threads", "engine ns", "speedup",
+           "efficiency");
+    for (size_t k = 0; k < threads.size(); k++)
+    {
+      const double speedup = engineNs[0] / engineNs[k];
+      printf("  %-24d %14.0f %14.2f %13.0f%%\n", threads[k], engineNs[k],
+             speedup, 100.0 * speedup * threads[0] / threads[k]);
+    }
+  }
+  if (!found)
+  {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,301 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/sonar_calculation_cpu.hh>
+
+#include <omp.h>
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace NpsGazeboSonar
+{
+  namespace
+  {
+    ///////////////////////////////////////////////////////////////////////
+    // Transform of a flat spectrum of _n samples at a delay of _v bins,
+    // sum_k exp(i*2*pi*k*_v/_n), for |_v| well below _n
+    ComplexD dirichlet(double _v, int _n)
+    {
+      double ratio;
+      if (fabs(_v) < 1e-9)
+        ratio = _n;
+      else
+        ratio = sin(M_PI * _v) / sin(M_PI * _v / _n);
+      const double phase = M_PI * (_n - 1) * _v / _n;
+      return ComplexD(cos(phase), sin(phase)) * ratio;
+    }
+  }  // namespace
+
+  ///////////////////////////////////////////////////////////////////////////
+  int cpu_thread_count(void)
+  {
+    return omp_get_max_threads();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngineCpu::Allocate()
+  {
+    const int nBeams = this->config.nBeams;
+    const int nFreq = this->config.nFreq;
+
+    this->P_Beams_F_real.assign(static_cast<size_t>(nBeams) * nFreq, 0.0f);
+    this->P_Beams_F_imag.assign(static_cast<size_t>(nBeams) * nFreq, 0.0f);
+    this->beamCorrectorRows.assign(static_cast<size_t>(nBeams) * nBeams, 0.0f);
+
+    this->fftPlan.Configure(nFreq);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngineCpu::UpdateBeamCorrector()
+  {
+    const int nBeams = this->config.nBeams;
+    for (int beam = 0; beam < nBeams; beam++)
+      for (int beam_other = 0; beam_other < nBeams; beam_other++)
+        this->beamCorrectorRows[beam * nBeams + beam_other] =
+          this->beamCorrector[beam_other * nBeams + beam] / this->beamCorrectorSum;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  // The range table is read in place
+  void SonarEngineCpu::UpdateRangeTable()
+  {
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  // CPU Sonar Claculation Function
+  void SonarEngineCpu::ComputeSpectrum(const cv::Mat &depth_image,
+                                       const cv::Mat &normal_image,
+                                       const cv::Mat &rand_image,
+                                       const cv::Mat &reflectivity_image,
+                                       BeamRangeBuffer &P_Beams)
+  {
+    const bool debugFlag = this->config.debugFlag;
+    auto start = std::chrono::high_resolution_clock::now();
+    auto stop = start;
+
+    // ----  Allocation of properties parameters  ---- //
+    const float soundSpeed = (float)this->config.soundSpeed;
+    const float maxDistance = (float)this->config.maxDistance;
+    const int nBeams = this->config.nBeams;
+    const int nRays = this->config.nRays;
+    const int nFreq = this->config.nFreq;
+    const int raySkips = this->config.raySkips;
+    const float delta_f = this->delta_f;
+    const float *rangeTable = this->rangeTable.data();
+    const int lastSample = this->config.rangeTableSize - 1;
+    const float rangeTableScale = this->rangeTableScale;
+    // Rays beyond (nRays / raySkips) * raySkips are not summed on the GPU either
+    const int nRaysSummed = (int)(nRays / raySkips) * raySkips;
+
+    //#######################################################//
+    //###############    Sonar Calculation   ################//
+    //#######################################################//
+    // Frequency of the first sample and wave vector step between samples
+    double freqStart;
+    if (nFreq % 2 == 0)
+      freqStart = delta_f * (-nFreq / 2.0 + 1.0);
+    else
+      freqStart = delta_f * (-(nFreq - 1) / 2.0 + 1.0);
+    const double kwStart = 2.0 * M_PI * freqStart / soundSpeed;
+    const double kwStep = 2.0 * M_PI * delta_f / soundSpeed;
+
+    // Time domain deposit kernel
+    const bool timeDomain = this->config.timeDomain;
+    const int halfWidth = this->config.kernelHalfWidth;
+    const double binsPerMeter = 2.0 * nFreq * delta_f / soundSpeed;
+    const ComplexD hammingShift(cos(2.0 * M_PI / nFreq), sin(2.0 * M_PI / nFreq));
+    const double hammingSide =
+      this->config.timeDomainWindow ? 0.5 * hammingBeta / hammingAlpha : 0.0;
+
+    P_Beams.Resize(nBeams, nFreq);
+
+    // Scattering and ray summation. Each beam owns its frequency
+    // accumulator, so beams are distributed across threads and the rays
+    // of a beam are summed without any synchronization.
+    #pragma omp parallel for schedule(dynamic)
+    for (int beam = 0; beam < nBeams; beam++)
+    {
+      float *P_Beam_real = &this->P_Beams_F_real[static_cast<size_t>(beam) * nFreq];
+      float *P_Beam_imag = &this->P_Beams_F_imag[static_cast<size_t>(beam) * nFreq];
+      for (int f = 0; f < nFreq; f++)
+        P_Beam_real[f] = P_Beam_imag[f] = 0.0f;
+
+      // Rotations exp(i*2*d*kwStep*j) within one phasor interval
+      float rotation_real[phasorInterval];
+      float rotation_imag[phasorInterval];
+      // Flat spectrum transform around the delay of a ray
+      ComplexD flat[2 * maxKernelHalfWidth + 2];
+
+      for (int ray = 0; ray < nRaysSummed; ray += raySkips)
+      {
+        // Input parameters for ray processing
+        const float distance = depth_image.ptr<float>(ray)[beam];
+        const float *normal = normal_image.ptr<float>(ray) + 3 * beam;
+        const float *xi = rand_image.ptr<float>(ray) + 2 * beam;
+        const float reflectivity = reflectivity_image.ptr<float>(ray)[beam];
+
+        // Max distance cut-off
+        if (distance > maxDistance)
+          continue;
+
+        // ----- Point scattering model ------ //
+        // Calculate amplitude. The cosine of the incidence angle (taking
+        // that of normal_image) is the normal z component itself.
+        const float lambert_sqrt = sqrt(reflectivity) * normal[2];
+        // Source term, target area and attenuation from the range table,
+        // spreading d^-2 times the d^1/2 of the target area
+        const float sample =
+          fminf(fmaxf(distance * rangeTableScale, 0.0f), lastSample);
+        const int i = std::min(static_cast<int>(sample), lastSample - 1);
+        const float rangeTerm = rangeTable[i]
+          + (sample - i) * (rangeTable[i + 1] - rangeTable[i]);
+        const float spreading = 1.0f / (distance * sqrtf(distance));
+        const Complex amplitude = Complex(xi[0], xi[1])
+                                  * (rangeTerm * spreading * lambert_sqrt);
+
+        if (timeDomain)
+        {
+          // Echo deposited around its delay in range bins. Bin n of
+          // the spectral path would hold
+          //   delta_f * amplitude * exp(i*2*d*kwStart) * D(center - n)
+          // with D the transform of the flat spectrum, which is
+          // truncated to the kernel. The optional Hamming window adds the
+          // two neighbouring shifts of D, which makes the kernel short.
+          const double center = distance * binsPerMeter;
+          const int nStart = static_cast<int>(floor(center)) - halfWidth + 1;
+          for (int q = 0; q < 2 * halfWidth + 2; q++)
+            flat[q] = dirichlet(center - (nStart - 1 + q), nFreq);
+
+          const double phase = 2.0 * distance * kwStart;
+          const ComplexD gain = ComplexD(cos(phase), sin(phase))
+            * ComplexD(amplitude.real(), amplitude.imag()) * (double)delta_f;
+          for (int t = 0; t < 2 * halfWidth; t++)
+          {
+            const ComplexD echo = gain * (flat[t + 1] - hammingSide
+              * (hammingShift * flat[t] + std::conj(hammingShift) * flat[t + 2]));
+            const int n = ((nStart + t) % nFreq + nFreq) % nFreq;
+            P_Beam_real[n] += echo.real();
+            P_Beam_imag[n] += echo.imag();
+          }
+          continue;
+        }
+
+        // Summation of Echo returned from a signal (frequency domain)
+        // The phase 2*d*kw grows by the same step from one frequency to the
+        // next, so exp(i*2*d*kw) is the anchor phasor of each interval
+        // times a rotation shared by all intervals of the ray.
+        const double phaseStep = 2.0 * distance * kwStep;
+        const std::complex<double> step(cos(phaseStep), sin(phaseStep));
+        std::complex<double> rotation(1.0, 0.0);
+        for (int j = 0; j < phasorInterval; j++)
+        {
+          rotation_real[j] = rotation.real();
+          rotation_imag[j] = rotation.imag();
+          rotation *= step;
+        }
+
+        for (int f0 = 0; f0 < nFreq; f0 += phasorInterval)
+        {
+          const double phase = 2.0 * distance * (kwStart + f0 * kwStep);
+          const Complex anchor =
+            Complex(cos(phase), sin(phase)) * amplitude;
+          const float anchor_real = anchor.real();
+          const float anchor_imag = anchor.imag();
+          const int n = std::min(phasorInterval, nFreq - f0);
+          float *sum_real = P_Beam_real + f0;
+          float *sum_imag = P_Beam_imag + f0;
+          #pragma omp simd
+          for (int j = 0; j < n; j++)
+          {
+            sum_real[j] += anchor_real * rotation_real[j] - anchor_imag * rotation_imag[j];
+            sum_imag[j] += anchor_real * rotation_imag[j] + anchor_imag * rotation_real[j];
+          }
+        }
+      }
+    }
+
+    // For calc time measure
+    stop = std::chrono::high_resolution_clock::now();
+    this->stageTimes.summation =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+    if (debugFlag)
+      printf("CPU Sonar Computation & Ray Summation Time %lld/100 [s]\n",
+             static_cast<long long int>(this->stageTimes.summation / 10000000));
+    start = stop;
+
+    // -------------- Beam culling correction -----------------//
+    // beamCorrector and beamCorrectorSum is precalculated at parent cpp
+    // Each beam only sums the band of beams above the corrector tolerance
+    #pragma omp parallel for schedule(static)
+    for (int beam = 0; beam < nBeams; beam++)
+    {
+      Complex *P_Beam_Cor = P_Beams.Beam(beam);
+      const float *corrector = &this->beamCorrectorRows[static_cast<size_t>(beam) * nBeams];
+      for (int f = 0; f < nFreq; f++)
+        P_Beam_Cor[f] = Complex(0.0f, 0.0f);
+      for (int beam_other = this->correctorBandStart[beam];
+           beam_other < this->correctorBandEnd[beam]; beam_other++)
+      {
+        const size_t offset = static_cast<size_t>(beam_other) * nFreq;
+        const float *P_Beam_real = &this->P_Beams_F_real[offset];
+        const float *P_Beam_imag = &this->P_Beams_F_imag[offset];
+        for (int f = 0; f < nFreq; f++)
+          P_Beam_Cor[f] += corrector[beam_other] * Complex(P_Beam_real[f], P_Beam_imag[f]);
+      }
+    }
+
+    // For calc time measure
+    stop = std::chrono::high_resolution_clock::now();
+    this->stageTimes.correction =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+    if (debugFlag)
+      printf("CPU Window & Correction %lld/100 [s]\n",
+             static_cast<long long int>(this->stageTimes.correction / 10000000));
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngineCpu::Transform(BeamRangeBuffer &P_Beams)
+  {
+    // The deposit already produced the time series
+    if (this->config.timeDomain)
+    {
+      this->stageTimes.fft = 0;
+      return;
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+
+    //#################################################//
+    //###################   FFT   #####################//
+    //#################################################//
+    // Batched over the contiguous beam-major buffer, scaled by delta_f
+    this->fftPlan.ForwardMany(P_Beams.Beam(0), P_Beams.Beams(),
+                              P_Beams.Ranges(), this->delta_f);
+
+    // For calc time measure
+    auto stop = std::chrono::high_resolution_clock::now();
+    this->stageTimes.fft =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+    if (this->config.debugFlag)
+      printf("CPU FFT Calc Time %lld/100 [s]\n",
+             static_cast<long long int>(this->stageTimes.fft / 10000000));
+  }
+} // namespace NpsGazeboSonar
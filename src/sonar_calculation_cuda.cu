@@ -38,6 +38,8 @@
 #include <chrono>
 
 #define BLOCK_SIZE 32
+// Rays staged in shared memory at once by the sonar calculation kernel
+#define RAY_TILE 64
 
 static inline void _safe_cuda_call(cudaError err, const char *msg,
                                    const char *file_name, const int line_number)
@@ -86,51 +88,32 @@ __device__ __host__ float unnormalized_sinc(float t)
 }
 
 ///////////////////////////////////////////////////////////////////////////
-template <typename T>
-__global__ void column_sums_reduce(const T *__restrict__ in, T *__restrict__ out, size_t width, size_t height)
-{
-
-  __shared__ T sdata[BLOCK_SIZE][BLOCK_SIZE + 1];
-  size_t idx = threadIdx.x + blockDim.x * blockIdx.x;
-  size_t width_stride = gridDim.x * blockDim.x;
-  size_t full_width = (width & (~((unsigned long long)(BLOCK_SIZE - 1)))) + ((width & (BLOCK_SIZE - 1)) ? BLOCK_SIZE : 0); // round up to next block
-  for (size_t w = idx; w < full_width; w += width_stride)
-  { // grid-stride loop across matrix width
-    sdata[threadIdx.y][threadIdx.x] = 0;
-    size_t in_ptr = w + threadIdx.y * width;
-    for (size_t h = threadIdx.y; h < height; h += BLOCK_SIZE)
-    { // block-stride loop across matrix height
-      sdata[threadIdx.y][threadIdx.x] += (w < width) ? in[in_ptr] : 0;
-      in_ptr += width * BLOCK_SIZE;
-    }
-    __syncthreads();
-    T my_val = sdata[threadIdx.x][threadIdx.y];
-    for (int i = warpSize >> 1; i > 0; i >>= 1) // warp-wise parallel sum reduction
-      my_val += __shfl_xor_sync(0xFFFFFFFFU, my_val, i);
-    __syncthreads();
-    if (threadIdx.x == 0)
-      sdata[0][threadIdx.y] = my_val;
-    __syncthreads();
-    if ((threadIdx.y == 0) && ((w) < width))
-      out[w] = sdata[0][threadIdx.x];
-  }
-}
-
-__global__ void gpu_matrix_mult(float *a, float *b, float *c, int m, int n, int k)
+// Banded complex-by-real matrix product for the beam culling correction
+// c[row][col] = sum_{i in [band_start[col], band_end[col])} a[row][i] * b[i][col]
+// a and c are (m x n) with separate real and imaginary parts, b is (n x n)
+__global__ void gpu_banded_matrix_mult(const float *a_real, const float *a_imag,
+                                       const float *b,
+                                       float *c_real, float *c_imag,
+                                       const int *band_start, const int *band_end,
+                                       int m, int n)
 {
   int row = blockIdx.y * blockDim.y + threadIdx.y;
   int col = blockIdx.x * blockDim.x + threadIdx.x;
-  float sum = 0;
-  if (col < k && row < m)
+  float sum_real = 0;
+  float sum_imag = 0;
+  if (col < n && row < m)
   {
-    for (int i = 0; i < n; i++)
+    for (int i = band_start[col]; i < band_end[col]; i++)
     {
-      sum += a[row * n + i] * b[i * k + col];
+      sum_real += a_real[row * n + i] * b[i * n + col];
+      sum_imag += a_imag[row * n + i] * b[i * n + col];
     }
-    c[row * k + col] = sum;
+    c_real[row * n + col] = sum_real;
+    c_imag[row * n + col] = sum_imag;
   }
 }
 
+///////////////////////////////////////////////////////////////////////////
 __global__ void gpu_diag_matrix_mult(float *Val, int *RowPtr, float *diagVals, int total_rows)
 {
   const int row = threadIdx.x + blockIdx.x * blockDim.x;
@@ -143,9 +126,56 @@ __global__ void gpu_diag_matrix_mult(float *Val, int *RowPtr, float *diagVals, i
   }
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Scattering amplitude of a single ray (point scattering model)
+__device__ thrust::complex<float> ray_amplitude(float distance,
+                                                const float *normal,
+                                                float xi_z, float xi_y,
+                                                float reflectivity,
+                                                const float *rangeTable,
+                                                int rangeTableSize,
+                                                float rangeTableScale,
+                                                float maxDistance)
+{
+  // Max distance cut-off
+  if (distance > maxDistance)
+    return thrust::complex<float>(0.0, 0.0);
+
+  // Beam pattern
+  // only one column of rays for each beam at beam center, interference calculated later
+  float azimuthBeamPattern = 1.0;
+  float elevationBeamPattern = 1.0;
+  // float elevationBeamPattern = abs(unnormalized_sinc(M_PI * 0.884
+  //    				                  / (beam_elevationAngleWidth) * sin(ray_elevationAngles[ray])));
+
+  // ----- Point scattering model ------ //
+  // Calculate amplitude. The cosine of the incidence angle (taking that
+  // of normal_image) is the normal z component itself.
+  float lambert_sqrt = sqrtf(reflectivity) * normal[2];
+  float beamPattern = azimuthBeamPattern * elevationBeamPattern;
+  // Source term, target area and attenuation from the range table,
+  // spreading d^-2 times the d^1/2 of the target area
+  const int lastSample = rangeTableSize - 1;
+  const float sample =
+      fminf(fmaxf(distance * rangeTableScale, 0.0f), (float)lastSample);
+  const int i = min((int)sample, lastSample - 1);
+  const float lower = __ldg(&rangeTable[i]);
+  const float rangeTerm = lower + (sample - i) * (__ldg(&rangeTable[i + 1]) - lower);
+  const float spreading = rsqrtf(distance) / distance;
+  return thrust::complex<float>(xi_z, xi_y)
+         * (rangeTerm * spreading * beamPattern * lambert_sqrt);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Sonar Claculation Function
-__global__ void sonar_calculation(thrust::complex<float> *P_Beams,
+// Scattering and ray summation are fused: a block of RAY_TILE threads
+// covers one beam and RAY_TILE * phasorInterval frequencies. The rays of
+// the beam are staged through shared memory RAY_TILE at a time and each
+// thread accumulates the spectrum of its phasorInterval frequencies in
+// registers, so only the nFreq x nBeams beam spectrum is ever written to
+// global memory.
+__global__ void sonar_calculation(float *P_Beams_real,
+                                  float *P_Beams_imag,
                                   float *depth_image,
                                   float *normal_image,
                                   int width,
@@ -156,95 +186,233 @@ __global__ void sonar_calculation(thrust::complex<float> *P_Beams,
                                   int rand_image_step,
                                   float *reflectivity_image,
                                   int reflectivity_image_step,
-                                  float hPixelSize,
-                                  float vPixelSize,
-                                  float hFOV,
-                                  float vFOV,
-                                  float beam_azimuthAngleWidth,
-                                  float beam_elevationAngleWidth,
-                                  float ray_azimuthAngleWidth,
-                                  float *ray_elevationAngles,
-                                  float ray_elevationAngleWidth,
                                   float soundSpeed,
-                                  float sourceTerm,
+                                  const float *rangeTable,
+                                  int rangeTableSize,
+                                  float rangeTableScale,
                                   int nBeams, int nRays,
                                   int raySkips,
-                                  float sonarFreq, float delta_f,
-                                  int nFreq, float bandwidth,
-                                  float maxDistance,
-                                  float attenuation,
-                                  float area_scaler)
+                                  float delta_f,
+                                  int nFreq,
+                                  float maxDistance)
 {
-  // 2D Index of current thread
-  const int beam = blockIdx.x * blockDim.x + threadIdx.x;
-  const int ray = blockIdx.y * blockDim.y + threadIdx.y;
+  __shared__ float ray_distance[RAY_TILE];
+  __shared__ thrust::complex<float> ray_amplitudes[RAY_TILE];
+  __shared__ thrust::complex<float> ray_rotation[RAY_TILE];
+
+  const int beam = blockIdx.y;
+  const int f0 = (blockIdx.x * blockDim.x + threadIdx.x) * NpsGazeboSonar::phasorInterval;
+  // Rays beyond (nRays / raySkips) * raySkips are not summed
+  const int nRaysSummed = (int)(nRays / raySkips);
+
+  // Spectrum of the rays (frequency domain)
+  // The phase 2*d*kw grows by a constant step from one frequency to the
+  // next, so each sample is the previous one times a rotation. The
+  // phasor is re-anchored with an exact sincos every phasorInterval
+  // samples to bound the drift (see sonar_engine.hh).
+  double freqStart;
+  if (nFreq % 2 == 0)
+    freqStart = delta_f * (-nFreq / 2.0 + 1.0);
+  else
+    freqStart = delta_f * (-(nFreq - 1) / 2.0 + 1.0);
+  const double kwStart = 2.0 * M_PI * freqStart / soundSpeed;
+  const double kwStep = 2.0 * M_PI * delta_f / soundSpeed;
+
+  thrust::complex<float> P_Beam[NpsGazeboSonar::phasorInterval];
+  for (int j = 0; j < NpsGazeboSonar::phasorInterval; j++)
+    P_Beam[j] = thrust::complex<float>(0.0, 0.0);
 
-  //Only valid threads perform memory I/O
-  if ((beam < width) && (ray < height) && (ray % raySkips == 0))
+  for (int tile = 0; tile < nRaysSummed; tile += RAY_TILE)
   {
-    // Location of the image pixel
-    const int depth_index = ray * depth_image_step / sizeof(float) + beam;
-    const int normal_index = ray * normal_image_step / sizeof(float) + (3 * beam);
-    const int rand_index = ray * rand_image_step / sizeof(float) + (2 * beam);
-    const int reflectivity_index = ray * reflectivity_image_step / sizeof(float) + beam;
-
-    // Input parameters for ray processing
-    float distance = depth_image[depth_index] * 1.0f;
-    float normal[3] = {normal_image[normal_index],
-                      normal_image[normal_index + 1],
-                      normal_image[normal_index + 2]};
-
-    // Beam pattern
-    // only one column of rays for each beam at beam center, interference calculated later
-    float azimuthBeamPattern = 1.0;
-    float elevationBeamPattern = 1.0;
-    // float elevationBeamPattern = abs(unnormalized_sinc(M_PI * 0.884
-    //    				                  / (beam_elevationAngleWidth) * sin(ray_elevationAngles[ray])));
-
-    // printf("angles %f", ray_elevationAngles[ray]);
-
-    // incidence angle (taking that of normal_image)
-    float incidence = acos(normal[2]); // compute_incidence(ray_azimuthAngle, ray_elevationAngle, normal);
-
-    // ----- Point scattering model ------ //
-    // Gaussian noise generated using opencv RNG
-    float xi_z = rand_image[rand_index];
-    float xi_y = rand_image[rand_index + 1];
-
-    // Calculate amplitude
-    thrust::complex<float> randomAmps = thrust::complex<float>(xi_z / sqrt(2.0), xi_y / sqrt(2.0));
-    thrust::complex<float> lambert_sqrt =
-        thrust::complex<float>(sqrt(reflectivity_image[reflectivity_index]) * cos(incidence), 0.0);
-    thrust::complex<float> beamPattern =
-        thrust::complex<float>(azimuthBeamPattern * elevationBeamPattern, 0.0);
-    thrust::complex<float> targetArea_sqrt = thrust::complex<float>(sqrt(distance * area_scaler), 0.0);
-    thrust::complex<float> propagationTerm =
-        thrust::complex<float>(1.0 / pow(distance, 2.0) * exp(-2.0 * attenuation * distance), 0.0);
-    thrust::complex<float> amplitude = randomAmps * thrust::complex<float>(sourceTerm, 0.0)
-                                     * propagationTerm * beamPattern * lambert_sqrt * targetArea_sqrt;
-
-    // Max distance cut-off
-    if (distance > maxDistance)
-      amplitude = thrust::complex<float>(0.0, 0.0);
+    // Each thread evaluates the scattering of one ray of the tile
+    const int tile_ray = tile + threadIdx.x;
+    if (tile_ray < nRaysSummed && beam < width)
+    {
+      const int ray = tile_ray * raySkips;
+
+      // Location of the image pixel
+      const int depth_index = ray * depth_image_step / sizeof(float) + beam;
+      const int normal_index = ray * normal_image_step / sizeof(float) + (3 * beam);
+      const int rand_index = ray * rand_image_step / sizeof(float) + (2 * beam);
+      const int reflectivity_index = ray * reflectivity_image_step / sizeof(float) + beam;
+
+      // Input parameters for ray processing
+      float distance = depth_image[depth_index] * 1.0f;
+      float normal[3] = {normal_image[normal_index],
+                        normal_image[normal_index + 1],
+                        normal_image[normal_index + 2]};
+
+      // Gaussian noise generated using opencv RNG
+      float xi_z = rand_image[rand_index];
+      float xi_y = rand_image[rand_index + 1];
+
+      float rotation_real, rotation_imag;
+      sincosf(2.0 * distance * kwStep, &rotation_imag, &rotation_real);
+
+      ray_distance[threadIdx.x] = distance;
+      ray_rotation[threadIdx.x] = thrust::complex<float>(rotation_real, rotation_imag);
+      ray_amplitudes[threadIdx.x] =
+          ray_amplitude(distance, normal, xi_z, xi_y,
+                        reflectivity_image[reflectivity_index],
+                        rangeTable, rangeTableSize, rangeTableScale,
+                        maxDistance);
+    }
+    __syncthreads();
 
     // Summation of Echo returned from a signal (frequency domain)
-    for (size_t f = 0; f < nFreq; f++)
+    if (f0 < nFreq)
+    {
+      const int tile_rays = min(RAY_TILE, nRaysSummed - tile);
+      for (int r = 0; r < tile_rays; r++)
+      {
+        const thrust::complex<float> amplitude = ray_amplitudes[r];
+        if (amplitude.real() == 0.0f && amplitude.imag() == 0.0f)
+          continue;
+
+        // Phase reduced to [-pi, pi] in double before the float sincos
+        double phase = 2.0 * ray_distance[r] * (kwStart + f0 * kwStep);
+        phase -= 2.0 * M_PI * rint(phase / (2.0 * M_PI));
+        float anchor_real, anchor_imag;
+        sincosf(phase, &anchor_imag, &anchor_real);
+        thrust::complex<float> kernel =
+            thrust::complex<float>(anchor_real, anchor_imag) * amplitude;
+        const thrust::complex<float> rotation = ray_rotation[r];
+        #pragma unroll
+        for (int j = 0; j < NpsGazeboSonar::phasorInterval; j++)
+        {
+          P_Beam[j] += kernel;
+          kernel *= rotation;
+        }
+      }
+    }
+    __syncthreads();
+  }
+
+  // Beam spectrum in (nFreq x nBeams) layout for the beam culling correction
+  if (f0 < nFreq && beam < width)
+  {
+    for (int j = 0; j < NpsGazeboSonar::phasorInterval && f0 + j < nFreq; j++)
     {
-      float freq;
-      if (nFreq % 2 == 0)
-        freq = delta_f * (-nFreq / 2.0 + f*1.0f + 1.0);
-      else
-        freq = delta_f * (-(nFreq - 1) / 2.0 + f*1.0f + 1.0);
-      float kw = 2.0 * M_PI * freq / soundSpeed; // wave vector
-
-      // Transmit spectrum, frequency domain
-      thrust::complex<float> kernel = exp(thrust::complex<float>(0.0f, 2.0f * distance * kw)) * amplitude;
-      P_Beams[beam * nFreq * (int)(nRays / raySkips) + (int)(ray / raySkips) * nFreq + f] =
-          thrust::complex<float>(kernel.real() , kernel.imag());
+      P_Beams_real[(f0 + j) * nBeams + beam] = P_Beam[j].real();
+      P_Beams_imag[(f0 + j) * nBeams + beam] = P_Beam[j].imag();
     }
   }
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Transform of a flat spectrum of n samples at a delay of v bins,
+// sum_k exp(i*2*pi*k*v/n), for |v| well below n
+__device__ thrust::complex<float> dirichlet(float v, int n)
+{
+  float ratio;
+  if (fabsf(v) < 1e-6f)
+    ratio = n;
+  else
+    ratio = sinpif(v) / sinpif(v / n);
+  float phase_real, phase_imag;
+  sincospif((n - 1) * v / n, &phase_imag, &phase_real);
+  return thrust::complex<float>(phase_real, phase_imag) * ratio;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Time domain Sonar Claculation Function
+// Each thread scatters one ray and deposits its echo into the
+// 2 * halfWidth range bins around its delay. Bin n of the spectral path
+// would hold delta_f * amplitude * exp(i*2*d*kwStart) * D(center - n),
+// with D the transform of the flat spectrum, which is truncated to the
+// kernel. The optional Hamming window adds the two neighbouring shifts of
+// D, weighted by side, which makes the kernel short.
+// The output is in (nFreq x nBeams) layout and must be zeroed beforehand.
+__global__ void sonar_time_domain(float *P_Beams_real,
+                                  float *P_Beams_imag,
+                                  float *depth_image,
+                                  float *normal_image,
+                                  int width,
+                                  int height,
+                                  int depth_image_step,
+                                  int normal_image_step,
+                                  float *rand_image,
+                                  int rand_image_step,
+                                  float *reflectivity_image,
+                                  int reflectivity_image_step,
+                                  float soundSpeed,
+                                  const float *rangeTable,
+                                  int rangeTableSize,
+                                  float rangeTableScale,
+                                  int nBeams, int nRays,
+                                  int raySkips,
+                                  float delta_f,
+                                  int nFreq,
+                                  float maxDistance,
+                                  int halfWidth,
+                                  float side)
+{
+  // 2D Index of current thread
+  const int beam = blockIdx.x * blockDim.x + threadIdx.x;
+  const int ray = blockIdx.y * blockDim.y + threadIdx.y;
+
+  // Rays beyond (nRays / raySkips) * raySkips are not summed
+  if ((beam >= width) || (ray >= (int)(nRays / raySkips) * raySkips) ||
+      (ray % raySkips != 0))
+    return;
+
+  // Location of the image pixel
+  const int depth_index = ray * depth_image_step / sizeof(float) + beam;
+  const int normal_index = ray * normal_image_step / sizeof(float) + (3 * beam);
+  const int rand_index = ray * rand_image_step / sizeof(float) + (2 * beam);
+  const int reflectivity_index = ray * reflectivity_image_step / sizeof(float) + beam;
+
+  // Input parameters for ray processing
+  float distance = depth_image[depth_index] * 1.0f;
+  float normal[3] = {normal_image[normal_index],
+                    normal_image[normal_index + 1],
+                    normal_image[normal_index + 2]};
+
+  const thrust::complex<float> amplitude =
+      ray_amplitude(distance, normal,
+                    rand_image[rand_index], rand_image[rand_index + 1],
+                    reflectivity_image[reflectivity_index],
+                    rangeTable, rangeTableSize, rangeTableScale,
+                    maxDistance);
+  if (amplitude.real() == 0.0f && amplitude.imag() == 0.0f)
+    return;
+
+  // Phase of the first frequency, reduced to [-pi, pi] in double
+  double freqStart;
+  if (nFreq % 2 == 0)
+    freqStart = delta_f * (-nFreq / 2.0 + 1.0);
+  else
+    freqStart = delta_f * (-(nFreq - 1) / 2.0 + 1.0);
+  double phase = 2.0 * distance * 2.0 * M_PI * freqStart / soundSpeed;
+  phase -= 2.0 * M_PI * rint(phase / (2.0 * M_PI));
+  float anchor_real, anchor_imag;
+  sincosf(phase, &anchor_imag, &anchor_real);
+  const thrust::complex<float> gain =
+      thrust::complex<float>(anchor_real, anchor_imag) * amplitude * delta_f;
+
+  // Delay of the echo in range bins
+  const double center = 2.0 * distance * nFreq * delta_f / soundSpeed;
+  const int nStart = (int)floor(center) - halfWidth + 1;
+
+  float shift_real, shift_imag;
+  sincospif(2.0f / nFreq, &shift_imag, &shift_real);
+  const thrust::complex<float> shift(shift_real, shift_imag);
+
+  thrust::complex<float> upper = dirichlet(center - (nStart - 1), nFreq);
+  thrust::complex<float> middle = dirichlet(center - nStart, nFreq);
+  for (int t = 0; t < 2 * halfWidth; t++)
+  {
+    const thrust::complex<float> lower = dirichlet(center - (nStart + t + 1), nFreq);
+    const thrust::complex<float> echo =
+        gain * (middle - side * (shift * upper + thrust::conj(shift) * lower));
+    const int n = ((nStart + t) % nFreq + nFreq) % nFreq;
+    atomicAdd(&P_Beams_real[n * nBeams + beam], echo.real());
+    atomicAdd(&P_Beams_imag[n * nBeams + beam], echo.imag());
+    upper = middle;
+    middle = lower;
+  }
+}
+
 ///////////////////////////////////////////////////////////////////////////
 namespace NpsGazeboSonar
 {
@@ -252,9 +420,11 @@ namespace NpsGazeboSonar
   // CUDA Device Checker Wrapper
   void check_cuda_init_wrapper(void)
   {
-    // Check CUDA device
-    cudaDeviceSynchronize();
-    cudaError_t error = cudaGetLastError();
+    // Check CUDA device, without waiting for the work of other streams
+    int devices = 0;
+    cudaError_t error = cudaGetDeviceCount(&devices);
+    if (error == cudaSuccess)
+      error = cudaGetLastError();
     if (error != cudaSuccess)
     {
       fprintf(stderr, "ERROR: %s\n", cudaGetErrorString(error));
@@ -262,58 +432,106 @@ namespace NpsGazeboSonar
     }
   }
 
-  // Sonar Claculation Function Wrapper
-  CArray2D sonar_calculation_wrapper(const cv::Mat &depth_image,
-                                     const cv::Mat &normal_image,
-                                     const cv::Mat &rand_image,
-                                     double _hPixelSize,
-                                     double _vPixelSize,
-                                     double _hFOV,
-                                     double _vFOV,
-                                     double _beam_azimuthAngleWidth,
-                                     double _beam_elevationAngleWidth,
-                                     double _ray_azimuthAngleWidth,
-                                     float *_ray_elevationAngles,
-                                     double _ray_elevationAngleWidth,
-                                     double _soundSpeed,
-                                     double _maxDistance,
-                                     double _sourceLevel,
-                                     int _nBeams, int _nRays,
-                                     int _raySkips,
-                                     double _sonarFreq,
-                                     double _bandwidth,
-                                     int _nFreq,
-                                     const cv::Mat &reflectivity_image,
-                                     double _attenuation,
-                                     float *window,
-                                     float **beamCorrector,
-                                     float beamCorrectorSum,
-                                     bool debugFlag)
+  ///////////////////////////////////////////////////////////////////////////
+  // Non-blocking streams do not synchronize with the legacy default stream
+  SonarEngineCuda::SonarEngineCuda()
   {
+    SAFE_CALL(cudaStreamCreateWithFlags(&this->spectrumStream,
+                                        cudaStreamNonBlocking),
+              "CUDA Stream Creation Failed");
+    SAFE_CALL(cudaStreamCreateWithFlags(&this->transformStream,
+                                        cudaStreamNonBlocking),
+              "CUDA Stream Creation Failed");
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  SonarEngineCuda::~SonarEngineCuda()
+  {
+    cudaStreamDestroy(this->spectrumStream);
+    cudaStreamDestroy(this->transformStream);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  // Working memory that only depends on the geometry and nFreq
+  void SonarEngineCuda::Allocate()
+  {
+    const int nBeams = this->config.nBeams;
+    const int nFreq = this->config.nFreq;
+
+    // Beam spectrum and beam culling correction
+    const int P_Beams_Cor_N = nBeams * nFreq;
+    this->P_Beams_Cor_real_tmp.Reserve(P_Beams_Cor_N);
+    this->P_Beams_Cor_imag_tmp.Reserve(P_Beams_Cor_N);
+    this->d_P_Beams_Cor_real.Reserve(P_Beams_Cor_N);
+    this->d_P_Beams_Cor_imag.Reserve(P_Beams_Cor_N);
+    this->d_P_Beams_Cor_F_real.Reserve(P_Beams_Cor_N);
+    this->d_P_Beams_Cor_F_imag.Reserve(P_Beams_Cor_N);
+    this->d_beamCorrector_lin.Reserve(nBeams * nBeams);
+    this->d_correctorBandStart.Reserve(nBeams);
+    this->d_correctorBandEnd.Reserve(nBeams);
+
+    // FFT
+    this->hostInputData.Reserve(nFreq * nBeams);
+    this->hostOutputData.Reserve(nFreq * nBeams);
+    this->deviceInputData.Reserve(nFreq * nBeams);
+    this->deviceOutputData.Reserve(nFreq * nBeams);
+    // Plan up front so that the first frame does not pay for it either
+    this->fftPlans.Get(nFreq, nBeams);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  // The corrector only changes with the beam geometry, so it is copied to
+  // the device once instead of every frame, in order with the kernels that
+  // read it
+  void SonarEngineCuda::UpdateBeamCorrector()
+  {
+    SAFE_CALL(cudaMemcpyAsync(this->d_beamCorrector_lin.ptr, this->beamCorrector.data(),
+                              this->d_beamCorrector_lin.Bytes(),
+                              cudaMemcpyHostToDevice, this->spectrumStream),
+              "CUDA Memcpy Failed");
+    SAFE_CALL(cudaMemcpyAsync(this->d_correctorBandStart.ptr, this->correctorBandStart.data(),
+                              this->d_correctorBandStart.Bytes(),
+                              cudaMemcpyHostToDevice, this->spectrumStream),
+              "CUDA Memcpy Failed");
+    SAFE_CALL(cudaMemcpyAsync(this->d_correctorBandEnd.ptr, this->correctorBandEnd.data(),
+                              this->d_correctorBandEnd.Bytes(),
+                              cudaMemcpyHostToDevice, this->spectrumStream),
+              "CUDA Memcpy Failed");
+    SAFE_CALL(cudaStreamSynchronize(this->spectrumStream), "CUDA Memcpy Failed");
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  // The range table only changes with the configuration, so it is copied
+  // to the device once instead of every frame
+  void SonarEngineCuda::UpdateRangeTable()
+  {
+    this->d_rangeTable.Reserve(this->rangeTable.size());
+    SAFE_CALL(cudaMemcpyAsync(this->d_rangeTable.ptr, this->rangeTable.data(),
+                              this->d_rangeTable.Bytes(),
+                              cudaMemcpyHostToDevice, this->spectrumStream),
+              "CUDA Memcpy Failed");
+    SAFE_CALL(cudaStreamSynchronize(this->spectrumStream), "CUDA Memcpy Failed");
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  // Sonar Claculation Function
+  void SonarEngineCuda::ComputeSpectrum(const cv::Mat &depth_image,
+                                        const cv::Mat &normal_image,
+                                        const cv::Mat &rand_image,
+                                        const cv::Mat &reflectivity_image,
+                                        BeamRangeBuffer &P_Beams_F)
+  {
+    const bool debugFlag = this->config.debugFlag;
     auto start = std::chrono::high_resolution_clock::now();
-    auto stop = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-    if (debugFlag)
-      start = std::chrono::high_resolution_clock::now();
+    auto stop = start;
 
     // ----  Allocation of properties parameters  ---- //
-    const float hPixelSize = (float)_hPixelSize;
-    const float vPixelSize = (float)_vPixelSize;
-    const float hFOV = (float)_hFOV;
-    const float vFOV = (float)_vFOV;
-    const float beam_elevationAngleWidth = (float)_beam_elevationAngleWidth;
-    const float beam_azimuthAngleWidth = (float)_beam_azimuthAngleWidth;
-    const float ray_elevationAngleWidth = (float)_ray_elevationAngleWidth;
-    const float ray_azimuthAngleWidth = (float)_ray_azimuthAngleWidth;
-    const float soundSpeed = (float)_soundSpeed;
-    const float maxDistance = (float)_maxDistance;
-    const float sonarFreq = (float)_sonarFreq;
-    const float bandwidth = (float)_bandwidth;
-    const float attenuation = (float)_attenuation;
-    const int nBeams = _nBeams;
-    const int nRays = _nRays;
-    const int nFreq = _nFreq;
-    const int raySkips = _raySkips;
+    const float soundSpeed = (float)this->config.soundSpeed;
+    const float maxDistance = (float)this->config.maxDistance;
+    const int nBeams = this->config.nBeams;
+    const int nRays = this->config.nRays;
+    const int nFreq = this->config.nFreq;
+    const int raySkips = this->config.raySkips;
 
     //#######################################################//
     //###############    Sonar Calculation   ################//
@@ -321,387 +539,266 @@ namespace NpsGazeboSonar
     // ---------   Calculation parameters   --------- //
     const float max_distance = maxDistance;
     // Signal
-    const float delta_f = bandwidth/nFreq;
-    // Precalculation
-    const float area_scaler = ray_azimuthAngleWidth * ray_elevationAngleWidth;
-    const float sourceLevel = (float)_sourceLevel;                     // db re 1 muPa;
-    const float pref = 1e-6;                                           // 1 micro pascal (muPa);
-    const float sourceTerm = sqrt(pow(10, (sourceLevel / 10))) * pref; // source term
-
-    // ---------   Allocate GPU memory for image   --------- //
-    //Calculate total number of bytes of input and output image
-    const int depth_image_Bytes = depth_image.step * depth_image.rows;
-    const int normal_image_Bytes = normal_image.step * normal_image.rows;
-    const int rand_image_Bytes = rand_image.step * rand_image.rows;
-    const int reflectivity_image_Bytes = reflectivity_image.step * reflectivity_image.rows;
-    const int ray_elevationAngles_Bytes = sizeof(float) * nRays;
-
-    //Allocate device memory
-    float *d_depth_image, *d_normal_image, *d_rand_image, *d_reflectivity_image, *ray_elevationAngles, *d_ray_elevationAngles;
-    SAFE_CALL(cudaMalloc((void **)&d_depth_image, depth_image_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_normal_image, normal_image_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_rand_image, rand_image_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_reflectivity_image, reflectivity_image_Bytes), "CUDA Malloc Failed");
-    cudaMallocHost((void **)&ray_elevationAngles, ray_elevationAngles_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_ray_elevationAngles, ray_elevationAngles_Bytes), "CUDA Malloc Failed");
-    for (size_t ray = 0; ray < nRays; ray ++)
-      ray_elevationAngles[ray] = _ray_elevationAngles[ray];
+    const float delta_f = this->delta_f;
+
+    // ---------   Copy image to GPU memory   --------- //
+    // Image buffers are kept unless the image size changes
+    this->d_depth_image.Reserve(depth_image.step * depth_image.rows);
+    this->d_normal_image.Reserve(normal_image.step * normal_image.rows);
+    this->d_rand_image.Reserve(rand_image.step * rand_image.rows);
+    this->d_reflectivity_image.Reserve(reflectivity_image.step * reflectivity_image.rows);
 
     //Copy data from OpenCV input image to device memory
-    SAFE_CALL(cudaMemcpy(d_depth_image, depth_image.ptr(), depth_image_Bytes,
-                  cudaMemcpyHostToDevice), "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_normal_image, normal_image.ptr(), normal_image_Bytes,
-                  cudaMemcpyHostToDevice),"CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_rand_image, rand_image.ptr(), rand_image_Bytes,
-                  cudaMemcpyHostToDevice),"CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_reflectivity_image, reflectivity_image.ptr(), reflectivity_image_Bytes,
-                  cudaMemcpyHostToDevice), "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_ray_elevationAngles, ray_elevationAngles, ray_elevationAngles_Bytes,
-                  cudaMemcpyHostToDevice), "CUDA Memcpy Failed");
-
-    //Specify a reasonable block size
-    const dim3 block(BLOCK_SIZE, BLOCK_SIZE);
-
-    //Calculate grid size to cover the whole image
-    const dim3 grid((depth_image.cols + block.x - 1) / block.x,
-                    (depth_image.rows + block.y - 1) / block.y);
-
-    // Beam data array
-    thrust::complex<float> *P_Beams;
-    thrust::complex<float> *d_P_Beams;
-    const int P_Beams_N = nBeams * (int)(nRays / raySkips) * (nFreq + 1);
-    const int P_Beams_Bytes = sizeof(thrust::complex<float>) * P_Beams_N;
-    SAFE_CALL(cudaMallocHost((void **)&P_Beams, P_Beams_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams, P_Beams_Bytes), "CUDA Malloc Failed");
-
-    //Launch the beamor conversion kernel
-    sonar_calculation<<<grid, block>>>(d_P_Beams,
-                                       d_depth_image,
-                                       d_normal_image,
-                                       normal_image.cols,
-                                       normal_image.rows,
-                                       depth_image.step,
-                                       normal_image.step,
-                                       d_rand_image,
-                                       rand_image.step,
-                                       d_reflectivity_image,
-                                       reflectivity_image.step,
-                                       hPixelSize,
-                                       vPixelSize,
-                                       hFOV,
-                                       vFOV,
-                                       beam_azimuthAngleWidth,
-                                       beam_elevationAngleWidth,
-                                       ray_azimuthAngleWidth,
-                                       d_ray_elevationAngles,
-                                       ray_elevationAngleWidth,
-                                       soundSpeed,
-                                       sourceTerm,
-                                       nBeams, nRays,
-                                       raySkips,
-                                       sonarFreq, delta_f,
-                                       nFreq, bandwidth,
-                                       max_distance,
-                                       attenuation,
-                                       area_scaler);
+    SAFE_CALL(cudaMemcpyAsync(this->d_depth_image.ptr, depth_image.ptr(),
+                  this->d_depth_image.Bytes(),
+                  cudaMemcpyHostToDevice, this->spectrumStream),
+                  "CUDA Memcpy Failed");
+    SAFE_CALL(cudaMemcpyAsync(this->d_normal_image.ptr, normal_image.ptr(),
+                  this->d_normal_image.Bytes(),
+                  cudaMemcpyHostToDevice, this->spectrumStream),
+                  "CUDA Memcpy Failed");
+    SAFE_CALL(cudaMemcpyAsync(this->d_rand_image.ptr, rand_image.ptr(),
+                  this->d_rand_image.Bytes(),
+                  cudaMemcpyHostToDevice, this->spectrumStream),
+                  "CUDA Memcpy Failed");
+    SAFE_CALL(cudaMemcpyAsync(this->d_reflectivity_image.ptr, reflectivity_image.ptr(),
+                  this->d_reflectivity_image.Bytes(),
+                  cudaMemcpyHostToDevice, this->spectrumStream),
+                  "CUDA Memcpy Failed");
+
+    float *d_P_Beams_Cor_real = this->d_P_Beams_Cor_real.ptr;
+    float *d_P_Beams_Cor_imag = this->d_P_Beams_Cor_imag.ptr;
+    if (this->config.timeDomain)
+    {
+      // Scattering and deposit of each ray into the range bins, writes the
+      // (nFreq x nBeams) time series straight into the input of the beam
+      // culling correction
+      SAFE_CALL(cudaMemsetAsync(d_P_Beams_Cor_real, 0, this->d_P_Beams_Cor_real.Bytes(),
+                                this->spectrumStream),
+                "CUDA Memset Failed");
+      SAFE_CALL(cudaMemsetAsync(d_P_Beams_Cor_imag, 0, this->d_P_Beams_Cor_imag.Bytes(),
+                                this->spectrumStream),
+                "CUDA Memset Failed");
+
+      //Calculate grid size to cover the whole image
+      const dim3 block(BLOCK_SIZE, BLOCK_SIZE);
+      const dim3 grid((depth_image.cols + block.x - 1) / block.x,
+                      (depth_image.rows + block.y - 1) / block.y);
+
+      sonar_time_domain<<<grid, block, 0, this->spectrumStream>>>(
+          d_P_Beams_Cor_real,
+          d_P_Beams_Cor_imag,
+          (float *)this->d_depth_image.ptr,
+          (float *)this->d_normal_image.ptr,
+          normal_image.cols,
+          normal_image.rows,
+          depth_image.step,
+          normal_image.step,
+          (float *)this->d_rand_image.ptr,
+          rand_image.step,
+          (float *)this->d_reflectivity_image.ptr,
+          reflectivity_image.step,
+          soundSpeed,
+          this->d_rangeTable.ptr,
+          this->config.rangeTableSize,
+          this->rangeTableScale,
+          nBeams, nRays,
+          raySkips,
+          delta_f,
+          nFreq,
+          max_distance,
+          this->config.kernelHalfWidth,
+          this->config.timeDomainWindow ?
+            0.5 * hammingBeta / hammingAlpha : 0.0);
+    }
+    else
+    {
+      // One block per beam and RAY_TILE * phasorInterval frequencies
+      const int nFreqIntervals = (nFreq + phasorInterval - 1) / phasorInterval;
+      const dim3 block(RAY_TILE);
+      const dim3 grid((nFreqIntervals + RAY_TILE - 1) / RAY_TILE, nBeams);
+
+      // Scattering and ray summation, writes the (nFreq x nBeams) beam
+      // spectrum straight into the input of the beam culling correction
+      sonar_calculation<<<grid, block, 0, this->spectrumStream>>>(
+          d_P_Beams_Cor_real,
+          d_P_Beams_Cor_imag,
+          (float *)this->d_depth_image.ptr,
+          (float *)this->d_normal_image.ptr,
+          normal_image.cols,
+          normal_image.rows,
+          depth_image.step,
+          normal_image.step,
+          (float *)this->d_rand_image.ptr,
+          rand_image.step,
+          (float *)this->d_reflectivity_image.ptr,
+          reflectivity_image.step,
+          soundSpeed,
+          this->d_rangeTable.ptr,
+          this->config.rangeTableSize,
+          this->rangeTableScale,
+          nBeams, nRays,
+          raySkips,
+          delta_f,
+          nFreq,
+          max_distance);
+    }
 
     //Synchronize to check for any kernel launch errors
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    //Copy back data from destination device meory to OpenCV output image
-    SAFE_CALL(cudaMemcpy(P_Beams, d_P_Beams, P_Beams_Bytes,
-                         cudaMemcpyDeviceToHost), "CUDA Memcpy Failed");
-
-    // Free GPU memory
-    cudaFree(d_depth_image);
-    cudaFree(d_normal_image);
-    cudaFree(d_rand_image);
-    cudaFree(d_reflectivity_image);
-    cudaFree(d_P_Beams);
-    cudaFree(d_ray_elevationAngles);
-    cudaFreeHost(ray_elevationAngles);
+    SAFE_CALL(cudaGetLastError(), "Kernel Launch Failed");
+    SAFE_CALL(cudaStreamSynchronize(this->spectrumStream), "Kernel Launch Failed");
 
     // For calc time measure
+    stop = std::chrono::high_resolution_clock::now();
+    this->stageTimes.summation =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
     if (debugFlag)
-    {
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-      printf("GPU Sonar Computation Time %lld/100 [s]\n",
-              static_cast<long long int>(duration.count() / 10000));
-      start = std::chrono::high_resolution_clock::now();
-    }
+      printf("GPU Sonar Computation & Ray Summation Time %lld/100 [s]\n",
+             static_cast<long long int>(this->stageTimes.summation / 10000000));
+    start = stop;
 
     //########################################################//
     //#########   Summation, Culling and windowing   #########//
     //########################################################//
-    // Preallocate an array for return
-    CArray2D P_Beams_F(CArray(nFreq), nBeams);
+    // Reuse the caller's array for return
+    P_Beams_F.Resize(nBeams, nFreq);
     // GPU grids and rows
     unsigned int grid_rows, grid_cols;
     dim3 dimBlock(BLOCK_SIZE, BLOCK_SIZE);
 
-    // GPU Ray summation using column sum
-    float *P_Ray_real, *P_Ray_imag;
-    float *d_P_Ray_real, *d_P_Ray_imag;
-    const int P_Ray_N = (int)(nRays / raySkips) * (nFreq);
-    const int P_Ray_Bytes = sizeof(float) * P_Ray_N;
-    float *P_Ray_F_real, *P_Ray_F_imag;
-    float *d_P_Ray_F_real, *d_P_Ray_F_imag;
-    const int P_Ray_F_N = (nFreq)*1;
-    const int P_Ray_F_Bytes = sizeof(float) * P_Ray_F_N;
-    cudaMallocHost((void **)&P_Ray_real, P_Ray_Bytes);
-    cudaMallocHost((void **)&P_Ray_imag, P_Ray_Bytes);
-    cudaMallocHost((void **)&P_Ray_F_real, P_Ray_F_Bytes);
-    cudaMallocHost((void **)&P_Ray_F_imag, P_Ray_F_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_real, P_Ray_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_imag, P_Ray_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_F_real, P_Ray_F_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Ray_F_imag, P_Ray_F_Bytes), "CUDA Malloc Failed");
-
-    dim3 dimGrid_Ray((nFreq + BLOCK_SIZE - 1) / BLOCK_SIZE);
-
-    for (size_t beam = 0; beam < nBeams; beam ++)
-    {
-      for (size_t ray = 0; ray < (int)(nRays / raySkips); ray++)
-      {
-        for (size_t f = 0; f < nFreq; f++)
-        {
-          P_Ray_real[ray * nFreq + f] =
-              P_Beams[beam * nFreq * (int)(nRays / raySkips) + ray * nFreq + f].real();
-          P_Ray_imag[ray * nFreq + f] =
-              P_Beams[beam * nFreq * (int)(nRays / raySkips) + ray * nFreq + f].imag();
-        }
-      }
-
-      SAFE_CALL(cudaMemcpy(d_P_Ray_real, P_Ray_real, P_Ray_Bytes, cudaMemcpyHostToDevice),
-                "CUDA Memcpy Failed");
-      SAFE_CALL(cudaMemcpy(d_P_Ray_imag, P_Ray_imag, P_Ray_Bytes, cudaMemcpyHostToDevice),
-                "CUDA Memcpy Failed");
-
-      column_sums_reduce<<<dimGrid_Ray, dimBlock>>>(d_P_Ray_real, d_P_Ray_F_real,
-                                                    nFreq, (int)(nRays / raySkips));
-      column_sums_reduce<<<dimGrid_Ray, dimBlock>>>(d_P_Ray_imag, d_P_Ray_F_imag,
-                                                    nFreq, (int)(nRays / raySkips));
-
-      SAFE_CALL(cudaMemcpy(P_Ray_F_real, d_P_Ray_F_real, P_Ray_F_Bytes,
-                           cudaMemcpyDeviceToHost), "CUDA Memcpy Failed");
-      SAFE_CALL(cudaMemcpy(P_Ray_F_imag, d_P_Ray_F_imag, P_Ray_F_Bytes,
-                           cudaMemcpyDeviceToHost), "CUDA Memcpy Failed");
-      SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-      for (size_t f = 0; f < nFreq; f++)
-        P_Beams_F[beam][f] = Complex(P_Ray_F_real[f], P_Ray_F_imag[f]);
-    }
-
-    // free memory
-    cudaFreeHost(P_Beams);
-    cudaFreeHost(P_Ray_real);
-    cudaFreeHost(P_Ray_imag);
-    cudaFreeHost(P_Ray_F_real);
-    cudaFreeHost(P_Ray_F_imag);
-    cudaFree(d_P_Ray_real);
-    cudaFree(d_P_Ray_imag);
-    cudaFree(d_P_Ray_F_real);
-    cudaFree(d_P_Ray_F_imag);
-
-    if (debugFlag)
-    {
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-      printf("Sonar Ray Summation %lld/100 [s]\n",
-            static_cast<long long int>(duration.count() / 10000));
-      start = std::chrono::high_resolution_clock::now();
-    }
-
     // -------------- Beam culling correction -----------------//
     // beamCorrector and beamCorrectorSum is precalculated at parent cpp
-    float *P_Beams_Cor_real, *P_Beams_Cor_imag;
-    // float *P_Beams_Cor_F_real, *P_Beams_Cor_F_imag;
-    float *P_Beams_Cor_real_tmp, *P_Beams_Cor_imag_tmp;
-    float *d_P_Beams_Cor_real, *d_P_Beams_Cor_imag;
-    float *d_P_Beams_Cor_F_real, *d_P_Beams_Cor_F_imag;
-    const int P_Beams_Cor_N = nBeams * nFreq;
-    const int P_Beams_Cor_Bytes = sizeof(float) * P_Beams_Cor_N;
-    cudaMallocHost((void **)&P_Beams_Cor_real, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_imag, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_real_tmp, P_Beams_Cor_Bytes);
-    cudaMallocHost((void **)&P_Beams_Cor_imag_tmp, P_Beams_Cor_Bytes);
-    // cudaMallocHost((void **)&P_Beams_Cor_F_real, P_Beams_Cor_Bytes);
-    // cudaMallocHost((void **)&P_Beams_Cor_F_imag, P_Beams_Cor_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_real, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_imag, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_F_real, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-    SAFE_CALL(cudaMalloc((void **)&d_P_Beams_Cor_F_imag, P_Beams_Cor_Bytes), "CUDA Malloc Failed");
-
-    float *beamCorrector_lin, *d_beamCorrector_lin;
-    const int beamCorrector_lin_N = nBeams * nBeams;
-    const int beamCorrector_lin_Bytes = sizeof(float) * beamCorrector_lin_N;
-    cudaMallocHost((void **)&beamCorrector_lin, beamCorrector_lin_Bytes);
-    SAFE_CALL(cudaMalloc((void **)&d_beamCorrector_lin, beamCorrector_lin_Bytes), "CUDA Malloc Failed");
+    // and already resident on the device (see UpdateBeamCorrector)
+    // Each beam only sums the band of beams above the corrector tolerance
+    float *P_Beams_Cor_real_tmp = this->P_Beams_Cor_real_tmp.ptr;
+    float *P_Beams_Cor_imag_tmp = this->P_Beams_Cor_imag_tmp.ptr;
+    float *d_P_Beams_Cor_F_real = this->d_P_Beams_Cor_F_real.ptr;
+    float *d_P_Beams_Cor_F_imag = this->d_P_Beams_Cor_F_imag.ptr;
+    const int P_Beams_Cor_Bytes = this->d_P_Beams_Cor_real.Bytes();
+    float *d_beamCorrector_lin = this->d_beamCorrector_lin.ptr;
+    const float beamCorrectorSum = this->beamCorrectorSum;
 
     // (nfreq x nBeams) * (nBeams x nBeams) = (nfreq x nBeams)
-    for (size_t beam = 0; beam < nBeams; beam ++)
-    {
-      for (size_t f = 0; f < nFreq; f++)
-      {
-        P_Beams_Cor_real[f * nBeams + beam] = P_Beams_F[beam][f].real() * 1.0f;
-        P_Beams_Cor_imag[f * nBeams + beam] = P_Beams_F[beam][f].imag() * 1.0f;
-      }
-      for (size_t beam_other = 0; beam_other < nBeams; beam_other ++)
-        beamCorrector_lin[beam_other * nBeams + beam] = beamCorrector[beam][beam_other];
-    }
-
-    SAFE_CALL(cudaMemcpy(d_P_Beams_Cor_real, P_Beams_Cor_real, P_Beams_Cor_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_P_Beams_Cor_imag, P_Beams_Cor_imag, P_Beams_Cor_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(d_beamCorrector_lin, beamCorrector_lin, beamCorrector_lin_Bytes,
-                         cudaMemcpyHostToDevice),
-              "CUDA Memcpy Failed");
-
     grid_rows = (nFreq + BLOCK_SIZE - 1) / BLOCK_SIZE;
     grid_cols = (nBeams + BLOCK_SIZE - 1) / BLOCK_SIZE;
     dim3 dimGrid_Beam(grid_cols, grid_rows);
 
-    gpu_matrix_mult<<<dimGrid_Beam, dimBlock>>>(d_P_Beams_Cor_real, d_beamCorrector_lin,
-                                                d_P_Beams_Cor_F_real, nFreq, nBeams, nBeams);
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    gpu_matrix_mult<<<dimGrid_Beam, dimBlock>>>(d_P_Beams_Cor_imag, d_beamCorrector_lin,
-                                                d_P_Beams_Cor_F_imag, nFreq, nBeams, nBeams);
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
-
-    //Copy back data from destination device meory
-    SAFE_CALL(cudaMemcpy(P_Beams_Cor_real_tmp, d_P_Beams_Cor_F_real, P_Beams_Cor_Bytes,
-                         cudaMemcpyDeviceToHost),
+    gpu_banded_matrix_mult<<<dimGrid_Beam, dimBlock, 0, this->spectrumStream>>>(
+        d_P_Beams_Cor_real, d_P_Beams_Cor_imag,
+        d_beamCorrector_lin,
+        d_P_Beams_Cor_F_real, d_P_Beams_Cor_F_imag,
+        this->d_correctorBandStart.ptr,
+        this->d_correctorBandEnd.ptr,
+        nFreq, nBeams);
+    SAFE_CALL(cudaGetLastError(), "Kernel Launch Failed");
+
+    //Copy back data from destination device meory, in stream order
+    SAFE_CALL(cudaMemcpyAsync(P_Beams_Cor_real_tmp, d_P_Beams_Cor_F_real, P_Beams_Cor_Bytes,
+                              cudaMemcpyDeviceToHost, this->spectrumStream),
               "CUDA Memcpy Failed");
-    SAFE_CALL(cudaMemcpy(P_Beams_Cor_imag_tmp, d_P_Beams_Cor_F_imag, P_Beams_Cor_Bytes,
-                         cudaMemcpyDeviceToHost),
+    SAFE_CALL(cudaMemcpyAsync(P_Beams_Cor_imag_tmp, d_P_Beams_Cor_F_imag, P_Beams_Cor_Bytes,
+                              cudaMemcpyDeviceToHost, this->spectrumStream),
               "CUDA Memcpy Failed");
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
+    SAFE_CALL(cudaStreamSynchronize(this->spectrumStream), "Kernel Launch Failed");
 
     // Return
-    for (size_t beam = 0; beam < nBeams; beam ++)
-      for (size_t f = 0; f < nFreq; f++)
-        P_Beams_F[beam][f] =
-            Complex(P_Beams_Cor_real_tmp[f * nBeams + beam] / beamCorrectorSum,
-                    P_Beams_Cor_imag_tmp[f * nBeams + beam] / beamCorrectorSum);
-
-    // Free memory
-    cudaFree(d_P_Beams_Cor_imag);
-    cudaFree(d_P_Beams_Cor_real);
-    cudaFree(d_P_Beams_Cor_F_imag);
-    cudaFree(d_P_Beams_Cor_F_real);
-    cudaFree(d_beamCorrector_lin);
-    cudaFreeHost(P_Beams_Cor_real);
-    cudaFreeHost(P_Beams_Cor_imag);
-    cudaFreeHost(P_Beams_Cor_real_tmp);
-    cudaFreeHost(P_Beams_Cor_imag_tmp);
-    cudaFreeHost(beamCorrector_lin);
+    for (int beam = 0; beam < nBeams; beam ++)
+    {
+      Complex *P_Beam = P_Beams_F.Beam(beam);
+      for (int f = 0; f < nFreq; f++)
+        P_Beam[f] = Complex(P_Beams_Cor_real_tmp[f * nBeams + beam] / beamCorrectorSum,
+                            P_Beams_Cor_imag_tmp[f * nBeams + beam] / beamCorrectorSum);
+    }
 
     // For calc time measure
+    stop = std::chrono::high_resolution_clock::now();
+    this->stageTimes.correction =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
     if (debugFlag)
-    {
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
       printf("GPU Window & Correction %lld/100 [s]\n",
-            static_cast<long long int>(duration.count() / 10000));
-      start = std::chrono::high_resolution_clock::now();
+             static_cast<long long int>(this->stageTimes.correction / 10000000));
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngineCuda::Transform(BeamRangeBuffer &P_Beams_F)
+  {
+    // The deposit already produced the time series
+    if (this->config.timeDomain)
+    {
+      this->stageTimes.fft = 0;
+      return;
     }
+    auto start = std::chrono::high_resolution_clock::now();
+    const int nBeams = P_Beams_F.Beams();
+    const int nFreq = P_Beams_F.Ranges();
+    const float delta_f = this->delta_f;
 
     //#################################################//
     //###################   FFT   #####################//
     //#################################################//
-    SAFE_CALL(cudaDeviceSynchronize(), "Kernel Launch Failed");
     const int DATASIZE = nFreq;
     const int BATCH = nBeams;
-    // --- Host side input data allocation and initialization
-    cufftComplex *hostInputData = (cufftComplex *)malloc(
-        DATASIZE * BATCH * sizeof(cufftComplex));
+    // --- Host side input data initialization
+    cufftComplex *hostInputData = this->hostInputData.ptr;
     for (int beam = 0; beam < BATCH; beam++)
     {
       for (int f = 0; f < DATASIZE; f++)
       {
         if (f < nFreq)
           hostInputData[beam * DATASIZE + f] =
-              make_cuComplex(P_Beams_F[beam][f].real() * 1.0f,
-                             P_Beams_F[beam][f].imag() * 1.0f);
+              make_cuComplex(P_Beams_F(beam, f).real() * 1.0f,
+                             P_Beams_F(beam, f).imag() * 1.0f);
         else
           hostInputData[beam * DATASIZE + f] =
               (make_cuComplex(0.f, 0.f)); // zero padding
       }
     }
 
-    // --- Device side input data allocation and initialization
-    cufftComplex *deviceInputData;
-    SAFE_CALL(cudaMalloc((void **)&deviceInputData,
-                         DATASIZE * BATCH * sizeof(cufftComplex)),
-                         "FFT CUDA Malloc Failed");
-    SAFE_CALL(cudaMemcpy(deviceInputData, hostInputData,
-                         DATASIZE * BATCH * sizeof(cufftComplex),
-                         cudaMemcpyHostToDevice),
-                         "FFT CUDA Memcopy Failed");
-
-    // --- Host side output data allocation
-    cufftComplex *hostOutputData =
-        (cufftComplex *)malloc(DATASIZE * BATCH * sizeof(cufftComplex));
-
-    // --- Device side output data allocation
-    cufftComplex *deviceOutputData;
-    cudaMalloc((void **)&deviceOutputData,
-               DATASIZE * BATCH * sizeof(cufftComplex));
-
-    // --- Batched 1D FFTs
-    cufftHandle handle;
-    int rank = 1;         // --- 1D FFTs
-    int n[] = {DATASIZE}; // --- Size of the Fourier transform
-    // --- Distance between two successive input/output elements
-    int istride = 1, ostride = 1;
-    int idist = DATASIZE, odist = DATASIZE; // --- Distance between batches
-    // --- Input/Output size with pitch (ignored for 1D transforms)
-    int inembed[] = {0};
-    int onembed[] = {0};
-    int batch = BATCH; // --- Number of batched executions
-    cufftPlanMany(&handle, rank, n,
-                  inembed, istride, idist,
-                  onembed, ostride, odist, CUFFT_C2C, batch);
-
-    cufftExecC2C(handle, deviceInputData, deviceOutputData, CUFFT_FORWARD);
+    // --- Device side input data initialization
+    cufftComplex *deviceInputData = this->deviceInputData.ptr;
+    SAFE_CALL(cudaMemcpyAsync(deviceInputData, hostInputData,
+                              DATASIZE * BATCH * sizeof(cufftComplex),
+                              cudaMemcpyHostToDevice, this->transformStream),
+                              "FFT CUDA Memcopy Failed");
+
+    // --- Host and device side output data
+    cufftComplex *hostOutputData = this->hostOutputData.ptr;
+    cufftComplex *deviceOutputData = this->deviceOutputData.ptr;
+
+    // --- Batched 1D FFTs, planned once per (nFreq, nBeams)
+    cufftHandle handle = this->fftPlans.Get(DATASIZE, BATCH);
+    if (cufftSetStream(handle, this->transformStream) != CUFFT_SUCCESS ||
+        cufftExecC2C(handle, deviceInputData, deviceOutputData,
+                     CUFFT_FORWARD) != CUFFT_SUCCESS)
+    {
+      fprintf(stderr, "cuFFT Execution Failed\n");
+      exit(EXIT_FAILURE);
+    }
 
     // --- Device->Host copy of the results
-    SAFE_CALL(cudaMemcpy(hostOutputData, deviceOutputData,
-                         DATASIZE * BATCH * sizeof(cufftComplex),
-                         cudaMemcpyDeviceToHost),
-                         "FFT CUDA Memcopy Failed");
-
-    cufftDestroy(handle);
-    cudaFree(deviceOutputData);
-    cudaFree(deviceInputData);
-    free(hostInputData);
-    free(hostOutputData);
-
+    SAFE_CALL(cudaMemcpyAsync(hostOutputData, deviceOutputData,
+                              DATASIZE * BATCH * sizeof(cufftComplex),
+                              cudaMemcpyDeviceToHost, this->transformStream),
+                              "FFT CUDA Memcopy Failed");
+    SAFE_CALL(cudaStreamSynchronize(this->transformStream),
+              "FFT CUDA Stream Failed");
 
     for (int beam = 0; beam < BATCH; beam++)
     {
+      Complex *P_Beam = P_Beams_F.Beam(beam);
       for (int f = 0; f < nFreq; f++)
       {
-        P_Beams_F[beam][f] =
-            Complex(hostOutputData[beam * DATASIZE + f].x * delta_f,
-                    hostOutputData[beam * DATASIZE + f].y * delta_f);
+        P_Beam[f] = Complex(hostOutputData[beam * DATASIZE + f].x * delta_f,
+                            hostOutputData[beam * DATASIZE + f].y * delta_f);
       }
     }
 
     // For calc time measure
-    if (debugFlag)
-    {
-      stop = std::chrono::high_resolution_clock::now();
-      duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+    auto stop = std::chrono::high_resolution_clock::now();
+    this->stageTimes.fft =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count();
+    if (this->config.debugFlag)
       printf("GPU FFT Calc Time %lld/100 [s]\n",
-            static_cast<long long int>(duration.count() / 10000));
-    }
-
-    return P_Beams_F;
+             static_cast<long long int>(this->stageTimes.fft / 10000000));
   }
 } // namespace NpsGazeboSonar
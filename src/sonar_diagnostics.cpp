@@ -0,0 +1,99 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/sonar_diagnostics.hh>
+
+#include <stdio.h>
+
+#include <vector>
+
+#include <diagnostic_msgs/KeyValue.h>
+
+namespace NpsGazeboSonar
+{
+  ///////////////////////////////////////////////////////////////////////////
+  static void AddValue(diagnostic_msgs::DiagnosticStatus &_status,
+                       const std::string &_key, const std::string &_value)
+  {
+    diagnostic_msgs::KeyValue keyValue;
+    keyValue.key = _key;
+    keyValue.value = _value;
+    _status.values.push_back(keyValue);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  static std::string Milliseconds(int64_t _ns)
+  {
+    char text[32];
+    snprintf(text, sizeof(text), "%.3f", _ns * 1e-6);
+    return text;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void FillSonarDiagnostics(const std::string &_name,
+                            const std::string &_hardwareId,
+                            const StageLatencies &_latencies,
+                            const SonarCounters &_counters,
+                            double _frameBudget,
+                            diagnostic_msgs::DiagnosticStatus &_status)
+  {
+    const std::vector<StageLatencies::Summary> summaries =
+      _latencies.Summarize();
+
+    _status.name = _name;
+    _status.hardware_id = _hardwareId;
+    _status.values.clear();
+
+    const StageLatencies::Summary &frame = summaries[STAGE_FRAME];
+    if (_frameBudget > 0.0 && frame.count > 0
+        && frame.p95 * 1e-9 > _frameBudget)
+    {
+      _status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+      _status.message = "Frame time above the frame budget";
+    }
+    else
+    {
+      _status.level = diagnostic_msgs::DiagnosticStatus::OK;
+      _status.message = frame.count > 0 ? "OK" : "No frames";
+    }
+
+    AddValue(_status, "frame budget [ms]",
+             Milliseconds(static_cast<int64_t>(_frameBudget * 1e9)));
+    AddValue(_status, "dropped frames",
+             std::to_string(_counters.droppedFrames));
+    AddValue(_status, "frames in flight",
+             std::to_string(_counters.framesInFlight));
+    AddValue(_status, "pipeline depth",
+             std::to_string(_counters.pipelineDepth));
+    if (_counters.reflectivityDirtyPixels >= 0)
+      AddValue(_status, "reflectivity dirty pixels",
+               std::to_string(_counters.reflectivityDirtyPixels));
+
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+      const StageLatencies::Summary &summary = summaries[s];
+      if (summary.count == 0)
+        continue;
+      const std::string stage = StageName(static_cast<SonarStage>(s));
+      AddValue(_status, stage + " count", std::to_string(summary.count));
+      AddValue(_status, stage + " p50 [ms]", Milliseconds(summary.p50));
+      AddValue(_status, stage + " p95 [ms]", Milliseconds(summary.p95));
+      AddValue(_status, stage + " p99 [ms]", Milliseconds(summary.p99));
+      AddValue(_status, stage + " max [ms]", Milliseconds(summary.max));
+    }
+  }
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/sonar_engine.hh>
+#include <nps_uw_multibeam_sonar/sonar_calculation_cpu.hh>
+#ifdef NPS_SONAR_WITH_CUDA
+#include <nps_uw_multibeam_sonar/sonar_calculation_cuda.cuh>
+#endif
+
+#include <math.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace NpsGazeboSonar
+{
+  ///////////////////////////////////////////////////////////////////////////
+  std::unique_ptr<SonarEngine> SonarEngine::Create(
+      const std::string &_backend, const SonarConfig &_config)
+  {
+    std::unique_ptr<SonarEngine> engine;
+    if (!Built(_backend))
+      return nullptr;
+#ifdef NPS_SONAR_WITH_CUDA
+    if (_backend == "gpu")
+      engine.reset(new SonarEngineCuda());
+#endif
+    if (_backend == "cpu")
+      engine.reset(new SonarEngineCpu());
+
+    engine->Configure(_config);
+    return engine;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  bool SonarEngine::Built(const std::string &_backend)
+  {
+#ifdef NPS_SONAR_WITH_CUDA
+    if (_backend == "gpu")
+      return true;
+#endif
+    return _backend == "cpu";
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngine::Configure(const SonarConfig &_config)
+  {
+    const bool geometryChanged =
+      _config.nBeams != this->config.nBeams ||
+      _config.nRays != this->config.nRays ||
+      _config.raySkips != this->config.raySkips ||
+      _config.nFreq != this->config.nFreq;
+
+    this->config = _config;
+    if (this->config.raySkips < 1)
+      this->config.raySkips = 1;
+    // The deposit kernel must stay shorter than the time series
+    this->config.kernelHalfWidth = std::max(1, std::min(
+      {this->config.kernelHalfWidth, maxKernelHalfWidth,
+       (this->config.nFreq - 2) / 2}));
+
+    // Precalculation
+    this->delta_f = this->config.bandwidth / this->config.nFreq;
+    this->area_scaler = this->config.rayAzimuthAngleWidth
+                        * this->config.rayElevationAngleWidth;
+    const float pref = 1e-6;  // 1 micro pascal (muPa);
+    this->sourceTerm =
+      sqrt(pow(10, (this->config.sourceLevel / 10))) * pref;  // source term
+
+    if (geometryChanged)
+    {
+      this->beamCorrector.assign(
+        static_cast<size_t>(this->config.nBeams) * this->config.nBeams, 0.0f);
+      this->beamCorrectorSum = 0.0;
+      this->correctorBandStart.assign(this->config.nBeams, 0);
+      this->correctorBandEnd.assign(this->config.nBeams, this->config.nBeams);
+      this->Allocate();
+    }
+    else if (this->beamCorrectorSum != 0.0)
+    {
+      // The tolerance may have changed
+      this->UpdateCorrectorBand();
+      this->UpdateBeamCorrector();
+    }
+
+    this->BuildRangeTable();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngine::BuildRangeTable()
+  {
+    this->config.rangeTableSize = std::max(2, this->config.rangeTableSize);
+    const int n = this->config.rangeTableSize;
+    const double spacing = this->config.maxDistance / (n - 1);
+    const double gain = this->sourceTerm * sqrt(this->area_scaler / 2.0);
+
+    this->rangeTable.resize(n);
+    for (int i = 0; i < n; i++)
+      this->rangeTable[i] =
+        gain * exp(-2.0 * this->config.attenuation * i * spacing);
+    this->rangeTableScale = spacing > 0.0 ? 1.0 / spacing : 0.0;
+    this->UpdateRangeTable();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngine::SetBeamCorrector(float **_beamCorrector,
+                                     float _beamCorrectorSum)
+  {
+    const int nBeams = this->config.nBeams;
+    for (int beam = 0; beam < nBeams; beam++)
+      for (int beam_other = 0; beam_other < nBeams; beam_other++)
+        this->beamCorrector[beam_other * nBeams + beam] =
+          _beamCorrector[beam][beam_other];
+    this->beamCorrectorSum = _beamCorrectorSum;
+    this->UpdateCorrectorBand();
+    this->UpdateBeamCorrector();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngine::UpdateCorrectorBand()
+  {
+    const int nBeams = this->config.nBeams;
+    float largest = 0.0;
+    for (const float value : this->beamCorrector)
+      largest = std::max(largest, std::abs(value));
+    const float threshold = this->config.correctorTolerance * largest;
+
+    for (int beam = 0; beam < nBeams; beam++)
+    {
+      int start = 0;
+      int end = nBeams;
+      if (threshold > 0.0)
+      {
+        while (start < beam &&
+               std::abs(this->beamCorrector[start * nBeams + beam]) < threshold)
+          start++;
+        while (end - 1 > beam &&
+               std::abs(this->beamCorrector[(end - 1) * nBeams + beam]) < threshold)
+          end--;
+      }
+      this->correctorBandStart[beam] = start;
+      this->correctorBandEnd[beam] = end;
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void SonarEngine::Compute(const cv::Mat &_depth_image,
+                            const cv::Mat &_normal_image,
+                            const cv::Mat &_rand_image,
+                            const cv::Mat &_reflectivity_image,
+                            BeamRangeBuffer &_P_Beams)
+  {
+    this->ComputeSpectrum(_depth_image, _normal_image, _rand_image,
+                          _reflectivity_image, _P_Beams);
+    this->Transform(_P_Beams);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  const SonarConfig &SonarEngine::Config() const
+  {
+    return this->config;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  const StageTimes &SonarEngine::LastStageTimes() const
+  {
+    return this->stageTimes;
+  }
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/sonar_pipeline.hh>
+
+#include <limits.h>
+#include <math.h>
+
+#include <algorithm>
+#include <complex>
+
+#include <opencv2/imgproc.hpp>
+
+namespace NpsGazeboSonar
+{
+  ///////////////////////////////////////////////////////////////////////////
+  bool RayAngleTable::Update(int _width, int _height, double _hFOV)
+  {
+    if (_width == this->width && _height == this->height
+        && _hFOV == this->hFOV)
+      return false;
+    this->width = _width;
+    this->height = _height;
+    this->hFOV = _hFOV;
+
+    // Pinhole camera, the focal length is set by the horizontal FOV
+    const double fl = static_cast<double>(_width) / (2.0 * tan(_hFOV / 2.0));
+    this->azimuths.resize(_width);
+    this->tanAzimuths.resize(_width);
+    for (int i = 0; i < _width; i++)
+    {
+      const double azimuth = _width > 1 ?
+        atan2(static_cast<double>(i) - 0.5 * static_cast<double>(_width), fl)
+        : 0.0;
+      this->azimuths[i] = static_cast<float>(azimuth);
+      this->tanAzimuths[i] = tan(azimuth);
+    }
+    this->elevations.resize(_height);
+    this->tanElevations.resize(_height);
+    for (int j = 0; j < _height; j++)
+    {
+      const double elevation = _height > 1 ?
+        atan2(static_cast<double>(j) - 0.5 * static_cast<double>(_height), fl)
+        : 0.0;
+      this->elevations[j] = static_cast<float>(elevation);
+      this->tanElevations[j] = tan(elevation);
+    }
+    return true;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  /// \brief Depth derivatives of one pixel, the Sobel taps of the former
+  /// filter2D passes summed in the same order. The products with 1/8 and
+  /// 1/4 are exact, so the sums are bitwise the same.
+  /// \param[in] _up Row above, clamped at the border
+  /// \param[in] _mid Row of the pixel
+  /// \param[in] _down Row below, clamped at the border
+  /// \param[in] _l Column left of the pixel, clamped at the border
+  /// \param[in] _c Column of the pixel
+  /// \param[in] _r Column right of the pixel, clamped at the border
+  /// \param[out] _dy Vertical derivative
+  /// \param[out] _dx Horizontal derivative
+  static inline void Derivatives(const float *_up, const float *_mid,
+                                 const float *_down, int _l, int _c, int _r,
+                                 float &_dy, float &_dx)
+  {
+    _dy = 0.0f;
+    _dy += -0.125f * _up[_l];
+    _dy += -0.25f * _up[_c];
+    _dy += -0.125f * _up[_r];
+    _dy += 0.125f * _down[_l];
+    _dy += 0.25f * _down[_c];
+    _dy += 0.125f * _down[_r];
+
+    _dx = 0.0f;
+    _dx += -0.125f * _up[_l];
+    _dx += 0.125f * _up[_r];
+    _dx += -0.25f * _mid[_l];
+    _dx += 0.25f * _mid[_r];
+    _dx += -0.125f * _down[_l];
+    _dx += 0.125f * _down[_r];
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  cv::Mat ComputeNormalImage(const cv::Mat &_depth, double _focalLength)
+  {
+    const int rows = _depth.rows;
+    const int cols = _depth.cols;
+    const float scale = static_cast<float>(1.0 / _focalLength);
+    cv::Mat normal_image(rows, cols, CV_32FC3);
+
+    // One pass over the depth image, rows are split across the threads.
+    // The former mask of pixels without a reading in their 5x5
+    // neighbourhood is implied: their derivatives and depth are zero, and
+    // so is their normal.
+    #pragma omp parallel
+    {
+      // Components of the normals of a row, one array each so that the
+      // loops below vectorize
+      std::vector<float> row(3 * cols);
+      float *dy = row.data();
+      float *dx = dy + cols;
+      float *dz = dx + cols;
+
+      #pragma omp for schedule(static)
+      for (int i = 0; i < rows; ++i)
+      {
+        const float *up = _depth.ptr<float>(std::max(i - 1, 0));
+        const float *mid = _depth.ptr<float>(i);
+        const float *down = _depth.ptr<float>(std::min(i + 1, rows - 1));
+
+        // Replicated border on the first and last column
+        Derivatives(up, mid, down, 0, 0, std::min(1, cols - 1),
+                    dy[0], dx[0]);
+        #pragma omp simd
+        for (int j = 1; j < cols - 1; ++j)
+          Derivatives(up, mid, down, j - 1, j, j + 1, dy[j], dx[j]);
+        if (cols > 1)
+          Derivatives(up, mid, down, cols - 2, cols - 1, cols - 1,
+                      dy[cols - 1], dx[cols - 1]);
+
+        // NOTE: with different focal lengths, the expression becomes
+        // (-dzx*fy, -dzy*fx, fx*fy)
+        // Normalized as cv::normalize(Vec3f) does: the squares summed in
+        // double, the double length inverted, and a zero vector scaled
+        // by zero
+        float *normals = normal_image.ptr<float>(i);
+        #pragma omp simd
+        for (int j = 0; j < cols; ++j)
+        {
+          dz[j] = scale * mid[j];
+          double norm = 0.0;
+          norm += static_cast<double>(dy[j]) * dy[j];
+          norm += static_cast<double>(dx[j]) * dx[j];
+          norm += static_cast<double>(dz[j]) * dz[j];
+          norm = sqrt(norm);
+          const double inverse = norm != 0.0 ? 1.0 / norm : 0.0;
+          normals[3 * j] = static_cast<float>(dy[j] * inverse);
+          normals[3 * j + 1] = static_cast<float>(dx[j] * inverse);
+          normals[3 * j + 2] = static_cast<float>(dz[j] * inverse);
+        }
+      }
+    }
+    return normal_image;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void QuantizeIntensities(const BeamRangeBuffer &_P_Beams, float _gain,
+                           bool _flipBeams, std::vector<uint8_t> &_intensities)
+  {
+    const int nBeams = _P_Beams.Beams();
+    const int nRanges = _P_Beams.Ranges();
+    _intensities.resize(static_cast<size_t>(nRanges) * nBeams);
+    for (int f = 0; f < nRanges; f++)
+    {
+      const std::complex<float> *P_Range = _P_Beams.Range(f);
+      uint8_t *counts = &_intensities[static_cast<size_t>(f) * nBeams];
+      for (int beam = 0; beam < nBeams; beam++)
+      {
+        // Reversed order flips the data left to right
+        const int beam_idx = _flipBeams ? nBeams - beam - 1 : beam;
+        const int intensity = static_cast<int>(_gain * std::abs(P_Range[beam_idx]));
+        counts[beam] = static_cast<uint8_t>(std::min(UCHAR_MAX, intensity));
+      }
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  cv::Mat RenderFanImage(const BeamRangeBuffer &_P_Beams,
+                         const std::vector<float> &_azimuthAngles,
+                         const std::vector<float> &_ranges,
+                         float _rangeMax, float _plotScaler)
+  {
+    const int nBeams = _P_Beams.Beams();
+
+    // Generate image of CV_8UC1
+    cv::Mat Intensity_image =
+      cv::Mat::zeros(cv::Size(nBeams, _P_Beams.Ranges()), CV_8UC1);
+
+    const float rangeRes = _ranges[1] - _ranges[0];
+    const int nEffectiveRanges = ceil(_rangeMax / rangeRes);
+    const unsigned int radius = Intensity_image.size().height;
+    const cv::Point origin(Intensity_image.size().width/2,
+                           Intensity_image.size().height);
+    const float binThickness = 2 * ceil(radius / nEffectiveRanges);
+
+    struct BearingEntry
+    {
+      float begin, center, end;
+      BearingEntry(float b, float c, float e)
+        : begin(b), center(c), end(e)
+          {;}
+    };
+
+    std::vector<BearingEntry> angles;
+    angles.reserve(nBeams);
+
+    for ( int b = 0; b < nBeams; ++b )
+    {
+      const float center = _azimuthAngles[b];
+      float begin = 0.0, end = 0.0;
+      if (b == 0)
+      {
+        end = (_azimuthAngles[b + 1] + center) / 2.0;
+        begin = 2 * center - end;
+      }
+      else if (b == nBeams - 1)
+      {
+        begin = angles[b - 1].end;
+        end = 2 * center - begin;
+      }
+      else
+      {
+        begin = angles[b - 1].end;
+        end = (_azimuthAngles[b + 1] + center) / 2.0;
+      }
+      angles.push_back(BearingEntry(begin, center, end));
+    }
+
+    const float ThetaShift = 1.5*M_PI;
+    for ( int r = 0; r < _ranges.size(); ++r )
+    {
+      if ( _ranges[r] > _rangeMax ) continue;
+      const std::complex<float> *P_Range = _P_Beams.Range(r);
+      for ( int b = 0; b < nBeams; ++b )
+      {
+        const float range = _ranges[r];
+        const int intensity = floor(10.0*log(std::abs(P_Range[nBeams - 1 - b])));
+        const float begin = angles[b].begin + ThetaShift,
+                    end = angles[b].end + ThetaShift;
+        const float rad = static_cast<float>(radius) * range/_rangeMax;
+        // Assume angles are in image frame x-right, y-down
+        cv::ellipse(Intensity_image, origin, cv::Size(rad, rad), 0.0,
+                    begin * 180.0/M_PI, end * 180.0/M_PI,
+                    intensity, binThickness);
+      }
+    }
+
+    // Normlize and colorize
+    cv::normalize(Intensity_image, Intensity_image,
+                  -255 + _plotScaler/10*255, 255, cv::NORM_MINMAX);
+    cv::Mat Itensity_image_color;
+    cv::applyColorMap(Intensity_image, Itensity_image_color, cv::COLORMAP_HOT);
+    return Itensity_image_color;
+  }
+}  // namespace NpsGazeboSonar
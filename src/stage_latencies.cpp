@@ -0,0 +1,159 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/stage_latencies.hh>
+
+#include <math.h>
+
+#include <algorithm>
+
+namespace NpsGazeboSonar
+{
+  ///////////////////////////////////////////////////////////////////////////
+  const char *StageName(SonarStage _stage)
+  {
+    switch (_stage)
+    {
+      case STAGE_POINT_CLOUD: return "point_cloud";
+      case STAGE_PIPELINE_WAIT: return "pipeline_wait";
+      case STAGE_NORMALS: return "normals";
+      case STAGE_SUMMATION: return "summation";
+      case STAGE_CORRECTION: return "correction";
+      case STAGE_FFT: return "fft";
+      case STAGE_RANGE_MAJOR: return "range_major";
+      case STAGE_RAW_IMAGE: return "raw_image";
+      case STAGE_FAN_IMAGE: return "fan_image";
+      case STAGE_FRAME: return "frame";
+      default: return "unknown";
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  int LatencyHistogram::Bucket(int64_t _ns)
+  {
+    if (_ns < 8)
+      return static_cast<int>(std::max<int64_t>(_ns, 0));
+    // The three bits below the leading one select the bucket of an octave
+    const int octave = 63 - __builtin_clzll(static_cast<uint64_t>(_ns));
+    return (octave - 2) * 8 + static_cast<int>((_ns >> (octave - 3)) & 7);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  int64_t LatencyHistogram::BucketUpperBound(int _bucket)
+  {
+    if (_bucket < 8)
+      return _bucket;
+    const int octave = _bucket / 8 + 2;
+    const int64_t width = static_cast<int64_t>(1) << (octave - 3);
+    return (8 + _bucket % 8) * width + width - 1;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void LatencyHistogram::Record(int64_t _ns)
+  {
+    this->counts[Bucket(_ns)]++;
+    this->count++;
+    this->max = std::max(this->max, _ns);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void LatencyHistogram::Merge(const LatencyHistogram &_other)
+  {
+    for (int b = 0; b < bucketCount; b++)
+      this->counts[b] += _other.counts[b];
+    this->count += _other.count;
+    this->max = std::max(this->max, _other.max);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void LatencyHistogram::Clear()
+  {
+    this->counts.fill(0);
+    this->count = 0;
+    this->max = 0;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  int64_t LatencyHistogram::Percentile(double _q) const
+  {
+    if (this->count == 0)
+      return 0;
+    // Rank of the quantile, 1 based
+    const uint64_t rank = std::max<uint64_t>(1,
+        static_cast<uint64_t>(ceil(_q * static_cast<double>(this->count))));
+    uint64_t seen = 0;
+    for (int b = 0; b < bucketCount; b++)
+    {
+      seen += this->counts[b];
+      if (seen >= rank)
+        return std::min(BucketUpperBound(b), this->max);
+    }
+    return this->max;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  StageLatencies::StageLatencies(int _intervals)
+    : intervals(std::max(1, _intervals))
+  {
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void StageLatencies::Record(SonarStage _stage, int64_t _ns)
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->intervals[this->current][_stage].Record(_ns);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void StageLatencies::Record(SonarStage _stage, Clock::time_point _start)
+  {
+    this->Record(_stage, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           Clock::now() - _start).count());
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void StageLatencies::Rotate()
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->current = (this->current + 1) % this->intervals.size();
+    for (auto &histogram : this->intervals[this->current])
+      histogram.Clear();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  std::vector<StageLatencies::Summary> StageLatencies::Summarize() const
+  {
+    std::array<LatencyHistogram, STAGE_COUNT> window;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      for (const auto &interval : this->intervals)
+        for (int s = 0; s < STAGE_COUNT; s++)
+          window[s].Merge(interval[s]);
+    }
+
+    std::vector<Summary> summaries(STAGE_COUNT);
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+      summaries[s].count = window[s].Count();
+      summaries[s].p50 = window[s].Percentile(0.50);
+      summaries[s].p95 = window[s].Percentile(0.95);
+      summaries[s].p99 = window[s].Percentile(0.99);
+      summaries[s].max = window[s].Max();
+    }
+    return summaries;
+  }
+}  // namespace NpsGazeboSonar
@@ -0,0 +1,304 @@
+/*
+ * Copyright 2020 Naval Postgraduate School
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+*/
+
+#include <nps_uw_multibeam_sonar/trace_recorder.hh>
+#include <nps_uw_multibeam_sonar/sonar_engine.hh>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <set>
+#include <utility>
+
+namespace NpsGazeboSonar
+{
+  /// \brief Spans a ring holds, a power of two
+  static const uint64_t ringSize = 1 << 14;
+
+  /// \brief Interval of the background thread
+  static const std::chrono::milliseconds flushInterval(100);
+
+  ///////////////////////////////////////////////////////////////////////////
+  struct TraceRecorder::ThreadBuffer
+  {
+    /// \brief Spans, written by the owning thread only
+    std::vector<Event> events = std::vector<Event>(ringSize);
+
+    /// \brief Spans written, advanced by the owning thread
+    std::atomic<uint64_t> head{0};
+
+    /// \brief Spans read, advanced by the background thread
+    std::atomic<uint64_t> tail{0};
+
+    /// \brief Spans dropped on a full ring
+    std::atomic<uint64_t> dropped{0};
+
+    /// \brief Kernel thread id
+    int tid = 0;
+
+    /// \brief Thread name
+    std::string name;
+
+    /// \brief Sensors the thread name has been written for
+    std::set<int> namedSensors;
+  };
+
+  ///////////////////////////////////////////////////////////////////////////
+  TraceRecorder::TraceRecorder() = default;
+
+  ///////////////////////////////////////////////////////////////////////////
+  TraceRecorder::~TraceRecorder()
+  {
+    std::lock_guard<std::mutex> startLock(this->startMutex);
+    this->Close();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  std::string TraceRecorder::Start(const std::string &_path)
+  {
+    std::lock_guard<std::mutex> startLock(this->startMutex);
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file)
+    {
+      this->users++;
+      return this->path;
+    }
+    this->file = fopen(_path.c_str(), "w");
+    if (!this->file)
+      return "";
+    this->path = _path;
+    this->users = 1;
+    fputs("[\n", this->file);
+    this->firstEvent = true;
+    // Recorder counters go to process 0, sensors start at 1
+    this->metadata.push_back("{\"name\":\"process_name\",\"ph\":\"M\","
+                             "\"pid\":0,\"args\":{\"name\":\"trace recorder\"}}");
+    this->stopping = false;
+    this->thread = std::thread(&TraceRecorder::Run, this);
+    this->started = true;
+    return this->path;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void TraceRecorder::Stop()
+  {
+    std::lock_guard<std::mutex> startLock(this->startMutex);
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      if (this->users == 0 || --this->users > 0)
+        return;
+    }
+    this->Close();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void TraceRecorder::Close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      if (!this->file)
+        return;
+      this->users = 0;
+      this->started = false;
+      this->stopping = true;
+    }
+    this->condition.notify_all();
+    if (this->thread.joinable())
+      this->thread.join();
+
+    // The background thread is gone, flush what is left
+    this->Flush();
+    std::lock_guard<std::mutex> lock(this->mutex);
+    fputs("\n]\n", this->file);
+    fclose(this->file);
+    this->file = nullptr;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  int TraceRecorder::RegisterSensor(const std::string &_name)
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->file)
+      return -1;
+    const int sensor = static_cast<int>(this->sensors.size());
+    this->sensors.push_back(_name);
+
+    // Each sensor is a process of the trace
+    std::string event = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":";
+    event += std::to_string(sensor + 1) + ",\"args\":{\"name\":\"";
+    for (const char c : _name)
+      if (c != '"' && c != '\\')
+        event += c;
+    event += "\"}}";
+    this->metadata.push_back(event);
+    return sensor;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  int64_t TraceRecorder::Now()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  std::string TraceRecorder::TraceFile(const std::string &_sdfPath)
+  {
+    if (!_sdfPath.empty())
+      return _sdfPath;
+    const char *path = getenv("NPS_SONAR_TRACE");
+    return path ? path : "";
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  TraceRecorder::ThreadBuffer *TraceRecorder::LocalBuffer()
+  {
+    thread_local ThreadBuffer *buffer = nullptr;
+    if (buffer)
+      return buffer;
+
+    std::unique_ptr<ThreadBuffer> created(new ThreadBuffer());
+    created->tid = static_cast<int>(syscall(SYS_gettid));
+    char name[16] = "";
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    created->name = name;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    buffer = created.get();
+    this->buffers.push_back(std::move(created));
+    return buffer;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void TraceRecorder::Record(int _sensor, const char *_name,
+                             int64_t _start, int64_t _end)
+  {
+    if (_sensor < 0 || !this->started.load(std::memory_order_relaxed))
+      return;
+
+    ThreadBuffer *buffer = this->LocalBuffer();
+    const uint64_t head = buffer->head.load(std::memory_order_relaxed);
+    if (head - buffer->tail.load(std::memory_order_acquire) >= ringSize)
+    {
+      buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    buffer->events[head & (ringSize - 1)] = {_name, _sensor, _start, _end};
+    buffer->head.store(head + 1, std::memory_order_release);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void TraceRecorder::Run()
+  {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (!this->stopping)
+    {
+      this->condition.wait_for(lock, flushInterval);
+      lock.unlock();
+      this->Flush();
+      lock.lock();
+    }
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void TraceRecorder::Write(const char *_event)
+  {
+    if (!this->firstEvent)
+      fputs(",\n", this->file);
+    fputs(_event, this->file);
+    this->firstEvent = false;
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void TraceRecorder::Flush()
+  {
+    std::vector<std::string> pending;
+    std::vector<ThreadBuffer *> rings;
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      if (!this->file)
+        return;
+      pending.swap(this->metadata);
+      for (const auto &buffer : this->buffers)
+        rings.push_back(buffer.get());
+    }
+
+    for (const std::string &event : pending)
+      this->Write(event.c_str());
+
+    char event[256];
+    for (ThreadBuffer *buffer : rings)
+    {
+      const uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+      const uint64_t head = buffer->head.load(std::memory_order_acquire);
+      for (uint64_t i = tail; i < head; i++)
+      {
+        const Event &span = buffer->events[i & (ringSize - 1)];
+        if (buffer->namedSensors.insert(span.sensor).second)
+        {
+          snprintf(event, sizeof(event),
+                   "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                   "\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                   span.sensor + 1, buffer->tid, buffer->name.c_str());
+          this->Write(event);
+        }
+        // Complete event, timestamps in microseconds
+        snprintf(event, sizeof(event),
+                 "{\"name\":\"%s\",\"cat\":\"sonar\",\"ph\":\"X\","
+                 "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                 span.name, span.sensor + 1, buffer->tid,
+                 span.start * 1e-3, (span.end - span.start) * 1e-3);
+        this->Write(event);
+      }
+      buffer->tail.store(head, std::memory_order_release);
+
+      const uint64_t dropped = buffer->dropped.exchange(0);
+      if (dropped > 0)
+      {
+        snprintf(event, sizeof(event),
+                 "{\"name\":\"dropped spans\",\"ph\":\"C\",\"pid\":0,"
+                 "\"tid\":%d,\"ts\":%.3f,\"args\":{\"dropped\":%llu}}",
+                 buffer->tid, Now() * 1e-3,
+                 static_cast<unsigned long long>(dropped));
+        this->Write(event);
+      }
+    }
+    fflush(this->file);
+  }
+
+  ///////////////////////////////////////////////////////////////////////////
+  void TraceEngineStages(int _sensor, const StageTimes &_times,
+                         bool _transform)
+  {
+    if (_sensor < 0)
+      return;
+    TraceRecorder &recorder = TraceRecorder::Instance();
+    const int64_t end = TraceRecorder::Now();
+    if (_transform)
+    {
+      recorder.Record(_sensor, "fft", end - _times.fft, end);
+      return;
+    }
+    const int64_t correction = end - _times.correction;
+    recorder.Record(_sensor, "summation",
+                    correction - _times.summation, correction);
+    recorder.Record(_sensor, "correction", correction, end);
+  }
+}  // namespace NpsGazeboSonar